@@ -1152,14 +1152,19 @@ cmd_browse(int argc, char **argv)
             queued->flag = DC_TF_LIST;
             queued->status = DC_QS_QUEUED;
             queued->length = UINT64_MAX; /* UINT64_MAX means that the size is unknown */
+            queued->segmented = NULL;
+            queued->no_leaves = false;
             ptrv_prepend(ui->download_queue, queued);
         } else {
             TRACE(("%s:%d: there is already filelist in download queue\n", __FUNCTION__, __LINE__));
         }
-        if (!has_user_conn(ui, DC_DIR_RECEIVE) && ui->conn_count < DC_USER_MAX_CONN)
+        if (user_conn_wake(ui)) {
+            /* An idle connection downloads it right away. */
+        } else if (!has_user_conn(ui, DC_DIR_RECEIVE) && ui->conn_count < DC_USER_MAX_CONN) {
             hub_connect_user(ui); /* Ignore errors */
-        else
+        } else {
             screen_putf(_("No free connections. Queued file for download.\n"));
+        }
 
         browse_none();
         browse_user = ui;
@@ -1408,7 +1413,9 @@ cmd_retry(int argc, char **argv)
             screen_putf(_("%s: No such user on this hub\n"), quotearg(argv[c]));
             continue;
         }
-        if (!has_user_conn(ui, DC_DIR_RECEIVE) && ui->conn_count < DC_USER_MAX_CONN) {
+        if (user_conn_wake(ui)) {
+            /* An idle connection retries right away. */
+        } else if (!has_user_conn(ui, DC_DIR_RECEIVE) && ui->conn_count < DC_USER_MAX_CONN) {
             hub_connect_user(ui);
         } else {
             screen_putf(_("%s: Already connected to user.\n"), quotearg(ui->nick));
@@ -1472,11 +1479,21 @@ cmd_queue(int argc, char **argv)
                 break;
             }
 
-            screen_putf("%d. (%s) [%s] %s\n",
-                        c+1,
-                        status,
-                        quotearg_n(0, queued->base_path),
-                        quotearg_n(1, queued->filename + strlen(queued->base_path)));
+            if (queued->segmented != NULL) {
+                screen_putf(_("%d. (%s) [%s] %s (%u of %u segments done)\n"),
+                            c+1,
+                            status,
+                            quotearg_n(0, queued->base_path),
+                            quotearg_n(1, queued->filename + strlen(queued->base_path)),
+                            queued->segmented->done_count,
+                            queued->segmented->segment_count);
+            } else {
+                screen_putf("%d. (%s) [%s] %s\n",
+                            c+1,
+                            status,
+                            quotearg_n(0, queued->base_path),
+                            quotearg_n(1, queued->filename + strlen(queued->base_path)));
+            }
         }
     }
 }
@@ -2007,6 +2024,17 @@ append_download_file(DCUserInfo *ui, DCFileList *node, DCFileList *basenode, uin
             queued->flag = DC_TF_NORMAL;
             queued->status = DC_QS_QUEUED;
             queued->length = node->size;
+            queued->segmented = NULL;
+            queued->no_leaves = false;
+            /* Files with a known TTH are downloaded in segments, so
+             * that other users sharing them can be used as sources. */
+            if (node->reg.has_tth && node->size > 0) {
+                char *local_file = resolve_download_file(ui, queued);
+                if (local_file != NULL) {
+                    queued->segmented = segmented_file_get(node->reg.tth, node->size, local_file);
+                    free(local_file);
+                }
+            }
             ptrv_append(ui->download_queue, queued);
         }
 
@@ -2091,7 +2119,9 @@ cmd_get(int argc, char **argv)
     }
 
     if (dl_some && !browsing_myself) {
-        if (!has_user_conn(browse_user, DC_DIR_RECEIVE) && browse_user->conn_count < DC_USER_MAX_CONN) {
+        if (user_conn_wake(browse_user)) {
+            /* An idle connection downloads them right away. */
+        } else if (!has_user_conn(browse_user, DC_DIR_RECEIVE) && browse_user->conn_count < DC_USER_MAX_CONN) {
             hub_connect_user(browse_user); /* Ignore errors */
         } else {
             screen_putf(_("No free connections. Queued files for download.\n"));
@@ -2165,12 +2195,25 @@ cmd_getresult(int argc, char **argv)
 
     DCFileList *node_ptr = path_to_node(translate_remote_to_local(sr->filename), sr->filetype);
     node_ptr->size = sr->filesize;
+    /* The hub name field of file results holds the TTH. */
+    if (strncmp(sr->hub_name, "TTH:", 4) == 0 && strlen(sr->hub_name + 4) >= DC_TTH_LENGTH) {
+        node_ptr->reg.has_tth = 1;
+        memcpy(node_ptr->reg.tth, sr->hub_name + 4, DC_TTH_LENGTH);
+    }
     
     uint64_t byte_count = 0;
     uint32_t file_count = 0;
+    uint32_t c;
     
     append_download_file(sr->userinfo, node_ptr, node_ptr->parent, &file_count, &byte_count);
-    if (!has_user_conn(sr->userinfo, DC_DIR_RECEIVE) && sr->userinfo->conn_count < DC_USER_MAX_CONN) {
+    /* Other results for the same file are sources for it as well. */
+    for (c = 0; c < sd->responses->cur; c++) {
+        if (sd->responses->buf[c] != sr)
+            segmented_file_search_result(sd->responses->buf[c]);
+    }
+    if (user_conn_wake(sr->userinfo)) {
+        /* An idle connection downloads them right away. */
+    } else if (!has_user_conn(sr->userinfo, DC_DIR_RECEIVE) && sr->userinfo->conn_count < DC_USER_MAX_CONN) {
         hub_connect_user(sr->userinfo); /* Ignore errors */
     } else {
         screen_putf(_("No free connections. Queued files for download.\n"));
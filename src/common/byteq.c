@@ -227,6 +227,22 @@ byteq_write(ByteQ *bq, int fd)
     return res;
 }
 
+/* Write at most len bytes from the start of the queue. */
+ssize_t
+byteq_write_upto(ByteQ *bq, int fd, size_t len)
+{
+    ssize_t res;
+
+    res = write(fd, bq->buf, MIN(len, bq->cur));
+    if (res > 0) {
+        bq->cur -= res;
+        if (bq->cur > 0)
+            memmove(bq->buf, bq->buf + res, bq->cur);
+    }
+
+    return res;
+}
+
 /* Should make sure the queue is non-empty prior to calling this. */
 ssize_t
 byteq_full_write(ByteQ *bq, int fd)
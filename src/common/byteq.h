@@ -50,6 +50,7 @@ ssize_t byteq_full_read(ByteQ *bq, int fd);
 ssize_t byteq_read_upto(ByteQ *bq, int fd, size_t len);
 ssize_t byteq_full_read_upto(ByteQ *bq, int fd, size_t len);
 ssize_t byteq_write(ByteQ *bq, int fd);
+ssize_t byteq_write_upto(ByteQ *bq, int fd, size_t len);
 ssize_t byteq_full_write(ByteQ *bq, int fd);
 void byteq_clear(ByteQ *bq);
 ssize_t byteq_sendto(ByteQ *bq, int fd, int flags, const struct sockaddr *to, socklen_t tolen);
@@ -37,9 +37,33 @@ msgq_new(int fd)
     MsgQ *mq = xmalloc(sizeof(MsgQ));
     mq->fd = fd;
     mq->queue = byteq_new(DEFAULT_MSGQ_BYTEQ_SIZE);
+    mq->flush = NULL;
+    mq->flush_data = NULL;
     return mq;
 }
 
+/* A loopback queue has no file descriptor. Messages stay in the
+ * queue until the reader picks them up in the same process. The
+ * synchronous functions call the flush callback instead of writing,
+ * so that the reader can consume what was put. Without a flush
+ * callback the reader is considered gone, and writes fail with EPIPE.
+ */
+MsgQ *
+msgq_new_loopback(MsgQFlushCallback flush, void *data)
+{
+    MsgQ *mq = msgq_new(-1);
+    mq->flush = flush;
+    mq->flush_data = data;
+    return mq;
+}
+
+void
+msgq_set_flush(MsgQ *mq, MsgQFlushCallback flush, void *data)
+{
+    mq->flush = flush;
+    mq->flush_data = data;
+}
+
 void
 msgq_free(MsgQ *mq)
 {
@@ -61,6 +85,14 @@ int
 msgq_write_all(MsgQ *mq)
 {
     int cur = mq->queue->cur;
+    if (mq->fd < 0) {
+        if (mq->flush == NULL) {
+            errno = EPIPE;
+            return -1;
+        }
+        mq->flush(mq->flush_data);
+        return 1;
+    }
     if (byteq_full_write(mq->queue, mq->fd) < cur)
         return -1;
     return 1;
@@ -81,6 +113,13 @@ msgq_read_complete_msg(MsgQ *mq)
     size_t size;
     int res;
 
+    /* A loopback queue is only read when a complete message is there.
+     * Anything else means that the writer has gone away. */
+    if (mq->fd < 0) {
+        errno = 0;
+        return msgq_has_complete_msg(mq) ? 1 : 0;
+    }
+
     if (mq->queue->cur < sizeof(size)) {
         res = byteq_full_read_upto(mq->queue, mq->fd, sizeof(size));
         if (res < sizeof(size))
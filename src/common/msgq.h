@@ -36,14 +36,20 @@ typedef enum {
     MSGQ_STRARY		/* char ** (terminated by NULL entry) */
 } MsgQType;
 
+typedef void (*MsgQFlushCallback)(void *data);
+
 struct _MsgQ {
     int fd;
     ByteQ *queue;
+    MsgQFlushCallback flush;	/* loopback queues only (fd < 0) */
+    void *flush_data;
 };
 
 typedef struct _MsgQ MsgQ;
 
 MsgQ *msgq_new(int fd);
+MsgQ *msgq_new_loopback(MsgQFlushCallback flush, void *data);
+void msgq_set_flush(MsgQ *mq, MsgQFlushCallback flush, void *data);
 void msgq_free(MsgQ *mq);
 ssize_t msgq_read(MsgQ *mq);
 ssize_t msgq_write(MsgQ *mq);
@@ -0,0 +1,133 @@
+/* ratelimit.c - Token bucket rate limiting
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <config.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/param.h>
+#include "ratelimit.h"
+
+/* A bucket holds this much time worth of data, but never less than
+ * RATELIMIT_MIN_BURST bytes so that low rates still allow reasonably
+ * sized writes.
+ */
+#define RATELIMIT_BURST_NSECS	(200*1000*1000ULL)
+#define RATELIMIT_MIN_BURST	4096
+#define NSECS_PER_SEC		(1000*1000*1000ULL)
+
+/* This is the generic cell rate algorithm, which is equivalent to a
+ * token bucket. Instead of a token count, the time when the bucket
+ * would be full again (tat) is stored. That only needs a single
+ * compare-and-swap to update.
+ */
+
+static uint64_t
+monotonic_nsecs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts); /* cannot fail */
+    return (uint64_t) ts.tv_sec * NSECS_PER_SEC + ts.tv_nsec;
+}
+
+static uint64_t
+burst_nsecs(uint64_t rate)
+{
+    return MAX(RATELIMIT_BURST_NSECS, RATELIMIT_MIN_BURST * NSECS_PER_SEC / rate);
+}
+
+void
+ratelimit_init(RateLimit *rl, uint64_t rate)
+{
+    rl->tat = 0;
+    rl->rate = rate;
+}
+
+void
+ratelimit_set_rate(RateLimit *rl, uint64_t rate)
+{
+    __atomic_store_n(&rl->rate, rate, __ATOMIC_RELAXED);
+}
+
+uint64_t
+ratelimit_get_rate(RateLimit *rl)
+{
+    return __atomic_load_n(&rl->rate, __ATOMIC_RELAXED);
+}
+
+/* Return how many bytes, at most max, that may be transferred now.
+ */
+size_t
+ratelimit_available(RateLimit *rl, size_t max)
+{
+    uint64_t rate = ratelimit_get_rate(rl);
+    uint64_t now;
+    uint64_t tat;
+    uint64_t limit;
+
+    if (rate == 0)
+        return max;
+    now = monotonic_nsecs();
+    limit = now + burst_nsecs(rate);
+    tat = MAX(now, __atomic_load_n(&rl->tat, __ATOMIC_RELAXED));
+    if (tat >= limit)
+        return 0;
+    return MIN(max, (limit - tat) * rate / NSECS_PER_SEC);
+}
+
+/* Account for count bytes that have been transferred. This always
+ * succeeds - if several users of the same limit raced past it, later
+ * users will have to wait longer.
+ */
+void
+ratelimit_consume(RateLimit *rl, size_t count)
+{
+    uint64_t rate = ratelimit_get_rate(rl);
+    uint64_t now;
+    uint64_t tat;
+
+    if (rate == 0)
+        return;
+    now = monotonic_nsecs();
+    tat = __atomic_load_n(&rl->tat, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&rl->tat, &tat, MAX(tat, now) + count * NSECS_PER_SEC / rate,
+                                        false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/* Return the number of milliseconds until count bytes may be
+ * transferred.
+ */
+uint64_t
+ratelimit_delay(RateLimit *rl, size_t count)
+{
+    uint64_t rate = ratelimit_get_rate(rl);
+    uint64_t now;
+    uint64_t ready;
+
+    if (rate == 0)
+        return 0;
+    now = monotonic_nsecs();
+    ready = __atomic_load_n(&rl->tat, __ATOMIC_RELAXED) + count * NSECS_PER_SEC / rate;
+    ready -= MIN(ready, burst_nsecs(rate));
+    if (ready <= now)
+        return 0;
+    return (ready - now + 999999) / 1000000;
+}
@@ -0,0 +1,43 @@
+/* ratelimit.h - Token bucket rate limiting
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef COMMON_RATELIMIT_H
+#define COMMON_RATELIMIT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* The state is a single word that is updated atomically, so a RateLimit
+ * may be placed in memory shared between processes.
+ */
+typedef struct _RateLimit RateLimit;
+
+struct _RateLimit {
+    uint64_t tat;	/* theoretical arrival time, in monotonic nanoseconds */
+    uint64_t rate;	/* bytes per second, or 0 for unlimited */
+};
+
+void ratelimit_init(RateLimit *rl, uint64_t rate);
+void ratelimit_set_rate(RateLimit *rl, uint64_t rate);
+uint64_t ratelimit_get_rate(RateLimit *rl);
+size_t ratelimit_available(RateLimit *rl, size_t max);
+void ratelimit_consume(RateLimit *rl, size_t count);
+uint64_t ratelimit_delay(RateLimit *rl, size_t count);
+
+#endif
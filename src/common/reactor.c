@@ -0,0 +1,666 @@
+/* reactor.c - File descriptor event dispatching
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <config.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/param.h>
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#else
+#include <poll.h>
+#endif
+#include "xalloc.h"		/* Gnulib */
+#include "error.h"
+#include "reactor.h"
+
+#define REACTOR_READ	1
+#define REACTOR_WRITE	2
+#define MAX_EVENTS	64
+
+/* Timers are kept in a hierarchical timing wheel: TIMER_LEVELS wheels
+ * of TIMER_SLOTS slots each, the first with a resolution of one tick
+ * and each following one TIMER_SLOTS times coarser. Timers further
+ * away than the wheels can hold are parked in the last slot and
+ * re-added when they come up.
+ */
+#define TIMER_TICK_MS	10
+#define TIMER_BITS	6
+#define TIMER_SLOTS	(1 << TIMER_BITS)
+#define TIMER_MASK	(TIMER_SLOTS - 1)
+#define TIMER_LEVELS	4
+#define TIMER_RANGE	((uint64_t) 1 << (TIMER_BITS * TIMER_LEVELS))
+
+typedef struct _ReactorWatch ReactorWatch;
+
+struct _ReactorWatch {
+    uint32_t mask;              /* REACTOR_READ and/or REACTOR_WRITE */
+    uint32_t generation;        /* Bumped each time the fd is dropped */
+    bool always_ready;          /* Not pollable (e.g. a regular file) */
+    ReactorCallback read_cb;
+    void *read_data;
+    ReactorCallback write_cb;
+    void *write_data;
+};
+
+struct _ReactorTimer {
+    ReactorTimer *next;         /* NULL if not pending */
+    ReactorTimer *prev;
+    uint64_t expires;           /* In ticks */
+    Reactor *reactor;
+    ReactorCallback callback;
+    void *data;
+};
+
+struct _Reactor {
+    ReactorWatch *watches;      /* Indexed by file descriptor */
+    int watches_max;
+    uint64_t now;               /* Milliseconds, updated on each wakeup */
+    uint64_t tick;              /* Next tick to run timers for */
+    uint32_t timer_count;
+    ReactorTimer wheel[TIMER_LEVELS][TIMER_SLOTS];
+#if defined(__linux__)
+    int epfd;
+    int always_ready_count;
+    int timerfd;
+    uint64_t timerfd_expires;   /* In ticks, 0 if disarmed */
+#else
+    struct pollfd *pollfds;
+    uint32_t *pollgens;
+    int pollfds_max;
+#endif
+};
+
+static uint64_t
+monotonic_msecs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts); /* cannot fail */
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+#if defined(__linux__)
+static void
+timerfd_readable(Reactor *r)
+{
+    uint64_t expirations;
+
+    /* Just reset readiness, the timers are run after every wakeup. */
+    if (read(r->timerfd, &expirations, sizeof(expirations)) < 0) {
+        /* EAGAIN if the timer was re-armed in between. Ignore. */
+    }
+}
+#endif
+
+Reactor *
+reactor_new(void)
+{
+    Reactor *r = xmalloc(sizeof(Reactor));
+    int c;
+    int d;
+
+#if defined(__linux__)
+    r->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (r->epfd < 0) {
+        free(r);
+        return NULL;
+    }
+    r->always_ready_count = 0;
+#else
+    r->pollfds = NULL;
+    r->pollgens = NULL;
+    r->pollfds_max = 0;
+#endif
+    r->watches = NULL;
+    r->watches_max = 0;
+    r->now = monotonic_msecs();
+    r->tick = r->now / TIMER_TICK_MS;
+    r->timer_count = 0;
+    for (c = 0; c < TIMER_LEVELS; c++) {
+        for (d = 0; d < TIMER_SLOTS; d++) {
+            r->wheel[c][d].next = &r->wheel[c][d];
+            r->wheel[c][d].prev = &r->wheel[c][d];
+        }
+    }
+#if defined(__linux__)
+    /* If no timerfd can be created, the wait timeout is used instead. */
+    r->timerfd_expires = 0;
+    r->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+    if (r->timerfd >= 0)
+        reactor_watch_read(r, r->timerfd, (ReactorCallback) timerfd_readable, r);
+#endif
+    return r;
+}
+
+/* Free the reactor. The file descriptors being watched are not touched,
+ * and timers still pending are left for their owners to free.
+ * This is also what a forked child should call on the reactor it
+ * inherited: the epoll instance is shared with the parent, so the
+ * child must not modify it - only drop its reference.
+ */
+void
+reactor_free(Reactor *r)
+{
+    if (r != NULL) {
+#if defined(__linux__)
+        if (r->timerfd >= 0)
+            close(r->timerfd);
+        close(r->epfd);
+#else
+        free(r->pollfds);
+        free(r->pollgens);
+#endif
+        free(r->watches);
+        free(r);
+    }
+}
+
+static ReactorWatch *
+reactor_get_watch(Reactor *r, int fd)
+{
+    assert(fd >= 0);
+    if (fd >= r->watches_max) {
+        int newmax = r->watches_max == 0 ? 64 : r->watches_max;
+
+        while (newmax <= fd)
+            newmax *= 2;
+        r->watches = xrealloc(r->watches, newmax * sizeof(ReactorWatch));
+        memset(r->watches + r->watches_max, 0, (newmax - r->watches_max) * sizeof(ReactorWatch));
+        r->watches_max = newmax;
+    }
+    return &r->watches[fd];
+}
+
+/* Update the kernel's (or our own) view of the events for fd after
+ * w->mask has changed from oldmask.
+ */
+static void
+reactor_update(Reactor *r, int fd, ReactorWatch *w, uint32_t oldmask)
+{
+#if defined(__linux__)
+    struct epoll_event ev;
+    int op;
+
+    if (w->mask == oldmask)
+        return;
+    if (w->mask == 0) {
+        op = EPOLL_CTL_DEL;
+    } else if (oldmask == 0) {
+        op = EPOLL_CTL_ADD;
+    } else {
+        op = EPOLL_CTL_MOD;
+    }
+    memset(&ev, 0, sizeof(ev));
+    if (w->mask & REACTOR_READ)
+        ev.events |= EPOLLIN;
+    if (w->mask & REACTOR_WRITE)
+        ev.events |= EPOLLOUT;
+    ev.data.u64 = ((uint64_t) w->generation << 32) | (uint32_t) fd;
+    if (w->always_ready) {
+        if (w->mask == 0) {
+            w->always_ready = false;
+            r->always_ready_count--;
+        }
+    } else if (epoll_ctl(r->epfd, op, fd, &ev) < 0) {
+        /* Regular files cannot be added to an epoll set, but like
+         * with select they are always ready for I/O. Removing fails if
+         * fd was closed before it was unwatched, which is harmless.
+         * Other failures, such as running out of memory, leave fd
+         * unwatched.
+         */
+        if (op == EPOLL_CTL_ADD && errno == EPERM) {
+            w->always_ready = true;
+            r->always_ready_count++;
+        } else if (op != EPOLL_CTL_DEL) {
+            warn("Cannot watch file descriptor %d - %s\n", fd, errstr);
+            if (op == EPOLL_CTL_MOD)
+                epoll_ctl(r->epfd, EPOLL_CTL_DEL, fd, &ev);
+            w->mask = 0;
+            w->read_cb = NULL;
+            w->write_cb = NULL;
+        }
+    }
+#endif
+    if (w->mask == 0)
+        w->generation++;
+}
+
+void
+reactor_watch_read(Reactor *r, int fd, ReactorCallback callback, void *data)
+{
+    ReactorWatch *w = reactor_get_watch(r, fd);
+    uint32_t oldmask = w->mask;
+
+    w->read_cb = callback;
+    w->read_data = data;
+    w->mask |= REACTOR_READ;
+    reactor_update(r, fd, w, oldmask);
+}
+
+void
+reactor_watch_write(Reactor *r, int fd, ReactorCallback callback, void *data)
+{
+    ReactorWatch *w = reactor_get_watch(r, fd);
+    uint32_t oldmask = w->mask;
+
+    w->write_cb = callback;
+    w->write_data = data;
+    w->mask |= REACTOR_WRITE;
+    reactor_update(r, fd, w, oldmask);
+}
+
+void
+reactor_unwatch_read(Reactor *r, int fd)
+{
+    ReactorWatch *w;
+    uint32_t oldmask;
+
+    if (fd < 0 || fd >= r->watches_max)
+        return;
+    w = &r->watches[fd];
+    oldmask = w->mask;
+    w->mask &= ~REACTOR_READ;
+    reactor_update(r, fd, w, oldmask);
+}
+
+void
+reactor_unwatch_write(Reactor *r, int fd)
+{
+    ReactorWatch *w;
+    uint32_t oldmask;
+
+    if (fd < 0 || fd >= r->watches_max)
+        return;
+    w = &r->watches[fd];
+    oldmask = w->mask;
+    w->mask &= ~REACTOR_WRITE;
+    reactor_update(r, fd, w, oldmask);
+}
+
+bool
+reactor_is_watched(Reactor *r, int fd)
+{
+    return fd >= 0 && fd < r->watches_max && r->watches[fd].mask != 0;
+}
+
+/* Call the callbacks of one ready file descriptor. The write callback
+ * is called before the read callback, so that a non-blocking connect()
+ * is seen to complete before any data arriving on the socket.
+ * Callbacks may unwatch or close any descriptor, including this one,
+ * so the watch is re-checked against the generation the event was
+ * reported for before each call.
+ */
+static void
+reactor_fire(Reactor *r, int fd, uint32_t generation, bool readable, bool writable)
+{
+    ReactorWatch *w;
+
+    w = &r->watches[fd];
+    if (writable && w->generation == generation && (w->mask & REACTOR_WRITE))
+        w->write_cb(w->write_data);
+    w = &r->watches[fd]; /* r->watches may have been reallocated */
+    if (readable && w->generation == generation && (w->mask & REACTOR_READ))
+        w->read_cb(w->read_data);
+}
+
+static void
+timer_link(Reactor *r, ReactorTimer *t)
+{
+    uint64_t expires = MAX(t->expires, r->tick);
+    uint64_t delta = expires - r->tick;
+    ReactorTimer *head;
+    int level;
+
+    if (delta >= TIMER_RANGE) {
+        expires = r->tick + TIMER_RANGE - 1;
+        delta = TIMER_RANGE - 1;
+    }
+    for (level = 0; level < TIMER_LEVELS-1; level++) {
+        if (delta < ((uint64_t) 1 << (TIMER_BITS * (level+1))))
+            break;
+    }
+    head = &r->wheel[level][(expires >> (TIMER_BITS * level)) & TIMER_MASK];
+    t->next = head;
+    t->prev = head->prev;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+static void
+timer_unlink(ReactorTimer *t)
+{
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = NULL;
+    t->prev = NULL;
+}
+
+/* Move the timers of the current slot in the given level one level
+ * down. Returns the slot index, which is 0 when the next level up
+ * needs to be cascaded as well.
+ */
+static int
+timer_cascade(Reactor *r, int level)
+{
+    int index = (r->tick >> (TIMER_BITS * level)) & TIMER_MASK;
+    ReactorTimer *head = &r->wheel[level][index];
+
+    while (head->next != head) {
+        ReactorTimer *t = head->next;
+        timer_unlink(t);
+        timer_link(r, t);
+    }
+    return index;
+}
+
+static void
+run_timers(Reactor *r)
+{
+    uint64_t now_tick = r->now / TIMER_TICK_MS;
+
+    while (r->timer_count > 0 && r->tick <= now_tick) {
+        int index = r->tick & TIMER_MASK;
+        ReactorTimer *head = &r->wheel[0][index];
+        uint64_t tick;
+
+        if (index == 0) {
+            int level;
+            for (level = 1; level < TIMER_LEVELS; level++) {
+                if (timer_cascade(r, level) != 0)
+                    break;
+            }
+        }
+        tick = r->tick++;
+        /* A callback may add and cancel timers, including ones in this
+         * slot. New timers land in later slots since r->tick has been
+         * advanced.
+         */
+        while (head->next != head) {
+            ReactorTimer *t = head->next;
+            timer_unlink(t);
+            if (t->expires > tick) {
+                timer_link(r, t); /* parked beyond the wheel range */
+            } else {
+                r->timer_count--;
+                t->callback(t->data);
+            }
+        }
+    }
+    if (r->timer_count == 0)
+        r->tick = now_tick + 1;
+}
+
+/* Find the tick of the earliest pending timer. For each level, the
+ * first non-empty slot from the current position holds the earliest
+ * timers of that level.
+ */
+static bool
+next_timer_expiry(Reactor *r, uint64_t *expires)
+{
+    bool found = false;
+    int level;
+
+    if (r->timer_count == 0)
+        return false;
+    for (level = 0; level < TIMER_LEVELS; level++) {
+        int start = (r->tick >> (TIMER_BITS * level)) & TIMER_MASK;
+        int c;
+
+        for (c = (level == 0 ? 0 : 1); c <= TIMER_SLOTS; c++) {
+            ReactorTimer *head = &r->wheel[level][(start + c) & TIMER_MASK];
+            ReactorTimer *t;
+
+            if (head->next == head)
+                continue;
+            for (t = head->next; t != head; t = t->next) {
+                if (!found || t->expires < *expires) {
+                    *expires = t->expires;
+                    found = true;
+                }
+            }
+            break;
+        }
+    }
+    /* Timers that are overdue are run on the next tick. */
+    if (found && *expires < r->tick)
+        *expires = r->tick;
+    return found;
+}
+
+/* Make sure we wake up in time for the next timer, either by arming
+ * the timerfd or by shortening timeout. Returns the new timeout.
+ */
+static int
+arm_timers(Reactor *r, int timeout)
+{
+    uint64_t expires;
+    uint64_t expires_ms;
+
+    if (!next_timer_expiry(r, &expires)) {
+#if defined(__linux__)
+        if (r->timerfd >= 0 && r->timerfd_expires != 0) {
+            struct itimerspec its;
+            memset(&its, 0, sizeof(its));
+            timerfd_settime(r->timerfd, 0, &its, NULL);
+            r->timerfd_expires = 0;
+        }
+#endif
+        return timeout;
+    }
+    expires_ms = expires * TIMER_TICK_MS;
+#if defined(__linux__)
+    if (r->timerfd >= 0) {
+        if (r->timerfd_expires != expires) {
+            struct itimerspec its;
+
+            memset(&its, 0, sizeof(its));
+            its.it_value.tv_sec = expires_ms / 1000;
+            its.it_value.tv_nsec = (expires_ms % 1000) * 1000000;
+            if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+                its.it_value.tv_nsec = 1;
+            if (timerfd_settime(r->timerfd, TFD_TIMER_ABSTIME, &its, NULL) == 0) {
+                r->timerfd_expires = expires;
+                return timeout;
+            }
+        } else {
+            return timeout;
+        }
+    }
+#endif
+    if (expires_ms <= r->now) {
+        timeout = 0;
+    } else if (timeout < 0 || expires_ms - r->now < timeout) {
+        timeout = MIN(expires_ms - r->now, INT_MAX);
+    }
+    return timeout;
+}
+
+/* Wait for events and dispatch them to the watchers. */
+static int
+reactor_wait(Reactor *r, int timeout)
+{
+#if defined(__linux__)
+    struct epoll_event events[MAX_EVENTS];
+    int c;
+    int count;
+
+    if (r->always_ready_count > 0)
+        timeout = 0;
+    count = epoll_wait(r->epfd, events, MAX_EVENTS, timeout);
+    r->now = monotonic_msecs();
+    if (count < 0)
+        return count;
+    for (c = 0; c < count; c++) {
+        int fd = (int) (events[c].data.u64 & 0xFFFFFFFF);
+        uint32_t generation = events[c].data.u64 >> 32;
+        /* Errors and hangups are reported as readiness so that the
+         * callback's read or write sees and handles the condition.
+         */
+        bool err = (events[c].events & (EPOLLERR|EPOLLHUP)) != 0;
+
+        reactor_fire(r, fd, generation,
+                     err || (events[c].events & EPOLLIN),
+                     err || (events[c].events & EPOLLOUT));
+    }
+    for (c = 0; r->always_ready_count > 0 && c < r->watches_max; c++) {
+        ReactorWatch *w = &r->watches[c];
+        if (w->always_ready) {
+            reactor_fire(r, c, w->generation, true, true);
+            count++;
+        }
+    }
+    return count;
+#else
+    int c;
+    int count;
+    int nfds = 0;
+
+    for (c = 0; c < r->watches_max; c++) {
+        if (r->watches[c].mask != 0)
+            nfds++;
+    }
+    if (nfds > r->pollfds_max) {
+        r->pollfds_max = nfds;
+        r->pollfds = xrealloc(r->pollfds, nfds * sizeof(struct pollfd));
+        r->pollgens = xrealloc(r->pollgens, nfds * sizeof(uint32_t));
+    }
+    nfds = 0;
+    for (c = 0; c < r->watches_max; c++) {
+        ReactorWatch *w = &r->watches[c];
+        if (w->mask != 0) {
+            r->pollfds[nfds].fd = c;
+            r->pollfds[nfds].events = 0;
+            r->pollfds[nfds].revents = 0;
+            if (w->mask & REACTOR_READ)
+                r->pollfds[nfds].events |= POLLIN;
+            if (w->mask & REACTOR_WRITE)
+                r->pollfds[nfds].events |= POLLOUT;
+            r->pollgens[nfds] = w->generation;
+            nfds++;
+        }
+    }
+
+    count = poll(r->pollfds, nfds, timeout);
+    r->now = monotonic_msecs();
+    if (count <= 0)
+        return count;
+    for (c = 0; c < nfds; c++) {
+        short revents = r->pollfds[c].revents;
+        bool err = (revents & (POLLERR|POLLHUP|POLLNVAL)) != 0;
+
+        if (revents != 0) {
+            reactor_fire(r, r->pollfds[c].fd, r->pollgens[c],
+                         err || (revents & POLLIN),
+                         err || (revents & POLLOUT));
+        }
+    }
+    return count;
+#endif
+}
+
+/* Wait at most timeout milliseconds (-1 meaning forever, unless there
+ * are pending timers) for events, and dispatch them along with any
+ * timers that have expired. Returns the number of ready file descriptors,
+ * or -1 on error (errno is set, and may be EINTR).
+ */
+int
+reactor_dispatch(Reactor *r, int timeout)
+{
+    int count;
+
+    count = reactor_wait(r, arm_timers(r, timeout));
+    if (count >= 0)
+        run_timers(r);
+    return count;
+}
+
+/* Return the time of the last wakeup, in milliseconds from an arbitrary
+ * starting point. This is cheaper than asking the system each time.
+ */
+uint64_t
+reactor_now(Reactor *r)
+{
+    return r->now;
+}
+
+ReactorTimer *
+reactor_timer_new(Reactor *r, ReactorCallback callback, void *data)
+{
+    ReactorTimer *t = xmalloc(sizeof(ReactorTimer));
+
+    t->next = NULL;
+    t->prev = NULL;
+    t->expires = 0;
+    t->reactor = r;
+    t->callback = callback;
+    t->data = data;
+    return t;
+}
+
+void
+reactor_timer_free(ReactorTimer *t)
+{
+    if (t != NULL) {
+        reactor_timer_cancel(t);
+        free(t);
+    }
+}
+
+/* Arm the timer to go off msecs milliseconds from the last wakeup.
+ * A pending timer is rescheduled. Timers are one-shot, the callback
+ * may re-arm the timer to make it periodic.
+ */
+void
+reactor_timer_set(ReactorTimer *t, uint64_t msecs)
+{
+    Reactor *r = t->reactor;
+
+    if (t->next != NULL) {
+        timer_unlink(t);
+    } else {
+        r->timer_count++;
+    }
+    /* Round up - timers never fire early. */
+    t->expires = (r->now + msecs + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    timer_link(r, t);
+}
+
+void
+reactor_timer_cancel(ReactorTimer *t)
+{
+    if (t->next != NULL) {
+        timer_unlink(t);
+        t->reactor->timer_count--;
+    }
+}
+
+bool
+reactor_timer_pending(ReactorTimer *t)
+{
+    return t->next != NULL;
+}
@@ -0,0 +1,47 @@
+/* reactor.h - File descriptor event dispatching
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef COMMON_REACTOR_H
+#define COMMON_REACTOR_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct _Reactor Reactor;
+typedef struct _ReactorTimer ReactorTimer;
+
+typedef void (*ReactorCallback)(void *data);
+
+Reactor *reactor_new(void);
+void reactor_free(Reactor *r);
+void reactor_watch_read(Reactor *r, int fd, ReactorCallback callback, void *data);
+void reactor_watch_write(Reactor *r, int fd, ReactorCallback callback, void *data);
+void reactor_unwatch_read(Reactor *r, int fd);
+void reactor_unwatch_write(Reactor *r, int fd);
+bool reactor_is_watched(Reactor *r, int fd);
+int reactor_dispatch(Reactor *r, int timeout);
+uint64_t reactor_now(Reactor *r);
+
+ReactorTimer *reactor_timer_new(Reactor *r, ReactorCallback callback, void *data);
+void reactor_timer_free(ReactorTimer *t);
+void reactor_timer_set(ReactorTimer *t, uint64_t msecs);
+void reactor_timer_cancel(ReactorTimer *t);
+bool reactor_timer_pending(ReactorTimer *t);
+
+#endif
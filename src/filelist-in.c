@@ -330,6 +330,9 @@ parse_main(int request_fd[2], int result_fd[2])
     close(result_fd[0]);
     request_mq = msgq_new(request_fd[0]);
     result_mq = msgq_new(result_fd[1]);
+    /* The epoll set is shared with the main process. */
+    reactor_free(main_reactor);
+    main_reactor = NULL;
 
     /* Inability to register these signals is not a fatal error. */
     sigact.sa_flags = SA_RESTART;
@@ -400,7 +403,7 @@ parse_request_fd_writable(void)
         return;
     }
     if (!msgq_has_partial_msg(parse_request_mq))
-        FD_CLR(parse_request_mq->fd, &write_fds);
+        reactor_unwatch_write(main_reactor, parse_request_mq->fd);
 }
 
 void
@@ -464,7 +467,7 @@ add_parse_request(DCFileListParseCallback callback, const char *filename, void *
     DCFileListParse *parse;
 
     msgq_put(parse_request_mq, MSGQ_STR, filename, MSGQ_STR, hub_charset ? hub_charset : "", MSGQ_END);
-    FD_SET(parse_request_mq->fd, &write_fds);
+    reactor_watch_write(main_reactor, parse_request_mq->fd, (ReactorCallback) parse_request_fd_writable, NULL);
 
     parse = xmalloc(sizeof(DCFileListParse));
     parse->callback = callback;
@@ -504,7 +507,7 @@ file_list_parse_init(void)
     close(result_fd[1]);
     parse_request_mq = msgq_new(request_fd[1]);
     parse_result_mq = msgq_new(result_fd[0]);
-    FD_SET(parse_result_mq->fd, &read_fds);
+    reactor_watch_read(main_reactor, parse_result_mq->fd, (ReactorCallback) parse_result_fd_readable, NULL);
     return true;
 }
 
@@ -516,10 +519,12 @@ file_list_parse_finish(void)
         ptrv_free(pending_parses);
     }
     if (parse_request_mq != NULL) {
+        reactor_unwatch_write(main_reactor, parse_request_mq->fd);
         close(parse_request_mq->fd);
         msgq_free(parse_request_mq);
     }
     if (parse_result_mq != NULL) {
+        reactor_unwatch_read(main_reactor, parse_result_mq->fd);
         close(parse_result_mq->fd);
         msgq_free(parse_result_mq);
     }
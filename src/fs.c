@@ -50,6 +50,7 @@
 #include "common/comparison.h"
 #include "iconvme.h"
 #include "microdc.h"
+#include "tth/tth_sidecar.h"
 
 //#define _TRACE
 #if defined(_TRACE)
@@ -135,11 +136,13 @@ new_file_node(const char *name, DCFileType type, DCFileList *parent)
     case DC_TYPE_DIR:
         node->dir.real_path = NULL;
         node->dir.children = hmap_new();
+        node->dir.dev = 0;
         break;
     case DC_TYPE_REG:
         node->reg.has_tth = false;
         memset(node->reg.tth, 0, sizeof(node->reg.tth));
         node->reg.mtime = 0;
+        node->reg.location = 0;
         /* No more operation at the moment! */
         break;
     }
@@ -515,9 +518,8 @@ dir_to_filelist(DCFileList *parent, const char *path)
 {
     struct dirent *ep;
     DIR *dp;
-    /*
-    char* tth_path = NULL;
-    */
+    PtrV *entries;
+    uint32_t c;
 
     dp = opendir(path);
     if (dp == NULL) {
@@ -527,14 +529,18 @@ dir_to_filelist(DCFileList *parent, const char *path)
 
     parent->dir.real_path = xstrdup(path);
 
-    /*
-    tth_path = catfiles(path, tth_directory_name);
-    */
+    entries = xreaddir_by_inode(dp);
+    if (errno != 0)
+        screen_putf(_("%s: Cannot read directory - %s\n"), quotearg(path), errstr);
+    if (closedir(dp) < 0)
+        screen_putf(_("%s: Cannot close directory - %s\n"), quotearg(path), errstr);
 
-    while ((ep = xreaddir(dp)) != NULL) {
+    for (c = 0; c < entries->cur; c++) {
         struct stat st;
         char *fullname;
 
+        ep = entries->buf[c];
+
         if (IS_SPECIAL_DIR(ep->d_name))
             continue;
 
@@ -552,10 +558,9 @@ dir_to_filelist(DCFileList *parent, const char *path)
             parent->size += node->size;
         }
         else if (S_ISREG(st.st_mode)) {
-            /*
-            char *tth_fname = NULL;
-            int tth_fd = -1;
-            */
+            char tth[TTH_SIDECAR_ROOT_LENGTH+1];
+            char *tthl;
+            size_t tthl_size;
             DCFileList *node = new_file_node(ep->d_name, DC_TYPE_REG, parent);
             node->size = st.st_size;
             node->reg.has_tth = 0;
@@ -563,26 +568,12 @@ dir_to_filelist(DCFileList *parent, const char *path)
             node->reg.mtime = st.st_mtime;
             parent->size += node->size;
 
-            /*
-            tth_fname = xasprintf("%s%s%s%s", tth_path, tth_path[0] == '\0' || tth_path[strlen(tth_path)-1] == '/' ? "" : "/", ep->d_name, ".tth");
-            //flag_putf(DC_DF_DEBUG, _("Opening TTH file <%s> for <%s>\n"), tth_fname, ep->d_name);
-            tth_fd = open(tth_fname, O_RDONLY);
-            if (tth_fd >= 0) {
-                uint64_t fsize;
-                time_t mtime, ctime;
-                char tth[39];
-                if (read(tth_fd, &fsize, sizeof(fsize)) == sizeof(fsize) && st.st_size == fsize &&
-                    read(tth_fd, &mtime, sizeof(mtime)) == sizeof(mtime) && st.st_mtime == mtime &&
-                    read(tth_fd, &ctime, sizeof(ctime)) == sizeof(ctime) && st.st_ctime == ctime &&
-                    read(tth_fd, tth, sizeof(tth)) == sizeof(tth)) {
-                    node->reg.has_tth = 1;
-                    memcpy(node->reg.tth, tth, sizeof(node->reg.tth));
-                    //fprintf(stderr, "File <%s> has TTH\n", ep->d_name);
-                }
-                close(tth_fd);
+            /* Files may have been hashed ahead of time with tthsum. */
+            if (tth_sidecar_read(fullname, &st, tth, &tthl, &tthl_size) == 0) {
+                node->reg.has_tth = 1;
+                memcpy(node->reg.tth, tth, sizeof(node->reg.tth));
+                free(tthl);
             }
-            free(tth_fname);
-            */
         }
         else {
             screen_putf(_("%s: Not a regular file or directory, ignoring\n"), quotearg(fullname));
@@ -590,13 +581,8 @@ dir_to_filelist(DCFileList *parent, const char *path)
         free(fullname);
     }
 
-    /*
-    free(tth_path);
-    */
-    if (errno != 0)
-        screen_putf(_("%s: Cannot read directory - %s\n"), quotearg(path), errstr);
-    if (closedir(dp) < 0)
-        screen_putf(_("%s: Cannot close directory - %s\n"), quotearg(path), errstr);
+    ptrv_foreach(entries, free);
+    ptrv_free(entries);
 }
 
 static void
@@ -833,13 +819,16 @@ resolve_upload_file(DCUserInfo *ui, DCAdcgetType ul_type, const char *name, DCTr
                 || strcmp(name, "/files.xml") == 0 || strcmp(name, "/files.xml.bz2") == 0
 #endif
            ) {
-            char* filename = catfiles(listing_dir, name);
+            char* filename = catfiles(listing_dir, name+1);
             if (flag != NULL) {
                 *flag = DC_TF_LIST;
             }
             if (size != NULL) {
+                DCFileListBuffer *buffer = file_list_buffer_lookup(filename);
                 struct stat st;
-                if (stat(filename, &st) == 0) {
+                if (buffer != NULL) {
+                    *size = buffer->size;
+                } else if (stat(filename, &st) == 0) {
                     *size = st.st_size;
                 } else {
                     *size = 0;
@@ -860,31 +849,24 @@ resolve_upload_file(DCUserInfo *ui, DCAdcgetType ul_type, const char *name, DCTr
     if (node == NULL)
         return NULL;
     if (ul_type == DC_ADCGET_TTHL) {
-        return NULL;
-        /*
-        	StrBuf *sb;
-
-        	sb = strbuf_new();
-
-        	strbuf_append_char(sb, '/');
-        	strbuf_append(sb, tth_directory_name);
-        	if ( tth_directory_name[strlen(tth_directory_name) - 1] != '/' )
-        	    strbuf_append_char(sb, '/');
-        	strbuf_append(sb, node->name);
-        	strbuf_append(sb, ".tth");
-
-        	node = node->parent;
-        	while (node != NULL) {
-        	    strbuf_prepend(sb, node->name);
-        	    strbuf_prepend_char(sb, '/');
-        	    node = node->parent;
-        	}
-
-        	strbuf_prepend(sb, share_dir);
-
-        	return strbuf_free_to_string(sb);
-        */
+        /* Leaves are served from the file saved when the file was hashed. */
+        char *filename;
+        struct stat st;
 
+        if (!node->reg.has_tth)
+            return NULL;
+        filename = tthl_filename(node->reg.tth);
+        if (stat(filename, &st) < 0) {
+            free(filename);
+            return NULL;
+        }
+        if (flag != NULL) {
+            *flag = DC_TF_NORMAL;
+        }
+        if (size != NULL) {
+            *size = st.st_size;
+        }
+        return filename;
     } else {
         if (flag != NULL) {
             *flag = DC_TF_NORMAL;
@@ -22,9 +22,17 @@
 #include <unistd.h>
 #include <signal.h>
 #include <errno.h>
+#include <string.h>
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <sys/stat.h>
+#include <fcntl.h>
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#endif
 
 #include "gettext.h"            /* Gnulib/GNU gettext */
 #define _(s) gettext(s)
@@ -35,12 +43,61 @@
 #include "common/byteq.h"
 #include "common/ptrv.h"
 #include "microdc.h"
+#include "tth_file.h"
 
 #include "tth/tth.h"
 
-MsgQ *hash_request_mq = NULL;
-MsgQ *hash_result_mq = NULL;
-pid_t hash_child;
+/* While a file is hashed, the leaves hashed so far are saved this often
+ * (in seconds), and progress is reported this often. */
+#define HASH_CHECKPOINT_INTERVAL 60
+#define HASH_PROGRESS_INTERVAL 2
+
+/* From linux/ioprio.h, which is not installed everywhere. */
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_NONE 0
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+
+typedef struct _HashProgress HashProgress;
+
+struct _HashProgress {
+    MsgQ *result_mq;
+    struct stat st;
+    time_t last_checkpoint;
+    time_t last_progress;
+    bool stopped;		/* the updater has gone away */
+};
+
+static int64_t
+timeval_usec(const struct timeval *tv)
+{
+    return (int64_t) tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+/* Called by tth_resume for each leaf hashed. If the updater is gone,
+ * the leaves hashed so far are saved so that hashing can resume from
+ * there the next time. */
+static int
+hash_progress(HashProgress *hp, off_t done, const char *tthl, size_t tthl_len)
+{
+    time_t now = time(NULL);
+
+    if (now - hp->last_progress >= HASH_PROGRESS_INTERVAL) {
+        hp->last_progress = now;
+        msgq_put(hp->result_mq, MSGQ_INT, DC_HASH_PROGRESS, MSGQ_INT64, (int64_t) done, MSGQ_END);
+        if (msgq_write_all(hp->result_mq) < 0) {
+            if (done < hp->st.st_size)
+                tth_checkpoint_save(&hp->st, done, tthl, tthl_len);
+            hp->stopped = true;
+            return 1;
+        }
+    }
+    if (now - hp->last_checkpoint >= HASH_CHECKPOINT_INTERVAL && done < hp->st.st_size) {
+        hp->last_checkpoint = now;
+        tth_checkpoint_save(&hp->st, done, tthl, tthl_len);
+    }
+    return 0;
+}
 
 static void
 __attribute__((noreturn))
@@ -69,9 +126,19 @@ hash_main(int request_fd[2], int result_fd[2])
 
     while (msgq_read_complete_msg(request_mq) > 0) {
         char *filename, *hash;
+        char *tthl = NULL;
+        size_t tthl_size = 0;
         struct stat st;
+        struct timeval start, end;
+        struct rusage start_usage, end_usage;
+        int64_t elapsed_usec = 0, cpu_usec = 0;
+        HashProgress hp;
+        off_t done = 0;
+        char *done_tthl = NULL;
+        size_t done_tthl_size = 0;
 
         msgq_get(request_mq, MSGQ_STR, &filename, MSGQ_END);
+        memset(&st, 0, sizeof(st));
 
         /*
         fprintf(stderr, "HASH: begin processing %s\n", filename);
@@ -81,11 +148,28 @@ hash_main(int request_fd[2], int result_fd[2])
         if (stat(filename, &st) < 0) {
             hash = xasprintf("FAILED");
         } else {
-            char* tthl = NULL;
-            size_t tthl_size;
-            hash = tth(filename, &tthl, &tthl_size);
-            if (tthl != NULL)
-                free(tthl);
+            /* Whether hashing waits for the disk or for the CPU shows in
+             * how much of the time the CPU was busy. */
+            gettimeofday(&start, NULL);
+            getrusage(RUSAGE_SELF, &start_usage);
+            hp.result_mq = result_mq;
+            hp.st = st;
+            hp.last_checkpoint = hp.last_progress = start.tv_sec;
+            hp.stopped = false;
+            tth_checkpoint_load(&st, &done, &done_tthl, &done_tthl_size);
+            hash = tth_resume(filename, &tthl, &tthl_size, done, done_tthl, done_tthl_size,
+                              (TTHProgressCallback) hash_progress, &hp);
+            free(done_tthl);
+            if (hp.stopped)
+                break;
+            /* A file that could not be hashed is hashed from the start
+             * if it is tried again. */
+            tth_checkpoint_remove(&st);
+            gettimeofday(&end, NULL);
+            getrusage(RUSAGE_SELF, &end_usage);
+            elapsed_usec = timeval_usec(&end) - timeval_usec(&start);
+            cpu_usec = timeval_usec(&end_usage.ru_utime) + timeval_usec(&end_usage.ru_stime)
+                     - timeval_usec(&start_usage.ru_utime) - timeval_usec(&start_usage.ru_stime);
         }
 
         /*
@@ -93,8 +177,14 @@ hash_main(int request_fd[2], int result_fd[2])
         fflush(stderr);
         */
 
-        msgq_put(result_mq, MSGQ_STR, hash, MSGQ_END);
+        /* The leaves are saved by the file list updater. The status of
+         * the file that was hashed tells it whether the file has changed
+         * since. */
+        msgq_put(result_mq, MSGQ_INT, DC_HASH_RESULT, MSGQ_STR, hash, MSGQ_BLOB, tthl, tthl_size,
+                 MSGQ_INT64, (int64_t) st.st_size, MSGQ_INT64, (int64_t) st.st_mtime, MSGQ_INT64, (int64_t) st.st_ctime,
+                 MSGQ_INT64, elapsed_usec, MSGQ_INT64, cpu_usec, MSGQ_END);
         free(hash);
+        free(tthl);
         if (msgq_write_all(result_mq) < 0) {
             /*
             fprintf(stderr, "HASH: msgq_write_all error: %d, %s\n", errno, errstr);
@@ -117,48 +207,130 @@ hash_main(int request_fd[2], int result_fd[2])
     exit(EXIT_SUCCESS);
 }
 
-bool
-hash_init(void)
+/* Put the I/O of a hashing process in the idle class, so that it reads
+ * from a disk only when no other process does, or back in the class that
+ * follows from its nice value. Failure is not an error: the process then
+ * just competes with uploads for the disk.
+ */
+static void
+set_io_priority(pid_t pid, bool idle)
+{
+#if defined(__linux__) && defined(__NR_ioprio_set)
+    int class = idle ? IOPRIO_CLASS_IDLE : IOPRIO_CLASS_NONE;
+    syscall(__NR_ioprio_set, IOPRIO_WHO_PROCESS, pid, class << IOPRIO_CLASS_SHIFT);
+#endif
+}
+
+void
+hash_worker_set_idle_io(DCHashWorker *worker, bool idle)
+{
+    set_io_priority(worker->pid, idle);
+}
+
+/* Return a number that orders files by where they start on their device.
+ * This is the physical offset of the first extent where the file system
+ * tells it, and the inode number otherwise, since inodes are mostly
+ * allocated close to the data of their files.
+ */
+uint64_t
+file_disk_location(const char *filename, const struct stat *st)
+{
+#if defined(__linux__) && defined(FS_IOC_FIEMAP)
+    struct {
+        struct fiemap map;
+        struct fiemap_extent extent;
+    } fm;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+    if (fd >= 0) {
+        memset(&fm, 0, sizeof(fm));
+        fm.map.fm_start = 0;
+        fm.map.fm_length = FIEMAP_MAX_OFFSET;
+        fm.map.fm_extent_count = 1;
+        if (ioctl(fd, FS_IOC_FIEMAP, &fm.map) == 0 && fm.map.fm_mapped_extents > 0
+                && fm.extent.fe_physical != 0) {
+            close(fd);
+            return fm.extent.fe_physical;
+        }
+        close(fd);
+    }
+#endif
+    return st->st_ino;
+}
+
+/* Start a hashing process. others are the workers already running,
+ * whose pipes are closed in the new process so that each worker sees
+ * the end of its requests when it is freed.
+ */
+DCHashWorker *
+hash_worker_new(PtrV *others)
 {
+    DCHashWorker *worker;
     int request_fd[2];
     int result_fd[2];
+    pid_t child;
+    uint32_t c;
 
-    if (pipe(request_fd) != 0 || pipe(result_fd) != 0) {
+    if (pipe(request_fd) != 0) {
+        warn(_("Cannot create pipe pair - %s\n"), errstr);
+        return NULL;
+    }
+    if (pipe(result_fd) != 0) {
         warn(_("Cannot create pipe pair - %s\n"), errstr);
-        return false;
+        close(request_fd[0]);
+        close(request_fd[1]);
+        return NULL;
     }
     if (!fd_set_nonblock_flag(request_fd[1], true)
             || !fd_set_nonblock_flag(result_fd[0], true)) {
         warn(_("Cannot set non-blocking flag - %s\n"), errstr);
-        return false;
+        goto cleanup;
     }
 
-    hash_child = fork();
-    if (hash_child < 0) {
+    child = fork();
+    if (child < 0) {
         warn(_("Cannot create process - %s\n"), errstr);
-        return false;
+        goto cleanup;
     }
-    if (hash_child == 0) {
+    if (child == 0) {
+        for (c = 0; c < others->cur; c++) {
+            DCHashWorker *other = others->buf[c];
+            close(other->request_mq->fd);
+            close(other->result_mq->fd);
+        }
         setpriority(PRIO_PROCESS, 0, 16);
+        set_io_priority(0, hash_idle_io);
         hash_main(request_fd, result_fd);
     }
 
     close(request_fd[0]);
     close(result_fd[1]);
-    hash_request_mq = msgq_new(request_fd[1]);
-    hash_result_mq = msgq_new(result_fd[0]);
-    return true;
+    worker = xmalloc(sizeof(DCHashWorker));
+    worker->pid = child;
+    worker->request_mq = msgq_new(request_fd[1]);
+    worker->result_mq = msgq_new(result_fd[0]);
+    worker->hashing = NULL;
+    worker->dev = 0;
+    worker->discard = false;
+    worker->userdata = NULL;
+    return worker;
+
+cleanup:
+    close(request_fd[0]);
+    close(request_fd[1]);
+    close(result_fd[0]);
+    close(result_fd[1]);
+    return NULL;
 }
 
+/* Stop a worker. The process exits once it has read all requests. */
 void
-hash_finish(void)
+hash_worker_free(DCHashWorker *worker)
 {
-    if (hash_request_mq != NULL) {
-        close(hash_request_mq->fd);
-        msgq_free(hash_request_mq);
-    }
-    if (hash_result_mq != NULL) {
-        close(hash_result_mq->fd);
-        msgq_free(hash_result_mq);
-    }
+    close(worker->request_mq->fd);
+    msgq_free(worker->request_mq);
+    close(worker->result_mq->fd);
+    msgq_free(worker->result_mq);
+    free(worker);
 }
@@ -33,6 +33,7 @@
 #include "xalloc.h"		/* Gnulib */
 #include "quotearg.h"		/* Gnulib */
 #include "memmem.h"		/* Gnulib */
+#include "minmax.h"		/* Gnulib */
 #include "gettext.h"		/* Gnulib/GNU gettext */
 #define _(s) gettext(s)
 #define N_(s) gettext_noop(s)
@@ -66,10 +67,12 @@ bool   hub_connected = false;
 time_t hub_activity_check_interval = 150;
 time_t hub_reconnect_interval = 10;
 time_t hub_last_activity = 0;
+static ReactorTimer *hub_activity_timer = NULL;
 
 void hub_set_connected(bool state)
 {
     hub_connected = state;
+    schedule_hub_activity_check();
 }
 
 void update_hub_activity()
@@ -77,7 +80,7 @@ void update_hub_activity()
     hub_last_activity = time(NULL);
 }
 
-void check_hub_activity()
+static void check_hub_activity()
 {
     if (hub_connected) {
         time_t now = time(NULL);
@@ -94,6 +97,28 @@ void check_hub_activity()
             }
         }
     }
+    schedule_hub_activity_check();
+}
+
+/* Arm the timer for the next keep-alive or reconnection attempt.
+ * Activity on the hub connection only updates hub_last_activity; the
+ * timer catches up with it when it goes off.
+ */
+void schedule_hub_activity_check()
+{
+    time_t next;
+
+    if (hub_activity_timer == NULL)
+        hub_activity_timer = reactor_timer_new(main_reactor, (ReactorCallback) check_hub_activity, NULL);
+    if (hub_connected && hub_state == DC_HUB_LOGGED_IN) {
+        next = hub_last_activity + hub_activity_check_interval;
+    } else if (hub_connected && hub_state == DC_HUB_DISCONNECTED && auto_reconnect) {
+        next = hub_last_activity + hub_reconnect_interval;
+    } else {
+        reactor_timer_cancel(hub_activity_timer);
+        return;
+    }
+    reactor_timer_set(hub_activity_timer, MAX(next - time(NULL), 0) * 1000);
 }
 
 void hub_reconnect()
@@ -236,6 +261,8 @@ free_queued_file(DCQueuedFile *qf)
 {
     free(qf->filename);
     free(qf->base_path);
+    if (qf->segmented != NULL)
+        segmented_file_unref(qf->segmented);
     free(qf);
 }
 
@@ -284,7 +311,7 @@ hub_putf(const char *format, ...)
     }
 
     if (oldcur == 0 && hub_sendq->cur > 0)
-        FD_SET(hub_socket, &write_fds);
+        reactor_watch_write(main_reactor, hub_socket, (ReactorCallback) hub_now_writable, NULL);
 
     update_hub_activity();
 
@@ -362,7 +389,7 @@ hub_connect(struct sockaddr_in *addr)
 
     if (&hub_addr != addr)
         hub_addr = *addr;
-    FD_SET(hub_socket, &write_fds);
+    reactor_watch_write(main_reactor, hub_socket, (ReactorCallback) hub_now_writable, NULL);
     hub_state = DC_HUB_CONNECT;
 }
 
@@ -376,8 +403,8 @@ hub_disconnect(void)
         hub_lookup = NULL;
     }
     if (hub_socket >= 0) {
-        FD_CLR(hub_socket, &read_fds);
-        FD_CLR(hub_socket, &write_fds);
+        reactor_unwatch_read(main_reactor, hub_socket);
+        reactor_unwatch_write(main_reactor, hub_socket);
         if (close(hub_socket) < 0)
             warn(_("Cannot close socket - %s\n"), errstr);
         hub_socket = -1;
@@ -402,6 +429,7 @@ hub_disconnect(void)
     hub_extensions = 0;
     hub_state = DC_HUB_DISCONNECTED;
     update_hub_activity();
+    schedule_hub_activity_check();
 }
 
 static bool
@@ -559,6 +587,7 @@ hub_handle_command(char *buf, uint32_t len)
                 goto hub_handle_command_cleanup;
 
             hub_state = DC_HUB_LOGGED_IN;
+            schedule_hub_activity_check();
         } else {
             flag_putf(DC_DF_JOIN_PART, _("User %s logged in.\n"), quotearg(conv_nick));
             ui = user_info_new(conv_nick);
@@ -1057,8 +1086,8 @@ hub_now_writable(void)
         screen_putf(_("Connected to hub from %s.\n"), sockaddr_in_str(&local_addr));
         update_hub_activity();
 
-        FD_CLR(hub_socket, &write_fds);
-        FD_SET(hub_socket, &read_fds);
+        reactor_unwatch_write(main_reactor, hub_socket);
+        reactor_watch_read(main_reactor, hub_socket, (ReactorCallback) hub_input_available, NULL);
         hub_state = DC_HUB_LOCK;
     } else {
         int res;
@@ -1072,7 +1101,7 @@ hub_now_writable(void)
             }
         }
         if (hub_sendq->cur == 0)
-            FD_CLR(hub_socket, &write_fds);
+            reactor_unwatch_write(main_reactor, hub_socket);
     }
 }
 
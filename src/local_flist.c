@@ -21,11 +21,13 @@
 #include "human.h"		/* Gnulib */
 #include "minmax.h"		/* Gnulib */
 #include "dirname.h"		/* Gnulib */
+#include "quotearg.h"		/* Gnulib */
 
 #include "common/msgq.h"
 #include "common/byteq.h"
 
 #include "microdc.h"
+#include "tth/tth_sidecar.h"
 
 //#define _TRACE
 #if defined(_TRACE)
@@ -34,13 +36,6 @@
 #define TRACE(x)
 #endif
 
-/* hash.c */
-extern MsgQ *hash_request_mq;
-extern MsgQ *hash_result_mq;
-extern pid_t hash_child;
-bool hash_init(void);
-void hash_finish(void);
-
 typedef enum {
     FILELIST_UPDATE_COMPLETE = 0,       /* RESPONSE ONLY      complete filelist - we have to replace the previous one (if any) with a new one */
     FILELIST_UPDATE_ADD_DIR_NAME,       /* REQUEST/RESPONSE   insert the new shared directory to the directory list */
@@ -52,6 +47,10 @@ typedef enum {
     FILELIST_UPDATE_HUB_CHARSET,        /* REQUEST ONLY       main application informs about hub_charset change */
     FILELIST_UPDATE_FS_CHARSET,         /* REQUEST ONLY       main application informs about fs_charset change */
     FILELIST_UPDATE_REFRESH_INTERVAL,   /* REQUEST ONLY       main application informs about filelist_refresh_timeout change */
+    FILELIST_UPDATE_HASH_WORKERS,       /* REQUEST ONLY       main application informs about hash_workers change */
+    FILELIST_UPDATE_HASH_SIDECARS,      /* REQUEST ONLY       main application informs about hash_sidecars change */
+    FILELIST_UPDATE_HASH_IDLE_IO,       /* REQUEST ONLY       main application informs about hash_idle_io change */
+    FILELIST_UPDATE_HASHED,             /* RESPONSE ONLY      report how fast a file was hashed to the main application */
 
     FILELIST_UPDATE_INSERT,	            /* RESPONSE ONLY NOT USED     add new entries to the existing filelist */
     FILELIST_UPDATE_DELETE,             /* RESPONSE ONLY NOT USED     delete the entries from the existing filelist */
@@ -60,6 +59,9 @@ typedef enum {
 
 time_t    filelist_refresh_timeout = 600;
 time_t    filelist_hash_refresh_timeout = 600;
+uint32_t  hash_workers = 4;
+bool      hash_sidecars = false;
+bool      hash_idle_io = true;
 
 MsgQ *update_request_mq = NULL;
 MsgQ *update_result_mq = NULL;
@@ -67,6 +69,10 @@ pid_t update_child;
 int   incoming_update_type = -1;
 char* update_status = NULL;
 
+/* The file lists published last, one for each format. */
+static DCFileListBuffer *published_lists[3] = { NULL, NULL, NULL };
+static uint32_t published_generation = 0;
+
 static const char* filelist_name = "filelist";
 static const char* new_filelist_name = "new-filelist";
 static const char* filelist_prefix = "new-";
@@ -216,63 +222,151 @@ fs_to_main_filelist(DCFileList* node)
     }
 }
 
+/* State of the update process. */
+typedef struct _DCFileListUpdater DCFileListUpdater;
+
+struct _DCFileListUpdater {
+    Reactor *reactor;
+    ReactorTimer *refresh_timer;
+    MsgQ *request_mq;
+    MsgQ *result_mq;
+    PtrV *hash_files;
+    PtrV *hash_workers;
+    uint32_t hashing;	/* number of workers hashing a file */
+    time_t hash_start;
+    bool update_hash;
+    bool running;
+    DCFileList *root;
+    char *flist_filename;
+    char *new_flist_filename;
+    int update_type;
+};
+
+/* True if worker is hashing a file, or a file that has been removed
+ * from the share and whose result is to be dropped. */
+static bool
+hash_worker_busy(DCHashWorker *worker)
+{
+    return worker->hashing != NULL || worker->discard;
+}
+
+/* True if node is top or in the tree below it. */
 static bool
-lookup_filelist_changes(DCFileList* node, PtrV* hash_files)
+file_node_within(DCFileList *node, DCFileList *top)
 {
+    for (; node != NULL; node = node->parent) {
+        if (node == top)
+            return true;
+    }
+    return false;
+}
+
+/* Free node, which has been removed from the file list, and everything
+ * below it. The files are removed from the hash queue first, and workers
+ * hashing them drop their results.
+ */
+static void
+free_file_node(DCFileListUpdater *upd, DCFileList *node)
+{
+    uint32_t c, d;
+
+    for (c = d = 0; c < upd->hash_files->cur; c++) {
+        if (!file_node_within(upd->hash_files->buf[c], node))
+            upd->hash_files->buf[d++] = upd->hash_files->buf[c];
+    }
+    upd->hash_files->cur = d;
+    for (c = 0; c < upd->hash_workers->cur; c++) {
+        DCHashWorker *worker = upd->hash_workers->buf[c];
+
+        if (worker->hashing != NULL && file_node_within(worker->hashing, node)) {
+            worker->hashing = NULL;
+            worker->discard = true;
+        }
+    }
+    filelist_free(node);
+}
+
+/* Queue the file node for hashing, unless it has been hashed before and
+ * its root is in the cache, or it was hashed ahead of time and has a
+ * sidecar. st is the status of the file. Returns true if the root was
+ * found or the file was queued.
+ */
+static bool
+queue_hash_file(DCFileList* node, const struct stat* st, PtrV* hash_files)
+{
+    const char* tth = tth_cache_lookup(st);
+    char root[TTH_SIDECAR_ROOT_LENGTH+1];
+    char* filename;
+    char* tthl;
+    size_t tthl_size;
+
+    if (tth != NULL && has_tthl(tth)) {
+        memcpy(node->reg.tth, tth, sizeof(node->reg.tth));
+        node->reg.has_tth = 1;
+        return true;
+    }
+
+    /* The leaves are only in newer sidecars. Without them the root is
+     * still used, but the leaves cannot be served. */
+    filename = catfiles(node->parent->dir.real_path, node->name);
+    if (tth_sidecar_read(filename, st, root, &tthl, &tthl_size) == 0) {
+        if (tthl != NULL && (has_tthl(root) || save_tthl(root, tthl, tthl_size)))
+            tth_cache_add(st, root);
+        memcpy(node->reg.tth, root, sizeof(node->reg.tth));
+        node->reg.has_tth = 1;
+        free(tthl);
+        free(filename);
+        return true;
+    }
+
+    if (ptrv_find(hash_files, node, (comparison_fn_t)compare_pointers) < 0) {
+        node->reg.location = file_disk_location(filename, st);
+        ptrv_append(hash_files, node);
+        free(filename);
+        return true;
+    }
+    free(filename);
+    return false;
+}
+
+/* Order of the hash queue: by device, then by where the files start on
+ * the device, so that each disk is read from one end to the other. */
+static int
+hash_file_compare(const DCFileList **n1, const DCFileList **n2)
+{
+    COMPARE_RETURN((*n1)->parent->dir.dev, (*n2)->parent->dir.dev);
+    COMPARE_RETURN((*n1)->reg.location, (*n2)->reg.location);
+    return 0;
+}
+
+static bool
+lookup_filelist_changes(DCFileListUpdater *upd, DCFileList* node)
+{
+    PtrV* hash_files = upd->hash_files;
     struct stat st;
     bool result = false; /* initially no chages detected */
     HMapIterator it;
     if (node->type == DC_TYPE_DIR) {
         if (node->dir.real_path != NULL) {
             PtrV* deleted = NULL;
+            HMap* seen = hmap_new();
+            uint32_t c;
             int i;
 
             struct dirent *ep = NULL;
             DIR *dp = NULL;
+            PtrV* entries = NULL;
 
-            hmap_iterator(node->dir.children, &it);
-            while (it.has_next(&it)) {
-                DCFileList *child = it.next(&it);
-                char* fullname = catfiles(node->dir.real_path, child->name);
-                if (stat(fullname, &st) < 0) {
-                    if (errno == ENOENT) {
-                        /*
-                            file was removed
-                            we have to delete from the file list
-                        */
-                        if (deleted == NULL) {
-                            deleted = ptrv_new();
-                        }
-
-                        ptrv_append(deleted, child->name);
-
-                    }
-                }
-                free(fullname);
-            }
-            if (deleted != NULL) {
-                for (i = 0; i < deleted->cur; i++) {
-                    DCFileList* child = hmap_remove(node->dir.children, (const char*)deleted->buf[i]);
-                    node->size -= child->size;
-
-                    /*
-                    TRACE((stderr, "removing 0x%08X (%s)\n", child, child == NULL ? "null" : child->name));
-                    */
-
-                    filelist_free(child);
-                    result = true;
-                }
-                ptrv_free(deleted);
-                deleted = NULL;
-            }
-
-            /* now we are looking for new items */
+            /* look for new and changed items, stat'ing them in inode order */
             dp = opendir(node->dir.real_path);
             if (dp != NULL) {
-                while ((ep = xreaddir(dp)) != NULL) {
+                entries = xreaddir_by_inode(dp);
+                closedir(dp);
+                for (c = 0; c < entries->cur; c++) {
                     char* fullname;
                     DCFileList* child;
 
+                    ep = entries->buf[c];
                     if (IS_SPECIAL_DIR(ep->d_name))
                         continue;
 
@@ -284,8 +378,11 @@ lookup_filelist_changes(DCFileList* node, PtrV* hash_files)
                         free(fullname);
                         continue;
                     }
+                    hmap_put(seen, ep->d_name, ep);
 
                     child = hmap_get(node->dir.children, ep->d_name);
+                    if (S_ISREG(st.st_mode))
+                        node->dir.dev = st.st_dev;
 
                     if (child != NULL) {
                         if (child->type == DC_TYPE_REG) {
@@ -293,14 +390,16 @@ lookup_filelist_changes(DCFileList* node, PtrV* hash_files)
                                 child->reg.has_tth = false;
                                 child->reg.mtime = st.st_mtime;
                                 child->size = st.st_size;
-                                if (ptrv_find(hash_files, child, (comparison_fn_t)compare_pointers) < 0) {
-                                    ptrv_append(hash_files, child);
+                                if (queue_hash_file(child, &st, hash_files))
                                     result = true;
-                                }
-                            } else if (child->reg.has_tth == 0) {
-                                if (ptrv_find(hash_files, child, (comparison_fn_t)compare_pointers) < 0) {
-                                    ptrv_append(hash_files, child);
-                                }
+                            } else if (child->reg.has_tth == 0 || !has_tthl(child->reg.tth)) {
+                                /* Files hashed before leaves were saved are hashed again. */
+                                bool had_tth = child->reg.has_tth;
+                                if (queue_hash_file(child, &st, hash_files) && !had_tth && child->reg.has_tth)
+                                    result = true;
+                            } else {
+                                /* Files hashed before the cache existed are added to it. */
+                                tth_cache_add(&st, child->reg.tth);
                             }
                         }
                     } else {
@@ -317,14 +416,8 @@ lookup_filelist_changes(DCFileList* node, PtrV* hash_files)
                             memset(child->reg.tth, 0, sizeof(child->reg.tth));
                             child->reg.mtime = st.st_mtime;
 
-                            if (ptrv_find(hash_files, child, (comparison_fn_t)compare_pointers) < 0) {
-                                ptrv_append(hash_files, child);
-                                /*
-                                TRACE(stderr, "adding %s for hashing\n", fullname);
-                                */
-                            } else {
+                            if (!queue_hash_file(child, &st, hash_files))
                                 assert(false);
-                            }
 
                         }
                     }
@@ -332,7 +425,52 @@ lookup_filelist_changes(DCFileList* node, PtrV* hash_files)
                         free(fullname);
 
                 }
-                closedir(dp);
+            }
+
+            /* items that were not found above may have been removed */
+            hmap_iterator(node->dir.children, &it);
+            while (it.has_next(&it)) {
+                DCFileList *child = it.next(&it);
+                char* fullname;
+
+                if (hmap_contains_key(seen, child->name))
+                    continue;
+                fullname = catfiles(node->dir.real_path, child->name);
+                if (stat(fullname, &st) < 0) {
+                    if (errno == ENOENT) {
+                        /*
+                            file was removed
+                            we have to delete from the file list
+                        */
+                        if (deleted == NULL) {
+                            deleted = ptrv_new();
+                        }
+
+                        ptrv_append(deleted, child->name);
+
+                    }
+                }
+                free(fullname);
+            }
+            hmap_free(seen);
+            if (entries != NULL) {
+                ptrv_foreach(entries, free);
+                ptrv_free(entries);
+            }
+            if (deleted != NULL) {
+                for (i = 0; i < deleted->cur; i++) {
+                    DCFileList* child = hmap_remove(node->dir.children, (const char*)deleted->buf[i]);
+                    node->size -= child->size;
+
+                    /*
+                    TRACE((stderr, "removing 0x%08X (%s)\n", child, child == NULL ? "null" : child->name));
+                    */
+
+                    free_file_node(upd, child);
+                    result = true;
+                }
+                ptrv_free(deleted);
+                deleted = NULL;
             }
         }
 
@@ -347,7 +485,7 @@ lookup_filelist_changes(DCFileList* node, PtrV* hash_files)
                 pause.tv_nsec = 1000000;
                 nanosleep(&pause, &remain);
                 */
-                bool r = lookup_filelist_changes(child, hash_files);
+                bool r = lookup_filelist_changes(upd, child);
                 result = result || r;
             }
             node->size += child->size;
@@ -426,63 +564,450 @@ bool send_filelist(MsgQ* status_mq, DCFileList* root)
     return true;
 }
 
-DCFileList* hash_request(PtrV* hash_files, MsgQ* request_mq, MsgQ* status_mq)
+/* Tell the main process how long it took to hash node, and for how much
+ * of that time the hashing process was running. */
+static bool
+report_hashed(MsgQ* status_mq, DCFileList* node, int64_t elapsed_usec, int64_t cpu_usec)
 {
-    DCFileList* hashing = NULL;
-    if (hash_files->cur > 0) {
-        char* filename;
-        hashing = hash_files->buf[0];
-        filename = catfiles(hashing->parent->dir.real_path, hashing->name);
-        msgq_put(request_mq, MSGQ_STR, filename, MSGQ_END);
-
-        //TRACE(("%s:%d: request hash for %s (%s)\n", __FUNCTION__, __LINE__, hashing->name, filename));
-        if (msgq_write_all(request_mq) < 0) {
-            /*
-            fprintf(stderr, "hash queue msgq_write_all error\n");
-            fflush(stderr);
-            */
-            hashing = NULL;
-        }
+    char* filename = catfiles(node->parent->dir.real_path, node->name);
+
+    msgq_put(status_mq, MSGQ_INT, FILELIST_UPDATE_HASHED, MSGQ_END);
+    msgq_put(status_mq, MSGQ_STR, filename, MSGQ_INT64, node->size,
+             MSGQ_INT64, elapsed_usec, MSGQ_INT64, cpu_usec, MSGQ_END);
+    free(filename);
+    return msgq_write_all(status_mq) >= 0;
+}
+
+static bool
+hash_request(DCHashWorker* worker, DCFileList* hashing, MsgQ* status_mq)
+{
+    char* filename;
+
+    filename = catfiles(hashing->parent->dir.real_path, hashing->name);
+    msgq_put(worker->request_mq, MSGQ_STR, filename, MSGQ_END);
 
-        report_status(status_mq, "Calculating TTH for %s", filename);
+    //TRACE(("%s:%d: request hash for %s (%s)\n", __FUNCTION__, __LINE__, hashing->name, filename));
+    if (msgq_write_all(worker->request_mq) < 0) {
+        /*
+        fprintf(stderr, "hash queue msgq_write_all error\n");
+        fflush(stderr);
+        */
         free(filename);
+        return false;
     }
-    return hashing;
+    worker->hashing = hashing;
+    worker->dev = hashing->parent->dir.dev;
+
+    report_status(status_mq, "Calculating TTH for %s", filename);
+    free(filename);
+    return true;
 }
 
 static void
-__attribute__((noreturn))
-local_filelist_update_main(int request_fd[2], int result_fd[2])
+save_and_send_filelist(DCFileListUpdater *upd)
 {
-    PtrV *hash_files = NULL;
-    DCFileList *hashing = NULL;
-    time_t hash_start = 0;
-    bool update_hash = false;
-    bool initial = true;
+    if (write_local_file_list(upd->new_flist_filename, upd->root)) {
+        rename(upd->new_flist_filename, upd->flist_filename);
+    } else {
+        unlink(new_filelist_name);
+    }
+    if (!send_filelist(upd->result_mq, upd->root))
+        upd->running = false;
+}
 
-    MsgQ *request_mq;
-    MsgQ *result_mq;
-    struct sigaction sigact;
+static void hash_result_fd_readable(DCHashWorker *worker);
 
-    fd_set readable, writable;
-    int max_fd = -1;
-    struct timeval tv;
+/* Return the index of the first file after start in the hash queue that
+ * is not on dev. The queue is sorted by device. */
+static uint32_t
+skip_hash_device(PtrV *hash_files, uint32_t start, dev_t dev)
+{
+    uint32_t lo = start, hi = hash_files->cur;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (((DCFileList *) hash_files->buf[mid])->parent->dir.dev <= dev)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
 
-    DCFileList *root = NULL;
-    /*HMapIterator it;*/
-    char* flist_filename = NULL, *new_flist_filename = NULL;
-    int  update_type = -1;
+/* Return the index of the next file in hash_files to hash: the first one
+ * that is not being hashed, and that is on a device no worker is reading.
+ * Each disk is then read by one worker at a time, in the order the files
+ * are laid out on it, and disks are hashed in parallel. Returns -1 if
+ * there is no such file.
+ */
+static int32_t
+next_hash_file(DCFileListUpdater *upd)
+{
+    uint32_t c, d;
 
-    close(request_fd[1]);
-    close(result_fd[0]);
-    request_mq = msgq_new(request_fd[0]);
-    result_mq = msgq_new(result_fd[1]);
+    for (c = 0; c < upd->hash_files->cur; ) {
+        DCFileList *node = upd->hash_files->buf[c];
+        dev_t dev = node->parent->dir.dev;
 
-    hash_files = ptrv_new();
+        for (d = 0; d < upd->hash_workers->cur; d++) {
+            DCHashWorker *worker = upd->hash_workers->buf[d];
+            if (hash_worker_busy(worker) && dev != 0 && worker->dev == dev) {
+                /* Files on a device being read are skipped all at once. */
+                c = skip_hash_device(upd->hash_files, c, dev);
+                break;
+            }
+            if (worker->hashing == node) {
+                c++;
+                break;
+            }
+        }
+        if (d == upd->hash_workers->cur)
+            return c;
+    }
+    return -1;
+}
 
-    if (!hash_init()) {
-        goto cleanup;
+static void
+stop_hash_worker(DCFileListUpdater *upd, uint32_t index)
+{
+    DCHashWorker *worker = ptrv_remove(upd->hash_workers, index);
+
+    reactor_unwatch_read(upd->reactor, worker->result_mq->fd);
+    if (hash_worker_busy(worker))
+        upd->hashing--;
+    hash_worker_free(worker);
+}
+
+/* Give queued files to idle workers, starting workers as needed up to
+ * hash_workers. Idle workers above that number are stopped.
+ */
+static void
+hash_dispatch(DCFileListUpdater *upd)
+{
+    uint32_t c;
+
+    for (c = upd->hash_workers->cur; c > 0 && upd->hash_workers->cur > hash_workers; c--) {
+        DCHashWorker *worker = upd->hash_workers->buf[c-1];
+        if (!hash_worker_busy(worker))
+            stop_hash_worker(upd, c-1);
+    }
+
+    for (;;) {
+        DCHashWorker *worker = NULL;
+        int32_t index;
+
+        index = next_hash_file(upd);
+        if (index < 0)
+            break;
+        for (c = 0; c < upd->hash_workers->cur; c++) {
+            if (!hash_worker_busy(upd->hash_workers->buf[c])) {
+                worker = upd->hash_workers->buf[c];
+                break;
+            }
+        }
+        if (worker == NULL) {
+            if (upd->hash_workers->cur >= MAX(hash_workers, 1))
+                break;
+            worker = hash_worker_new(upd->hash_workers);
+            if (worker == NULL)
+                break;
+            worker->userdata = upd;
+            ptrv_append(upd->hash_workers, worker);
+            reactor_watch_read(upd->reactor, worker->result_mq->fd, (ReactorCallback) hash_result_fd_readable, worker);
+        }
+        if (!hash_request(worker, upd->hash_files->buf[index], upd->result_mq)) {
+            stop_hash_worker(upd, ptrv_find(upd->hash_workers, worker, (comparison_fn_t) compare_pointers));
+            break;
+        }
+        if (upd->hashing == 0)
+            upd->hash_start = time(NULL);
+        upd->hashing++;
+    }
+}
+
+/* Look through the shared directories for new or deleted files, then
+ * schedule the next refresh.
+ */
+static void
+refresh_filelist(DCFileListUpdater *upd, bool initial)
+{
+    if (upd->hashing == 0 && !initial)
+        report_status(upd->result_mq, "Refreshing FileList");
+
+    if (lookup_filelist_changes(upd, upd->root)) {
+        save_and_send_filelist(upd);
+        if (!upd->running)
+            return;
     }
+    ptrv_sort(upd->hash_files, (comparison_fn_t) hash_file_compare);
+    if (upd->hashing == 0 && !initial)
+        report_status(upd->result_mq, NULL);
+    hash_dispatch(upd);
+    reactor_timer_set(upd->refresh_timer, filelist_refresh_timeout * 1000);
+}
+
+static void
+refresh_timer_expired(DCFileListUpdater *upd)
+{
+    refresh_filelist(upd, false);
+}
+
+static void
+hash_result_fd_readable(DCHashWorker *worker)
+{
+    DCFileListUpdater *upd = worker->userdata;
+    int res = msgq_read(worker->result_mq);
+    if (res == 0 || (res < 0 && errno != EAGAIN)) {
+        /*
+        fprintf(stderr, "LOCAL_FLIST: hash msgq_read failed: %d, %s\n", errno, errstr);
+        fflush(stderr);
+        */
+        upd->running = false;
+        return;
+    }
+    while (msgq_has_complete_msg(worker->result_mq)) {
+        char* hash;
+        void* tthl;
+        size_t tthl_size;
+        int64_t hashed_size, hashed_mtime, hashed_ctime;
+        int64_t elapsed_usec, cpu_usec;
+        int kind;
+
+        msgq_peek(worker->result_mq, MSGQ_INT, &kind, MSGQ_END);
+        if (kind == DC_HASH_PROGRESS) {
+            int64_t done;
+
+            msgq_get(worker->result_mq, MSGQ_INT, &kind, MSGQ_INT64, &done, MSGQ_END);
+            if (worker->hashing != NULL && worker->hashing->size > 0) {
+                DCFileList* h = worker->hashing;
+                char* filename = catfiles(h->parent->dir.real_path, h->name);
+                report_status(upd->result_mq, "Calculating TTH for %s (%d%%)", filename,
+                              (int) (done * 100 / h->size));
+                free(filename);
+            }
+            continue;
+        }
+        msgq_get(worker->result_mq, MSGQ_INT, &kind, MSGQ_STR, &hash, MSGQ_BLOB, &tthl, &tthl_size,
+                 MSGQ_INT64, &hashed_size, MSGQ_INT64, &hashed_mtime, MSGQ_INT64, &hashed_ctime,
+                 MSGQ_INT64, &elapsed_usec, MSGQ_INT64, &cpu_usec, MSGQ_END);
+        //TRACE(("%s:%d: hashing == 0x%08X, hash == 0x%08X\n", __FUNCTION__, __LINE__, hashing, hash));
+        if (worker->discard) {
+            /* The file was removed from the share while it was hashed. */
+            worker->discard = false;
+            upd->hashing--;
+        } else if (worker->hashing != NULL) {
+            DCFileList* h = worker->hashing;
+            int32_t index = ptrv_find(upd->hash_files, h, (comparison_fn_t)compare_pointers);
+            char* filename = catfiles(h->parent->dir.real_path, h->name);
+            struct stat st;
+            bool changed = false;
+
+            /* A file rewritten while it was hashed may already have been
+             * seen by a refresh, which could not queue it again. It stays
+             * queued and is hashed again as it is now. */
+            if (index >= 0 && hash != NULL && strlen(hash) == DC_TTH_LENGTH) {
+                if (stat(filename, &st) < 0) {
+                    changed = true;
+                } else if (st.st_size != hashed_size || st.st_mtime != hashed_mtime || st.st_ctime != hashed_ctime
+                           || h->size != (uint64_t) hashed_size || h->reg.mtime != hashed_mtime) {
+                    h->reg.mtime = st.st_mtime;
+                    h->size = st.st_size;
+                    changed = true;
+                }
+            }
+            /* A result for a file no longer queued is stale. */
+            if (index >= 0 && !changed)
+                ptrv_remove(upd->hash_files, index);
+            if (hash != NULL && index >= 0 && !changed) {
+                int len = MIN(sizeof(h->reg.tth), strlen(hash));
+
+                memcpy(h->reg.tth, hash, len);
+                h->reg.has_tth = 1;
+                upd->update_hash = true;
+                if (tthl != NULL && !save_tthl(hash, tthl, tthl_size))
+                    report_error(upd->result_mq, "Cannot save TTH leaves of %s: %s\n", h->name, errstr);
+                if (tthl != NULL && strlen(hash) == DC_TTH_LENGTH) {
+                    tth_cache_add(&st, hash);
+                    /* Shares that are not writable are not written to. */
+                    if (hash_sidecars)
+                        tth_sidecar_write(filename, &st, hash, tthl, tthl_size);
+                }
+                report_hashed(upd->result_mq, h, elapsed_usec, cpu_usec);
+            }
+            free(filename);
+            worker->hashing = NULL;
+            upd->hashing--;
+        }
+        if (hash != NULL)
+            free(hash);
+        free(tthl);
+    }
+
+    /* This may stop the worker. */
+    hash_dispatch(upd);
+    time_t now = time(NULL);
+    if (upd->update_hash && ((upd->hashing == 0 && upd->hash_files->cur == 0) || (now - upd->hash_start) > filelist_hash_refresh_timeout)) {
+        upd->hash_start = now;
+        save_and_send_filelist(upd);
+        if (!upd->running)
+            return;
+        upd->update_hash = false;
+    }
+    if (upd->hashing == 0) {
+        report_status(upd->result_mq, NULL);
+        if (upd->hash_files->cur == 0)
+            tth_checkpoint_clear();
+    }
+}
+
+static void
+update_request_readable(DCFileListUpdater *upd)
+{
+    DCFileList *root = upd->root;
+    MsgQ *request_mq = upd->request_mq;
+    MsgQ *result_mq = upd->result_mq;
+    int res = msgq_read(request_mq);
+
+    if (res == 0 || (res < 0 && errno != EAGAIN)) {
+        upd->running = false;
+        return;
+    }
+    while (msgq_has_complete_msg(request_mq)) {
+        if (upd->update_type < 0) {
+            /* read update type */
+            msgq_get(request_mq, MSGQ_INT, &upd->update_type, MSGQ_END);
+        } else {
+            if (upd->update_type == FILELIST_UPDATE_REFRESH_INTERVAL) {
+                time_t interval = 0;
+                msgq_get(request_mq, MSGQ_INT, &interval, MSGQ_END);
+                if (interval != 0) {
+                    filelist_refresh_timeout = interval;
+                    reactor_timer_set(upd->refresh_timer, filelist_refresh_timeout * 1000);
+                }
+            } else if (upd->update_type == FILELIST_UPDATE_HASH_WORKERS) {
+                msgq_get(request_mq, MSGQ_INT32, &hash_workers, MSGQ_END);
+                hash_dispatch(upd);
+            } else if (upd->update_type == FILELIST_UPDATE_HASH_SIDECARS) {
+                msgq_get(request_mq, MSGQ_BOOL, &hash_sidecars, MSGQ_END);
+            } else if (upd->update_type == FILELIST_UPDATE_HASH_IDLE_IO) {
+                uint32_t c;
+
+                msgq_get(request_mq, MSGQ_BOOL, &hash_idle_io, MSGQ_END);
+                for (c = 0; c < upd->hash_workers->cur; c++)
+                    hash_worker_set_idle_io(upd->hash_workers->buf[c], hash_idle_io);
+            } else {
+                char *name;
+                int len = 0;
+
+                msgq_get(request_mq, MSGQ_STR, &name, MSGQ_END);
+
+                len = strlen(name);
+                if (name[len-1] == '/')
+                    name[len-1] = 0;
+
+                switch (upd->update_type) {
+                case FILELIST_UPDATE_ADD_DIR_NAME:
+                    if (is_already_shared(root, name)) {
+                        // report error here
+                        report_error(result_mq, "%s directory is already shared as subfolder of existing shared tree\n", name);
+                    } else {
+                        char* bname = xstrdup(base_name(name));
+
+                        if (hmap_contains_key(root->dir.children, bname)) {
+                            /* we already have the shared directory with the same name */
+                            report_error(result_mq, "%s directory cannot be shared as %s because there is already shared directory with the same name\n", name, bname);
+                        } else {
+                            DCFileList* node = new_file_node(bname, DC_TYPE_DIR, root);
+                            node->dir.real_path = xstrdup(name);
+                            /* refresh right away */
+                            reactor_timer_set(upd->refresh_timer, 0);
+                        }
+                        free(bname);
+                    }
+                    break;
+                case FILELIST_UPDATE_DEL_DIR_NAME:
+                {
+                    char* bname = xstrdup(base_name(name));
+
+                    DCFileList* node = hmap_get(root->dir.children, bname);
+                    if (node != NULL && node->type == DC_TYPE_DIR) {
+                        if (strcmp(node->dir.real_path, name) == 0) {
+                            node = hmap_remove(root->dir.children, bname);
+                            free_file_node(upd, node);
+                            save_and_send_filelist(upd);
+                        } else {
+                            report_error(result_mq, "%s directory is not shared\n");
+                        }
+                    }
+                    free(bname);
+                }
+                break;
+                case FILELIST_UPDATE_LISTING_DIR:
+                    if (listing_dir != NULL) {
+                        free(listing_dir);
+                    }
+                    listing_dir = xstrdup(name);
+                    if (!send_filelist(result_mq, root)) {
+                        upd->running = false;
+                    }
+                    break;
+                case FILELIST_UPDATE_HUB_CHARSET:
+                    set_hub_charset(name);
+                    if (!send_filelist(result_mq, root)) {
+                        upd->running = false;
+                    }
+                    break;
+                case FILELIST_UPDATE_FS_CHARSET:
+                    set_fs_charset(name);
+                    if (!send_filelist(result_mq, root)) {
+                        upd->running = false;
+                    }
+                    break;
+                default:
+                    /*
+                    fprintf(stderr, "unknown message type %d\n", update_type);
+                    fflush(stderr);
+                    */
+                    upd->running = false;
+                    break;
+                }
+                free(name);
+                if (!upd->running)
+                    return;
+            }
+            upd->update_type = -1;
+        }
+    }
+}
+
+static void
+__attribute__((noreturn))
+local_filelist_update_main(int request_fd[2], int result_fd[2])
+{
+    DCFileListUpdater *upd;
+    struct sigaction sigact;
+
+    close(request_fd[1]);
+    close(result_fd[0]);
+    /* The epoll set is shared with the main process. */
+    reactor_free(main_reactor);
+    main_reactor = NULL;
+
+    upd = xmalloc(sizeof(DCFileListUpdater));
+    upd->reactor = NULL;
+    upd->refresh_timer = NULL;
+    upd->request_mq = msgq_new(request_fd[0]);
+    upd->result_mq = msgq_new(result_fd[1]);
+    upd->hash_files = ptrv_new();
+    upd->hash_workers = ptrv_new();
+    upd->hashing = 0;
+    upd->hash_start = 0;
+    upd->update_hash = false;
+    upd->running = true;
+    upd->root = NULL;
+    upd->flist_filename = NULL;
+    upd->new_flist_filename = NULL;
+    upd->update_type = -1;
 
     /* Inability to register these signals is not a fatal error. */
     sigact.sa_flags = SA_RESTART;
@@ -496,246 +1021,43 @@ local_filelist_update_main(int request_fd[2], int result_fd[2])
     sigaction(SIGCHLD, &sigact, NULL);
     sigaction(SIGPIPE, &sigact, NULL);
 
-    FD_ZERO(&readable);
-    FD_ZERO(&writable);
-
-    if (!get_package_file(filelist_name, &flist_filename) || !get_package_file(new_filelist_name, &new_flist_filename)) {
+    if (!get_package_file(filelist_name, &upd->flist_filename) || !get_package_file(new_filelist_name, &upd->new_flist_filename)) {
         goto cleanup;
     }
 
-    if (NULL == (root = read_local_file_list(flist_filename))) {
+    tth_cache_load();
+
+    if (NULL == (upd->root = read_local_file_list(upd->flist_filename))) {
         if (errno == ENOTFILELIST) {
-            report_error(result_mq, "Cannot load FileList - %s: Invalid file format\n", flist_filename);
+            report_error(upd->result_mq, "Cannot load FileList - %s: Invalid file format\n", upd->flist_filename);
         } else if (errno == EWRONGVERSION) {
-            report_error(result_mq, "Cannot load FileList - %s: Version isn't supported\n", flist_filename);
+            report_error(upd->result_mq, "Cannot load FileList - %s: Version isn't supported\n", upd->flist_filename);
         } else {
-            report_error(result_mq, "Cannot load FileList - %s: %s\n", flist_filename, errstr);
+            report_error(upd->result_mq, "Cannot load FileList - %s: %s\n", upd->flist_filename, errstr);
         }
         goto cleanup;
     }
 
-    if (!send_filelist(result_mq, root)) {
+    if (!send_filelist(upd->result_mq, upd->root)) {
         goto cleanup;
     }
 
-    // now we start monitoring the shared directories
-    update_type = -1;
-
-    FD_SET(request_mq->fd, &readable);
-    max_fd = request_mq->fd;
-    FD_SET(hash_result_mq->fd, &readable);
-    max_fd = MAX(hash_result_mq->fd, max_fd);
-
-    while (true) {
-        tv.tv_sec   = filelist_refresh_timeout;
-        tv.tv_usec  = 0;
-
-        fd_set r_ready = readable, w_ready = writable;
-        int selected = 0;
-        if (!initial) {
-            selected = select(max_fd+1, &r_ready, &w_ready, NULL, &tv);
-        } else {
-            initial = false;
-        }
-        if (selected > 0) {
-            if (FD_ISSET(hash_result_mq->fd, &r_ready)) {
-                int res = msgq_read(hash_result_mq);
-                if (res == 0 || (res < 0 && errno != EAGAIN)) {
-                    /*
-                    fprintf(stderr, "LOCAL_FLIST: hash msgq_read failed: %d, %s\n", errno, errstr);
-                    fflush(stderr);
-                    */
-                    break;
-                }
-                while (msgq_has_complete_msg(hash_result_mq)) {
-                    char* hash;
-                    msgq_get(hash_result_mq, MSGQ_STR, &hash, MSGQ_END);
-                    //TRACE(("%s:%d: hashing == 0x%08X, hash == 0x%08X\n", __FUNCTION__, __LINE__, hashing, hash));
-                    if (hashing != NULL) {
-                        DCFileList* h = ptrv_remove_first(hash_files);
-                        assert(hashing == h);
-                        if (hash != NULL) {
-                            int len = MIN(sizeof(h->reg.tth), strlen(hash));
-                            memcpy(h->reg.tth, hash, len);
-                            h->reg.has_tth = 1;
-                            update_hash = true;
-                        }
-                        hashing = NULL;
-                    }
-                    if (hash != NULL)
-                        free(hash);
-                    if (hash_files->cur > 0) {
-                        /*
-                        fprintf(stderr, "before hash_request\n");
-                        fflush(stderr);
-                        */
-                        hashing = hash_request(hash_files, hash_request_mq, result_mq);
-                        /*
-                        fprintf(stderr, "after hash_request\n");
-                        fflush(stderr);
-                        fprintf(stderr, "request TTH for %08X (%s)\n", hashing, hashing != NULL ? hashing->name : "NULL");
-                        fflush(stderr);
-                        */
-                    }
-                    time_t now = time(NULL);
-                    if (update_hash && ((hashing == NULL && hash_files->cur == 0) || (now - hash_start) > filelist_hash_refresh_timeout)) {
-                        hash_start = now;
-                        if (write_local_file_list(new_flist_filename, root)) {
-                            rename(new_flist_filename, flist_filename);
-                        } else {
-                            unlink(new_filelist_name);
-                        }
+    upd->reactor = reactor_new();
+    if (upd->reactor == NULL)
+        goto cleanup;
+    upd->refresh_timer = reactor_timer_new(upd->reactor, (ReactorCallback) refresh_timer_expired, upd);
 
-                        if (!send_filelist(result_mq, root)) {
-                            break;
-                        }
-                        update_hash = false;
-                    }
-                    if (hashing == NULL && !initial) {
-                        report_status(result_mq, NULL);
-                    }
-                }
-            }
-            if (FD_ISSET(request_mq->fd, &r_ready)) {
-                int res = msgq_read(request_mq);
-                if (res == 0 || (res < 0 && errno != EAGAIN)) {
-                    break;
-                }
-                while (msgq_has_complete_msg(request_mq)) {
-                    if (update_type < 0) {
-                        /* read update type */
-                        msgq_get(request_mq, MSGQ_INT, &update_type, MSGQ_END);
-                    } else {
-                        if (update_type == FILELIST_UPDATE_REFRESH_INTERVAL) {
-                            time_t interval = 0;
-                            msgq_get(request_mq, MSGQ_INT, &interval, MSGQ_END);
-                            if (interval != 0) {
-                                filelist_refresh_timeout = interval;
-                            }
-                        } else {
-                            char *name;
-                            int len = 0;
-
-                            msgq_get(request_mq, MSGQ_STR, &name, MSGQ_END);
-
-                            len = strlen(name);
-                            if (name[len-1] == '/')
-                                name[len-1] = 0;
-
-                            switch (update_type) {
-                            case FILELIST_UPDATE_ADD_DIR_NAME:
-                                if (is_already_shared(root, name)) {
-                                    // report error here
-                                    report_error(result_mq, "%s directory is already shared as subfolder of existing shared tree\n", name);
-                                } else {
-                                    char* bname = xstrdup(base_name(name));
-
-                                    if (hmap_contains_key(root->dir.children, bname)) {
-                                        /* we already have the shared directory with the same name */
-                                        report_error(result_mq, "%s directory cannot be shared as %s because there is already shared directory with the same name\n", name, bname);
-                                    } else {
-                                        DCFileList* node = new_file_node(bname, DC_TYPE_DIR, root);
-                                        node->dir.real_path = xstrdup(name);
-                                        selected = 0;
-                                    }
-                                    free(bname);
-                                }
-                                break;
-                            case FILELIST_UPDATE_DEL_DIR_NAME:
-                                //selected = 0;
-                            {
-                                char* bname = xstrdup(base_name(name));
-
-                                DCFileList* node = hmap_get(root->dir.children, bname);
-                                if (node != NULL && node->type == DC_TYPE_DIR) {
-                                    if (strcmp(node->dir.real_path, name) == 0) {
-                                        node = hmap_remove(root->dir.children, bname);
-                                        filelist_free(node);
-                                        if (write_local_file_list(new_flist_filename, root)) {
-                                            rename(new_flist_filename, flist_filename);
-                                        } else {
-                                            unlink(new_filelist_name);
-                                        }
-
-                                        if (!send_filelist(result_mq, root)) {
-                                            goto cleanup;
-                                        }
-                                    } else {
-                                        report_error(result_mq, "%s directory is not shared\n");
-                                    }
-                                }
-                                free(bname);
-                            }
-                            break;
-                            case FILELIST_UPDATE_LISTING_DIR:
-                                if (listing_dir != NULL) {
-                                    free(listing_dir);
-                                }
-                                listing_dir = xstrdup(name);
-                                if (!send_filelist(result_mq, root)) {
-                                    goto cleanup;
-                                }
-                                break;
-                            case FILELIST_UPDATE_HUB_CHARSET:
-                                set_hub_charset(name);
-                                if (!send_filelist(result_mq, root)) {
-                                    goto cleanup;
-                                }
-                                break;
-                            case FILELIST_UPDATE_FS_CHARSET:
-                                set_fs_charset(name);
-                                if (!send_filelist(result_mq, root)) {
-                                    goto cleanup;
-                                }
-                                break;
-                            default:
-                                /*
-                                fprintf(stderr, "unknown message type %d\n", update_type);
-                                fflush(stderr);
-                                */
-                                goto cleanup;
-                                break;
-                            }
-                            free(name);
-                        }
-                        update_type = -1;
-                    }
-                }
-            }
-        }
-        if (selected == 0) {
-            // just look through shared directories for new or deleted files
-            if (hashing == NULL && !initial)
-                report_status(result_mq, "Refreshing FileList");
-
-            if (lookup_filelist_changes(root, hash_files)) {
-                if (write_local_file_list(new_flist_filename, root)) {
-                    rename(new_flist_filename, flist_filename);
-                } else {
-                    unlink(new_filelist_name);
-                }
+    // now we start monitoring the shared directories
+    reactor_watch_read(upd->reactor, upd->request_mq->fd, (ReactorCallback) update_request_readable, upd);
 
-                if (!send_filelist(result_mq, root)) {
-                    break;
-                }
-            }
-            if (hashing == NULL && !initial)
-                report_status(result_mq, NULL);
-            if (hashing == NULL && hash_files->cur > 0) {
-                hashing = hash_request(hash_files, hash_request_mq, result_mq);
-                if (hashing != NULL) {
-                    hash_start = time(NULL);
-                }
-            }
-        } else if (selected < 0) {
+    refresh_filelist(upd, true);
+    while (upd->running) {
+        if (reactor_dispatch(upd->reactor, -1) < 0 && errno != EINTR) {
             /*
-            fprintf(stderr, "select error: %d, %s\n", errno, errstr);
+            fprintf(stderr, "reactor_dispatch error: %d, %s\n", errno, errstr);
             fflush(stderr);
             */
-            if (errno != EINTR) {
-                // error occurs
-                break;
-            }
+            break;
         }
     }
 
@@ -746,16 +1068,21 @@ local_filelist_update_main(int request_fd[2], int result_fd[2])
      */
 
 cleanup:
-    hash_finish();
+    tth_cache_free();
+    ptrv_foreach(upd->hash_workers, (PtrVForeachCallback) hash_worker_free);
+    ptrv_free(upd->hash_workers);
 
-    filelist_free(root);
+    filelist_free(upd->root);
 
-    ptrv_free(hash_files);
+    ptrv_free(upd->hash_files);
 
-    free(flist_filename);
-    free(new_flist_filename);
-    msgq_free(request_mq);
-    msgq_free(result_mq);
+    reactor_timer_free(upd->refresh_timer);
+    reactor_free(upd->reactor);
+    free(upd->flist_filename);
+    free(upd->new_flist_filename);
+    msgq_free(upd->request_mq);
+    msgq_free(upd->result_mq);
+    free(upd);
     close(request_fd[0]);
     close(result_fd[1]);
     exit(EXIT_SUCCESS);
@@ -791,11 +1118,75 @@ bool local_file_list_update_init(void)
     close(result_fd[1]);
     update_request_mq = msgq_new(request_fd[1]);
     update_result_mq = msgq_new(result_fd[0]);
-    FD_SET(update_result_mq->fd, &read_fds);
+    reactor_watch_read(main_reactor, update_result_mq->fd, (ReactorCallback) update_result_fd_readable, NULL);
 
     return true;
 }
 
+void
+file_list_buffer_unref(DCFileListBuffer *buffer)
+{
+    buffer->refcount--;
+    if (buffer->refcount == 0) {
+        if (buffer->data != NULL)
+            munmap(buffer->data, buffer->size);
+        free(buffer->filename);
+        free(buffer);
+    }
+}
+
+/* Return the published list that was loaded from filename, or NULL if
+ * there is none. User connection processes see the lists published
+ * when they were created.
+ */
+DCFileListBuffer *
+file_list_buffer_lookup(const char *filename)
+{
+    uint32_t c;
+
+    for (c = 0; c < sizeof(published_lists)/sizeof(*published_lists); c++) {
+        if (published_lists[c] != NULL && strcmp(published_lists[c]->filename, filename) == 0)
+            return published_lists[c];
+    }
+    return NULL;
+}
+
+/* Map the list that has just been renamed to filename into memory, and
+ * make it replace the previous list in slot. Uploads of the previous
+ * list keep it until they end. If the list cannot be mapped, it is
+ * uploaded from disk.
+ */
+static void
+publish_file_list(uint32_t slot, const char *filename)
+{
+    DCFileListBuffer *buffer = NULL;
+    struct stat st;
+    void *data = NULL;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+    if (fd >= 0 && fstat(fd, &st) == 0) {
+        if (st.st_size > 0)
+            data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (data != MAP_FAILED) {
+            buffer = xmalloc(sizeof(DCFileListBuffer));
+            buffer->refcount = 1;
+            buffer->generation = ++published_generation;
+            buffer->filename = xstrdup(filename);
+            buffer->data = data;
+            buffer->size = st.st_size;
+        }
+    }
+    if (buffer == NULL)
+        flag_putf(DC_DF_DEBUG, _("%s: Cannot map file list into memory - %s\n"), quotearg(filename), errstr);
+    if (fd >= 0)
+        close(fd);
+
+    if (published_lists[slot] != NULL)
+        file_list_buffer_unref(published_lists[slot]);
+    published_lists[slot] = buffer;
+}
+
 bool process_new_file_list(MsgQ* result_mq)
 {
     void *data;
@@ -835,6 +1226,7 @@ bool process_new_file_list(MsgQ* result_mq)
               *dc_flist_to      = xasprintf("%s%sMyList.DcLst",   listing_dir, listing_dir[0] == '\0' || listing_dir[strlen(listing_dir)-1] == '/' ? "" : "/");
 
     rename(   dc_flist_from,    dc_flist_to);
+    publish_file_list(0, dc_flist_to);
     if (ptrv_find(delete_files, dc_flist_to, (comparison_fn_t) strcmp) < 0)
         ptrv_append(delete_files, xstrdup(dc_flist_to));
     if (ptrv_find(delete_files, dc_flist_from, (comparison_fn_t) strcmp) < 0)
@@ -844,6 +1236,8 @@ bool process_new_file_list(MsgQ* result_mq)
 #if defined(HAVE_LIBXML2)
     rename(  xml_flist_from,   xml_flist_to);
     rename(bzxml_flist_from, bzxml_flist_to);
+    publish_file_list(1, xml_flist_to);
+    publish_file_list(2, bzxml_flist_to);
     if (ptrv_find(delete_files, xml_flist_to, (comparison_fn_t) strcmp) < 0)
         ptrv_append(delete_files, xstrdup(xml_flist_to));
     if (ptrv_find(delete_files, xml_flist_from, (comparison_fn_t) strcmp) < 0)
@@ -988,6 +1382,36 @@ update_request_set_filelist_refresh_timeout(time_t seconds)
     return true;
 }
 
+bool
+update_request_set_hash_workers(uint32_t count)
+{
+    msgq_put(update_request_mq, MSGQ_INT, FILELIST_UPDATE_HASH_WORKERS, MSGQ_END);
+    msgq_put(update_request_mq, MSGQ_INT32, count, MSGQ_END);
+    if (msgq_write_all(update_request_mq) < 0)
+        return false;
+    return true;
+}
+
+bool
+update_request_set_hash_sidecars(bool enabled)
+{
+    msgq_put(update_request_mq, MSGQ_INT, FILELIST_UPDATE_HASH_SIDECARS, MSGQ_END);
+    msgq_put(update_request_mq, MSGQ_BOOL, enabled, MSGQ_END);
+    if (msgq_write_all(update_request_mq) < 0)
+        return false;
+    return true;
+}
+
+bool
+update_request_set_hash_idle_io(bool enabled)
+{
+    msgq_put(update_request_mq, MSGQ_INT, FILELIST_UPDATE_HASH_IDLE_IO, MSGQ_END);
+    msgq_put(update_request_mq, MSGQ_BOOL, enabled, MSGQ_END);
+    if (msgq_write_all(update_request_mq) < 0)
+        return false;
+    return true;
+}
+
 void
 update_request_fd_writable(void)
 {
@@ -1000,7 +1424,7 @@ update_request_fd_writable(void)
         return;
     }
     if (!msgq_has_partial_msg(update_request_mq))
-        FD_CLR(update_request_mq->fd, &write_fds);
+        reactor_unwatch_write(main_reactor, update_request_mq->fd);
 }
 
 void
@@ -1037,6 +1461,26 @@ update_result_fd_readable(void)
                 free(err);
             }
             break;
+            case FILELIST_UPDATE_HASHED:
+            {
+                char sizebuf[LONGEST_HUMAN_READABLE+1];
+                char ratebuf[LONGEST_HUMAN_READABLE+1];
+                char* filename;
+                uint64_t size;
+                int64_t elapsed_usec, cpu_usec;
+
+                msgq_get(update_result_mq, MSGQ_STR, &filename, MSGQ_INT64, &size,
+                         MSGQ_INT64, &elapsed_usec, MSGQ_INT64, &cpu_usec, MSGQ_END);
+                elapsed_usec = MAX(elapsed_usec, 1);
+                flag_putf(DC_DF_DEBUG, _("Hashed %s (%s) in %.1f seconds (%s/s), CPU busy %d%% of the time\n"),
+                          quotearg(filename),
+                          human_readable(size, sizebuf, human_suppress_point_zero|human_autoscale|human_base_1024|human_SI|human_B, 1, 1),
+                          elapsed_usec / 1e6,
+                          human_readable((uintmax_t) (size / (elapsed_usec / 1e6)), ratebuf, human_suppress_point_zero|human_autoscale|human_base_1024|human_SI|human_B, 1, 1),
+                          (int) MIN(cpu_usec * 100 / elapsed_usec, 100));
+                free(filename);
+            }
+            break;
             default:
                 assert(false);
                 break;
@@ -1049,11 +1493,15 @@ update_result_fd_readable(void)
 void
 local_file_list_update_finish(void)
 {
+    uint32_t c;
+
     if (update_request_mq != NULL) {
+        reactor_unwatch_write(main_reactor, update_request_mq->fd);
         close(update_request_mq->fd);
         msgq_free(update_request_mq);
     }
     if (update_result_mq != NULL) {
+        reactor_unwatch_read(main_reactor, update_result_mq->fd);
         close(update_result_mq->fd);
         msgq_free(update_result_mq);
     }
@@ -1061,4 +1509,10 @@ local_file_list_update_finish(void)
         free(update_status);
         update_status = NULL;
     }
+    for (c = 0; c < sizeof(published_lists)/sizeof(*published_lists); c++) {
+        if (published_lists[c] != NULL) {
+            file_list_buffer_unref(published_lists[c]);
+            published_lists[c] = NULL;
+        }
+    }
 }
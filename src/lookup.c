@@ -180,6 +180,9 @@ lookup_main(int request_fd[2], int result_fd[2])
     close(result_fd[0]);
     request_mq = msgq_new(request_fd[0]);
     result_mq = msgq_new(result_fd[1]);
+    /* The epoll set is shared with the main process. */
+    reactor_free(main_reactor);
+    main_reactor = NULL;
 
     /* Inability to register these signals is not a fatal error. */
     sigact.sa_flags = SA_RESTART;
@@ -243,7 +246,7 @@ lookup_request_fd_writable(void)
         return;
     }
     if (!msgq_has_partial_msg(lookup_request_mq))
-        FD_CLR(lookup_request_mq->fd, &write_fds);
+        reactor_unwatch_write(main_reactor, lookup_request_mq->fd);
 }
 
 void
@@ -302,7 +305,7 @@ add_lookup_request(const char *node, const char *service, const struct addrinfo
     addrinfo_to_data(hints, &data, &size);
     msgq_put(lookup_request_mq, MSGQ_STR, node, MSGQ_STR, service, MSGQ_BLOB, data, size, MSGQ_END);
     free(data);
-    FD_SET(lookup_request_mq->fd, &write_fds);
+    reactor_watch_write(main_reactor, lookup_request_mq->fd, (ReactorCallback) lookup_request_fd_writable, NULL);
 
     lookup = xmalloc(sizeof(DCLookup));
     lookup->callback = callback;
@@ -342,7 +345,7 @@ lookup_init(void)
     close(result_fd[1]);
     lookup_request_mq = msgq_new(request_fd[1]);
     lookup_result_mq = msgq_new(result_fd[0]);
-    FD_SET(lookup_result_mq->fd, &read_fds);
+    reactor_watch_read(main_reactor, lookup_result_mq->fd, (ReactorCallback) lookup_result_fd_readable, NULL);
     return true;
 }
 
@@ -354,10 +357,12 @@ lookup_finish(void)
         ptrv_free(pending_lookups);
     }
     if (lookup_request_mq != NULL) {
+        reactor_unwatch_write(main_reactor, lookup_request_mq->fd);
         close(lookup_request_mq->fd);
         msgq_free(lookup_request_mq);
     }
     if (lookup_result_mq != NULL) {
+        reactor_unwatch_read(main_reactor, lookup_result_mq->fd);
         close(lookup_result_mq->fd);
         msgq_free(lookup_result_mq);
     }
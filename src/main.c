@@ -25,6 +25,7 @@
 #include <stdlib.h>		/* C89 */
 #include <string.h>		/* C89 */
 #include <sys/socket.h>		/* POSIX */
+#include <sys/mman.h>		/* POSIX: mmap */
 #include <sys/stat.h>		/* ? */
 #include <sys/types.h>		/* ? */
 #include <sys/wait.h>		/* POSIX: waitpid */
@@ -61,6 +62,7 @@ enum {
 };
 
 #define LISTEN_QUEUE_CONNS 16
+#define RECENT_UPLOADS 16
 
 /* interactive state (move to transfer.c/browse.c) */
 DCFileList *browse_list = NULL;
@@ -72,11 +74,11 @@ bool browsing_myself = false;
 /* misc */
 uint64_t bytes_received = 0;
 uint64_t bytes_sent = 0;
+DCTransferLimits *transfer_limits = NULL;
 uint64_t max_speed = 0, prev_max_speed = 0;
 uint16_t listen_port = 0;
 bool running = true;
-fd_set read_fds;
-fd_set write_fds;
+Reactor *main_reactor = NULL;
 PtrV *delete_files = NULL;
 PtrV *delete_dirs = NULL;
 static PtrV *search_udpmsg_out;	/* pending outgoing search results */
@@ -93,6 +95,9 @@ const char version_etc_copyright[] =
     "Copyright (C) 2006 Vladimir Chugunov, based on Oskar Liljeblad's microdc 0.11.0\nmicrodc is copyright (C) 2004, 2005 Oskar Liljeblad.";
 
 static uint32_t user_conn_unknown_last = 0;
+static uint32_t idle_user_conns = 0;	/* download connections waiting for more files */
+static char *recent_uploads[RECENT_UPLOADS];	/* local names of the last files uploaded */
+static uint32_t recent_upload_next = 0;
 static PtrV *user_conn_unknown_free = NULL;
 static ByteQ *search_recvq;
 
@@ -101,6 +106,12 @@ static int signal_pipe[2] = { -1, -1 };
 static int listen_socket = -1;
 static int search_socket = -1;
 
+static void user_request_fd_writable(DCUserConn *uc);
+static void user_request_flush(DCUserConn *uc);
+static void user_result_fd_readable(DCUserConn *uc);
+static void search_now_writable(void);
+static void handle_listen_connection(void);
+
 static const char *short_opts = "c:n";
 static struct option long_opts[] = {
     { "config", required_argument, NULL, 'c' },
@@ -152,6 +163,37 @@ get_package_file(const char *name, char **outname)
     return true;
 }
 
+/* Return true if local_file is likely to be uploaded by more than one
+ * connection at a time: it is being uploaded right now, or was among
+ * the last RECENT_UPLOADS files uploaded. Such files are left in the
+ * page cache, so that concurrent uploads read them from a single copy.
+ */
+static bool
+upload_file_is_hot(DCUserConn *uc, const char *local_file)
+{
+    HMapIterator it;
+    uint32_t c;
+    bool hot = false;
+
+    hmap_iterator(user_conns, &it);
+    while (!hot && it.has_next(&it)) {
+        DCUserConn *other = it.next(&it);
+        if (other != uc && other->dir == DC_DIR_SEND && other->transfer_file != NULL
+                && strcmp(other->transfer_file, local_file) == 0)
+            hot = true;
+    }
+    for (c = 0; !hot && c < RECENT_UPLOADS; c++) {
+        if (recent_uploads[c] != NULL && strcmp(recent_uploads[c], local_file) == 0)
+            hot = true;
+    }
+    if (!hot) {
+        free(recent_uploads[recent_upload_next]);
+        recent_uploads[recent_upload_next] = xstrdup(local_file);
+        recent_upload_next = (recent_upload_next + 1) % RECENT_UPLOADS;
+    }
+    return hot;
+}
+
 bool
 has_user_conn(DCUserInfo *ui, DCTransferDirection dir)
 {
@@ -330,18 +372,82 @@ handle_ended_upload(DCUserConn *uc, bool success, const char *reason)
 }
 
 static void
-handle_ended_download(DCUserConn *uc, bool success, const char *reason)
+handle_ended_download(DCUserConn *uc, bool success, const char *reason, const uint8_t *roots, size_t roots_size)
 {
+    DCQueuedFile *queued;
+    bool keep_queued = false;
+    int verified = -1;
+
     bytes_received += uc->transfer_pos - uc->transfer_start;
     if (uc->occupied_slot) {
         used_dl_slots--;
         uc->occupied_slot = false;
     }
+    if (uc->segmented != NULL && uc->fetching_leaves) {
+        /* roots holds the TTH leaves of the file. */
+        int damaged = success ? segmented_file_repair(uc->segmented, roots, roots_size) : -1;
+
+        /* A file that failed verification but has no damaged segments
+         * cannot be repaired. An incomplete file may just have had its
+         * unhashed segments verified. */
+        if (damaged < 0) {
+            if (segmented_file_leaves_failed(uc->segmented, uc->queued_valid ? uc->info->download_queue->buf[uc->queue_pos] : NULL)) {
+                warn(_("%s: Cannot get the TTH leaves of the file, downloading all of it again\n"),
+                     quotearg(uc->segmented->local_file));
+            } else {
+                flag_putf(DC_DF_DOWNLOAD, _("%s: Cannot get the TTH leaves of the file, trying another source.\n"),
+                          quotearg(uc->segmented->local_file));
+            }
+        } else if (damaged == 0 && segmented_file_verify(uc->segmented) == 0) {
+            warn(_("%s: Cannot find the damaged parts of the file, downloading all of it again\n"),
+                 quotearg(uc->segmented->local_file));
+            segmented_file_reset(uc->segmented);
+        } else if (damaged > 0) {
+            flag_putf(DC_DF_DOWNLOAD, _("%s: Downloading %d damaged segments again.\n"),
+                      quotearg(uc->segmented->local_file), damaged);
+        }
+        /* If all of it was there and is good, it is finished below. */
+        keep_queued = uc->queued_valid && (!segmented_file_is_complete(uc->segmented) || uc->segmented->repair);
+        segmented_file_unref(uc->segmented);
+        uc->segmented = NULL;
+        uc->fetching_leaves = false;
+    } else if (uc->segmented != NULL) {
+        /* Keep the segments that were received and hashed, even if the
+         * download failed later on. */
+        segmented_file_release(uc->segmented, uc->segment_start, uc->segment_length, roots, roots_size);
+        segmented_file_unref(uc->segmented);
+        uc->segmented = NULL;
+    }
     /* If we removed from the queued item during download,
      * queue_pos will point outside the queue. */
-    if (uc->queued_valid) {
-        DCQueuedFile *queued;
-
+    queued = uc->queued_valid ? uc->info->download_queue->buf[uc->queue_pos] : NULL;
+    if (queued != NULL && success && queued->segmented != NULL) {
+        DCSegmentedFile *sf = queued->segmented;
+
+        if (!segmented_file_is_complete(sf) || sf->repair) {
+            /* Stay on this file and download another segment of it,
+             * or wait for a source of the TTH leaves to verify it. */
+            keep_queued = true;
+        } else if (!keep_queued && (verified = segmented_file_verify(sf)) == 0) {
+            reason = _("TTH mismatch");
+            success = false;
+            if (sf->repairs < DC_SEGMENT_MAX_REPAIRS) {
+                /* Stay on this file and repair it. */
+                warn(_("%s: Downloaded file does not match its TTH, repairing it\n"), quotearg(uc->local_file));
+                sf->repair = true;
+                sf->repairs++;
+                keep_queued = true;
+            } else {
+                warn(_("%s: Downloaded file does not match its TTH\n"), quotearg(uc->local_file));
+                segmented_file_reset(sf);
+            }
+        }
+    }
+    if (keep_queued) {
+        queued->status = DC_QS_QUEUED;
+        uc->queued_valid = false;
+        display_transfer_ended_msg(false, uc, success, " (%s)", reason);
+    } else if (uc->queued_valid) {
         /*
         queued = uc->info->download_queue->buf[uc->queue_pos];
         uc->queue_pos++;
@@ -359,6 +465,11 @@ handle_ended_download(DCUserConn *uc, bool success, const char *reason)
                 }
             } else {
                 char *final_file = xstrndup(uc->local_file, strlen(uc->local_file)-5);
+                if (queued->segmented != NULL) {
+                    if (verified < 0)
+                        flag_putf(DC_DF_DEBUG, _("%s: Parts of the file were not hashed, TTH not verified.\n"), quotearg(uc->local_file));
+                    segmented_file_finish(queued->segmented);
+                }
                 if (safe_rename(uc->local_file, final_file) != 0) {
                     warn(_("%s: Cannot rename file to %s - %s\n"), quotearg_n(0, uc->local_file), quote_n(1, final_file), errstr);
                     reason = _("cannot rename file"); /* XXX: would like a more elaborate error message here perhaps? */
@@ -371,6 +482,7 @@ handle_ended_download(DCUserConn *uc, bool success, const char *reason)
             queued->status = DC_QS_ERROR;
         }
         display_transfer_ended_msg(false, uc, success, " (%s)", reason);
+        free_queued_file(queued);
     } else {
         display_transfer_ended_msg(false, uc, success, " but unqueued (%s)", reason);
     }
@@ -389,32 +501,36 @@ user_connection_new(struct sockaddr_in *addr, int user_socket)
     DCUserConn *uc;
     int get_fd[2] = { -1, -1 };
     int put_fd[2] = { -1, -1 };
-    pid_t pid;
+    pid_t pid = -1;
+    bool in_process = (transfer_engine == DC_ENGINE_REACTOR);
 
-    if (pipe(get_fd) != 0 || pipe(put_fd) != 0) {
-        warn(_("Cannot create pipe pair - %s\n"), errstr);
-        goto cleanup;
-    }
+    if (!in_process) {
+        if (pipe(get_fd) != 0 || pipe(put_fd) != 0) {
+            warn(_("Cannot create pipe pair - %s\n"), errstr);
+            goto cleanup;
+        }
 
-    pid = fork();
-    if (pid < 0) {
-        warn(_("Cannot create process - %s\n"), errstr);
-        goto cleanup;
+        pid = fork();
+        if (pid < 0) {
+            warn(_("Cannot create process - %s\n"), errstr);
+            goto cleanup;
+        }
+        if (pid == 0)
+            user_main(put_fd, get_fd, addr, user_socket);
+
+        if (close(get_fd[1]) != 0 || close(put_fd[0]) != 0)
+            warn(_("Cannot close pipe - %s\n"), errstr);
+        /* Non-blocking mode is not required, but there may be some latency otherwise. */
+        if (!fd_set_nonblock_flag(get_fd[0], true) || !fd_set_nonblock_flag(put_fd[1], true))
+            warn(_("Cannot set non-blocking flag - %s\n"), errstr);
+        /* The user socket is only used by the newly created user process. */
+        if (user_socket >= 0 && close(user_socket) < 0)
+            warn(_("Cannot close socket - %s\n"), errstr);
     }
-    if (pid == 0)
-        user_main(put_fd, get_fd, addr, user_socket);
-
-    if (close(get_fd[1]) != 0 || close(put_fd[0]) != 0)
-        warn(_("Cannot close pipe - %s\n"), errstr);
-    /* Non-blocking mode is not required, but there may be some latency otherwise. */
-    if (!fd_set_nonblock_flag(get_fd[0], true) || !fd_set_nonblock_flag(put_fd[1], true))
-        warn(_("Cannot set non-blocking flag - %s\n"), errstr);
-    /* The user socket is only used by the newly created user process. */
-    if (user_socket >= 0 && close(user_socket) < 0)
-        warn(_("Cannot close socket - %s\n"), errstr);
 
     uc = xmalloc(sizeof(DCUserConn));
     uc->pid = pid;
+    uc->local = NULL;
     uc->info = NULL;
     uc->occupied_slot = 0;
     uc->occupied_minislot = 0;
@@ -428,10 +544,22 @@ user_connection_new(struct sockaddr_in *addr, int user_socket)
     uc->transferring = false;
     uc->queue_pos = 0;
     uc->queued_valid = false;
+    uc->segmented = NULL;
+    uc->fetching_leaves = false;
+    uc->idle = false;
+    uc->idle_request = 0;
+    uc->idle_can_segment = false;
+    uc->idle_can_send_leaves = false;
     /* uc->we_connected = (user_socket < 0); */
-    uc->get_mq = msgq_new(get_fd[0]);
-    uc->put_mq = msgq_new(put_fd[1]);
-    FD_SET(uc->get_mq->fd, &read_fds);
+    if (in_process) {
+        /* Messages are passed directly, see user_local_start. */
+        uc->get_mq = msgq_new_loopback(NULL, NULL);
+        uc->put_mq = msgq_new_loopback(NULL, NULL);
+    } else {
+        uc->get_mq = msgq_new(get_fd[0]);
+        uc->put_mq = msgq_new(put_fd[1]);
+        reactor_watch_read(main_reactor, uc->get_mq->fd, (ReactorCallback) user_result_fd_readable, uc);
+    }
     if (user_conn_unknown_free->cur > 0) {
         uc->name = ptrv_remove_first(user_conn_unknown_free);
     } else {
@@ -444,6 +572,8 @@ user_connection_new(struct sockaddr_in *addr, int user_socket)
         user_conn_unknown_last++;
     }
     hmap_put(user_conns, uc->name, uc);
+    if (in_process && !user_local_start(uc, addr, user_socket))
+        return NULL; /* uc has been disconnected already */
     return uc;
 
 cleanup:
@@ -465,11 +595,15 @@ user_disconnect(DCUserConn *uc)
 
     hmap_remove(user_conns, uc->name);
 
+    if (uc->idle) {
+        uc->idle = false;
+        idle_user_conns--;
+    }
     if (uc->occupied_slot) { /* could also check that uc->transfer_file != NULL */
         if (uc->dir == DC_DIR_SEND) {
             handle_ended_upload(uc, false, "connection terminated prematurely");
         } else { /* uc->dir == DC_DIR_RECV */
-            handle_ended_download(uc, false, "connection terminated prematurely");
+            handle_ended_download(uc, false, "connection terminated prematurely", NULL, 0);
         }
     }
 
@@ -487,13 +621,19 @@ user_disconnect(DCUserConn *uc)
         user_info_free(uc->info);
     }
 
-    FD_CLR(uc->get_mq->fd, &read_fds);
-    FD_CLR(uc->put_mq->fd, &write_fds);
-    if (close(uc->get_mq->fd) != 0 || close(uc->put_mq->fd) != 0)
-        warn(_("Cannot close pipe - %s\n"), errstr);
-    msgq_free(uc->get_mq);
+    if (uc->local != NULL) {
+        /* The message queues are freed along with the connection. */
+        user_local_release(uc->local);
+        uc->local = NULL;
+    } else {
+        reactor_unwatch_read(main_reactor, uc->get_mq->fd);
+        reactor_unwatch_write(main_reactor, uc->put_mq->fd);
+        if (close(uc->get_mq->fd) != 0 || close(uc->put_mq->fd) != 0)
+            warn(_("Cannot close pipe - %s\n"), errstr);
+        msgq_free(uc->get_mq);
+        msgq_free(uc->put_mq);
+    }
     uc->get_mq = NULL;
-    msgq_free(uc->put_mq);
     uc->put_mq = NULL;
     if (strchr(uc->name, '|') == NULL)
         ptrv_append(user_conn_unknown_free, uc->name);
@@ -525,6 +665,172 @@ user_conn_status_to_string(DCUserConn *uc, time_t now)
     return status;
 }
 
+/* A segment map left by an earlier session may show the whole file as
+ * downloaded, if microdc2 stopped before the file was verified and
+ * renamed. Verify it now. Returns true if the file was finished, and
+ * false if it is to be repaired or downloaded again.
+ */
+static bool
+finish_complete_download(DCQueuedFile *queued)
+{
+    DCSegmentedFile *sf = queued->segmented;
+    char *final_file;
+
+    if (segmented_file_verify(sf) == 0) {
+        if (sf->repairs < DC_SEGMENT_MAX_REPAIRS) {
+            warn(_("%s: Downloaded file does not match its TTH, repairing it\n"), quotearg(sf->local_file));
+            sf->repair = true;
+            sf->repairs++;
+        } else {
+            warn(_("%s: Downloaded file does not match its TTH\n"), quotearg(sf->local_file));
+            segmented_file_reset(sf);
+        }
+        return false;
+    }
+
+    final_file = xstrndup(sf->local_file, strlen(sf->local_file)-5);
+    segmented_file_finish(sf);
+    if (safe_rename(sf->local_file, final_file) != 0) {
+        warn(_("%s: Cannot rename file to %s - %s\n"), quotearg_n(0, sf->local_file), quote_n(1, final_file), errstr);
+        queued->status = DC_QS_ERROR;
+    } else {
+        flag_putf(DC_DF_DOWNLOAD, _("%s: All of the file was downloaded already, finished it.\n"), quotearg(final_file));
+    }
+    free(final_file);
+    return true;
+}
+
+/* Reply to DC_MSG_CHECK_DOWNLOAD with the next file to download from
+ * the user. If there is none, the connection may wait in the pool of
+ * idle connections until more files are queued, see user_conn_wake.
+ */
+static void
+check_download(DCUserConn *uc, int32_t request, bool can_segment, bool can_send_leaves)
+{
+    int32_t idle_timeout = 0;
+
+    if (uc->idle) {
+        uc->idle = false;
+        idle_user_conns--;
+    }
+    for (; uc->queue_pos < uc->info->download_queue->cur; uc->queue_pos++) {
+        DCQueuedFile *queued;
+        char *local_file;
+        char *tth = NULL;
+        uint64_t offset = 0;
+        uint64_t length = 0;
+        DCTransferFlag flag;
+
+        queued = uc->info->download_queue->buf[uc->queue_pos];
+        if (queued->status == DC_QS_DONE)
+            continue;
+        flag = queued->flag;
+        if (queued->segmented != NULL) {
+            if (segmented_file_is_complete(queued->segmented) && !queued->segmented->repair
+                    && finish_complete_download(queued))
+                continue;
+            if (queued->segmented->repair && can_segment && can_send_leaves) {
+                /* Get the TTH leaves to find the damaged segments. */
+                queued->segmented->repair = false;
+                uc->fetching_leaves = true;
+                flag = DC_TF_LEAVES;
+            } else {
+                /* Leave the repair to another source. Missing segments
+                 * can still be downloaded from this one meanwhile. */
+                if (queued->segmented->repair && segmented_file_leaves_failed(queued->segmented, queued)) {
+                    warn(_("%s: No source can send the TTH leaves, downloading all of the file again\n"),
+                         quotearg(queued->segmented->local_file));
+                }
+                /* Users that cannot send segments get the rest of
+                 * the file, if no one else is downloading it. */
+                if (!segmented_file_reserve(queued->segmented, !can_segment, &offset, &length))
+                    continue;
+            }
+            local_file = xstrdup(queued->segmented->local_file);
+            tth = queued->segmented->tth;
+            uc->segmented = queued->segmented;
+            uc->segmented->refcount++;
+            uc->segment_start = offset;
+            uc->segment_length = length;
+        } else {
+            local_file = resolve_download_file(uc->info, queued);
+        }
+        uc->queued_valid = true;
+        uc->transfer_file = xstrdup(queued->filename);
+        uc->local_file = xstrdup(local_file);
+        uc->occupied_slot = true;
+        queued->status = DC_QS_PROCESSING;
+        used_dl_slots++;
+        msgq_put(uc->put_mq, MSGQ_INT32, request, MSGQ_STR, local_file, MSGQ_STR, uc->transfer_file, MSGQ_INT64, queued->length, MSGQ_INT, flag,
+                 MSGQ_STR, tth, MSGQ_INT64, offset, MSGQ_INT64, length, MSGQ_INT32, (int32_t) 0, MSGQ_END);
+        free(local_file);
+        return;
+    }
+    if (idle_user_conns < idle_connections && idle_connection_timeout > 0) {
+        idle_user_conns++;
+        uc->idle = true;
+        uc->idle_request = request;
+        uc->idle_can_segment = can_segment;
+        uc->idle_can_send_leaves = can_send_leaves;
+        idle_timeout = idle_connection_timeout;
+    }
+    msgq_put(uc->put_mq, MSGQ_INT32, request, MSGQ_STR, NULL, MSGQ_STR, NULL, MSGQ_INT64, (uint64_t) 0, MSGQ_INT, DC_TF_NORMAL,
+             MSGQ_STR, NULL, MSGQ_INT64, (uint64_t) 0, MSGQ_INT64, (uint64_t) 0, MSGQ_INT32, idle_timeout, MSGQ_END);
+}
+
+/* Give newly queued files to an idle download connection to ui, if
+ * there is one. Returns false if there is none.
+ */
+bool
+user_conn_wake(DCUserInfo *ui)
+{
+    uint32_t c;
+
+    for (c = 0; c < ui->conn_count; c++) {
+        DCUserConn *uc = ui->conn[c];
+
+        if (uc->idle) {
+            flag_putf(DC_DF_CONNECTIONS, _("Reusing idle connection %s.\n"), quote(uc->name));
+            uc->queue_pos = 0;
+            check_download(uc, uc->idle_request, uc->idle_can_segment, uc->idle_can_send_leaves);
+            /* This reply was not asked for just now, so it must be
+             * delivered to in-process connections explicitly. */
+            if (uc->local != NULL)
+                user_local_replied(uc->local);
+            else
+                user_request_flush(uc);
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Close the idle download connections above the idle_connections
+ * limit, after it has been lowered.
+ */
+void
+user_conn_trim_idle(void)
+{
+    HMapIterator it;
+    PtrV *excess;
+    uint32_t kept = 0;
+    uint32_t c;
+
+    if (idle_user_conns <= idle_connections)
+        return;
+    excess = ptrv_new();
+    hmap_iterator(user_conns, &it);
+    while (it.has_next(&it)) {
+        DCUserConn *uc = it.next(&it);
+
+        if (uc->idle && kept++ >= idle_connections)
+            ptrv_append(excess, uc);
+    }
+    for (c = 0; c < excess->cur; c++)
+        user_conn_cancel(excess->buf[c]);
+    ptrv_free(excess);
+}
+
 /* This function should be called when the user process it to be notified
  * about the termination (when it isn't terminating by itself).
  */
@@ -546,7 +852,17 @@ user_request_fd_writable(DCUserConn *uc)
         return;
     }
     if (!msgq_has_partial_msg(uc->put_mq))
-        FD_CLR(uc->put_mq->fd, &write_fds);
+        reactor_unwatch_write(main_reactor, uc->put_mq->fd);
+}
+
+/* Make sure that a reply just put on uc->put_mq reaches the user
+ * connection. In-process connections pick it up by themselves.
+ */
+static void
+user_request_flush(DCUserConn *uc)
+{
+    if (uc->local == NULL)
+        reactor_watch_write(main_reactor, uc->put_mq->fd, (ReactorCallback) user_request_fd_writable, uc);
 }
 
 static void
@@ -560,6 +876,15 @@ user_result_fd_readable(DCUserConn *uc)
         user_disconnect(uc); /* MSG: socket error above */
         return;
     }
+    user_conn_dispatch(uc);
+}
+
+/* Handle all complete messages received from a user connection.
+ * Note that uc may have been freed when this function returns.
+ */
+void
+user_conn_dispatch(DCUserConn *uc)
+{
     while (msgq_has_complete_msg(uc->get_mq)) {
         int id;
 
@@ -574,32 +899,26 @@ user_result_fd_readable(DCUserConn *uc)
             free(msg);
             break;
         }
-        case DC_MSG_WANT_DOWNLOAD: {
-            bool reply;
-
-            msgq_get(uc->get_mq, MSGQ_INT, &id, MSGQ_END);
-            reply = !has_user_conn(uc->info, DC_DIR_RECEIVE)
-                    && (uc->queue_pos < uc->info->download_queue->cur);
-            msgq_put(uc->put_mq, MSGQ_BOOL, reply, MSGQ_END);
-            FD_SET(uc->put_mq->fd, &write_fds);
-            break;
-        }
         case DC_MSG_VALIDATE_DIR: {
+            int32_t request;
             DCTransferDirection dir;
             bool reply;
 
-            msgq_get(uc->get_mq, MSGQ_INT, &id, MSGQ_INT, &dir, MSGQ_END);
+            msgq_get(uc->get_mq, MSGQ_INT, &id, MSGQ_INT32, &request, MSGQ_INT, &dir, MSGQ_END);
             reply = validate_direction(uc, dir);
-            msgq_put(uc->put_mq, MSGQ_BOOL, reply, MSGQ_END);
-            FD_SET(uc->put_mq->fd, &write_fds);
+            msgq_put(uc->put_mq, MSGQ_INT32, request, MSGQ_BOOL, reply, MSGQ_END);
+            user_request_flush(uc);
             break;
         }
         case DC_MSG_VALIDATE_NICK: {
+            int32_t request;
             char *nick;
             bool reply;
+            bool want_download;
 
-            msgq_get(uc->get_mq, MSGQ_INT, &id, MSGQ_STR, &nick, MSGQ_END);
+            msgq_get(uc->get_mq, MSGQ_INT, &id, MSGQ_INT32, &request, MSGQ_STR, &nick, MSGQ_END);
             reply = validate_nick(uc, nick);
+            want_download = false;
             free(nick);
             if (uc->info != NULL) {
                 /* The user can only be DC_ACTIVE_SENT_PASSIVE if we are passive.
@@ -615,16 +934,15 @@ user_result_fd_readable(DCUserConn *uc)
                  */
                 if (uc->info->active_state == DC_ACTIVE_SENT_ACTIVE)
                     uc->info->active_state = DC_ACTIVE_UNKNOWN;
+                /* Tell whether we want to download too, to save the user
+                 * connection a round trip during the handshake. */
+                want_download = !has_user_conn(uc->info, DC_DIR_RECEIVE)
+                                 && (uc->queue_pos < uc->info->download_queue->cur);
             }
-            msgq_put(uc->put_mq, MSGQ_BOOL, reply, MSGQ_END);
-            FD_SET(uc->put_mq->fd, &write_fds);
+            msgq_put(uc->put_mq, MSGQ_INT32, request, MSGQ_BOOL, reply, MSGQ_BOOL, want_download, MSGQ_END);
+            user_request_flush(uc);
             break;
         }
-        case DC_MSG_GET_MY_NICK:
-            msgq_get(uc->get_mq, MSGQ_INT, &id, MSGQ_END);
-            msgq_put(uc->put_mq, MSGQ_STR, my_nick, MSGQ_END);
-            FD_SET(uc->put_mq->fd, &write_fds);
-            break;
         case DC_MSG_TRANSFER_STATUS:
             msgq_get(uc->get_mq, MSGQ_INT, &id, MSGQ_INT64, &uc->transfer_pos, MSGQ_END);
             break;
@@ -658,48 +976,40 @@ user_result_fd_readable(DCUserConn *uc)
                 warn(_("Cannot get current time - %s\n"), errstr);
             break;
         }
-        case DC_MSG_CHECK_DOWNLOAD:
-            msgq_get(uc->get_mq, MSGQ_INT, &id, MSGQ_END);
-            for (; uc->queue_pos < uc->info->download_queue->cur; uc->queue_pos++) {
-                DCQueuedFile *queued;
-                char *local_file;
-
-                queued = uc->info->download_queue->buf[uc->queue_pos];
-                if (queued->status != DC_QS_DONE) {
-                    local_file = resolve_download_file(uc->info, queued);
-                    uc->queued_valid = true;
-                    uc->transfer_file = xstrdup(queued->filename);
-                    uc->local_file = xstrdup(local_file);
-                    uc->occupied_slot = true;
-                    queued->status = DC_QS_PROCESSING;
-                    used_dl_slots++;
-                    msgq_put(uc->put_mq, MSGQ_STR, local_file, MSGQ_STR, uc->transfer_file, MSGQ_INT64, queued->length, MSGQ_INT, queued->flag, MSGQ_END);
-                    FD_SET(uc->put_mq->fd, &write_fds);
-                    free(local_file);
-                    return;
-                }
-            }
-            msgq_put(uc->put_mq, MSGQ_STR, NULL, MSGQ_STR, NULL, MSGQ_INT64, (uint64_t) 0, MSGQ_INT, DC_TF_NORMAL, MSGQ_END);
-            FD_SET(uc->put_mq->fd, &write_fds);
+        case DC_MSG_CHECK_DOWNLOAD: {
+            int32_t request;
+            bool can_segment;
+            bool can_send_leaves;
+
+            msgq_get(uc->get_mq, MSGQ_INT, &id, MSGQ_INT32, &request, MSGQ_BOOL, &can_segment, MSGQ_BOOL, &can_send_leaves, MSGQ_END);
+            check_download(uc, request, can_segment, can_send_leaves);
+            user_request_flush(uc);
             break;
+        }
         case DC_MSG_DOWNLOAD_ENDED: {
             bool success;
             char *reason;
+            void *roots;
+            size_t roots_size;
 
-            msgq_get(uc->get_mq, MSGQ_INT, &id, MSGQ_BOOL, &success, MSGQ_STR, &reason, MSGQ_END);
-            handle_ended_download(uc, success, reason);
+            msgq_get(uc->get_mq, MSGQ_INT, &id, MSGQ_BOOL, &success, MSGQ_STR, &reason, MSGQ_BLOB, &roots, &roots_size, MSGQ_END);
+            handle_ended_download(uc, success, reason, roots, roots_size);
             free(reason);
+            free(roots);
             break;
         }
         case DC_MSG_CHECK_UPLOAD: {
+            int32_t request;
             char *remote_file;
             char *local_file;
             int type;
             uint64_t size = 0;
             DCTransferFlag flag = DC_TF_NORMAL;
             bool permit_transfer = false;
+            uint32_t list_generation = 0;
+            bool hot = false;
 
-            msgq_get(uc->get_mq, MSGQ_INT, &id, MSGQ_INT, &type, MSGQ_STR, &remote_file, MSGQ_END);
+            msgq_get(uc->get_mq, MSGQ_INT, &id, MSGQ_INT32, &request, MSGQ_INT, &type, MSGQ_STR, &remote_file, MSGQ_END);
             local_file = resolve_upload_file(uc->info, type, remote_file, &flag, &size);
             free(remote_file);
             uc->transfer_file = NULL;
@@ -723,6 +1033,14 @@ user_result_fd_readable(DCUserConn *uc)
                 }
                 if (permit_transfer) {
                     uc->transfer_file = local_file;
+                    if (flag == DC_TF_LIST) {
+                        DCFileListBuffer *buffer = file_list_buffer_lookup(local_file);
+
+                        if (buffer != NULL)
+                            list_generation = buffer->generation;
+                    } else {
+                        hot = upload_file_is_hot(uc, local_file);
+                    }
                 } else {
                     free(local_file);
                     local_file = NULL;
@@ -730,8 +1048,8 @@ user_result_fd_readable(DCUserConn *uc)
             } else {
                 permit_transfer = true;
             }
-            msgq_put(uc->put_mq, MSGQ_BOOL, permit_transfer, MSGQ_STR, local_file, MSGQ_END);
-            FD_SET(uc->put_mq->fd, &write_fds);
+            msgq_put(uc->put_mq, MSGQ_INT32, request, MSGQ_BOOL, permit_transfer, MSGQ_STR, local_file, MSGQ_INT32, list_generation, MSGQ_BOOL, hot, MSGQ_END);
+            user_request_flush(uc);
             break;
         }
         case DC_MSG_UPLOAD_ENDED: {
@@ -759,6 +1077,20 @@ user_result_fd_readable(DCUserConn *uc)
     }
 }
 
+/* Copy the rate limit variables (in KiB/s) into the shared limits.
+ * Forked user connection processes see the change immediately.
+ */
+void
+update_transfer_limits(void)
+{
+    if (transfer_limits == NULL)
+        return;
+    ratelimit_set_rate(&transfer_limits->upload, (uint64_t) upload_limit * 1024);
+    ratelimit_set_rate(&transfer_limits->download, (uint64_t) download_limit * 1024);
+    transfer_limits->user_upload_rate = (uint64_t) user_upload_limit * 1024;
+    transfer_limits->user_download_rate = (uint64_t) user_download_limit * 1024;
+}
+
 void
 transfer_completion_generator(DCCompletionInfo *ci)
 {
@@ -930,7 +1262,7 @@ add_search_result(struct sockaddr_in *addr, char *results, uint32_t resultlen)
     memcpy(msg->data, results, resultlen);
 
     ptrv_append(search_udpmsg_out, msg);
-    FD_SET(search_socket, &write_fds);
+    reactor_watch_write(main_reactor, search_socket, (ReactorCallback) search_now_writable, NULL);
 }
 
 static void
@@ -980,16 +1312,16 @@ search_now_writable(void)
         free(msg);
     }
 
-    FD_CLR(search_socket, &write_fds);
+    reactor_unwatch_write(main_reactor, search_socket);
 }
 
 static void
 disable_active(void)
 {
     if (listen_socket >= 0) {
+        reactor_unwatch_read(main_reactor, listen_socket);
         if (close(listen_socket) < 0)
             warn(_("Cannot close socket - %s\n"), errstr); /* XXX: (user connections server/listen socket) */
-        FD_CLR(listen_socket, &read_fds);
         listen_socket = -1;
     }
 }
@@ -1027,7 +1359,7 @@ enable_search(void)
         }
     }
 
-    FD_SET(search_socket, &read_fds);
+    reactor_watch_read(main_reactor, search_socket, (ReactorCallback) search_input_available, NULL);
 
     return true;
 }
@@ -1092,7 +1424,7 @@ enable_active(uint16_t port)
 
     screen_putf(_("Listening on %s.\n"), sockaddr_in_str(&addr));
     listen_port = ntohs(addr.sin_port);
-    FD_SET(listen_socket, &read_fds);
+    reactor_watch_read(main_reactor, listen_socket, (ReactorCallback) handle_listen_connection, NULL);
     return true;
 }
 
@@ -1109,12 +1441,15 @@ set_active(bool newactive, uint16_t port)
     }
     /* Start of disable_search. */
     if (search_socket >= 0) {
+        reactor_unwatch_read(main_reactor, search_socket);
+        reactor_unwatch_write(main_reactor, search_socket);
         if (close(search_socket) < 0)
             warn(_("Cannot close socket - %s\n"), errstr);
         search_socket = -1;
     }
     /* End of disable_search. */
-    enable_search();
+    if (enable_search() && search_udpmsg_out != NULL && search_udpmsg_out->cur > 0)
+        reactor_watch_write(main_reactor, search_socket, (ReactorCallback) search_now_writable, NULL);
     is_active = newactive;
     return true;
 }
@@ -1222,10 +1557,22 @@ main (int argc, char **argv)
         goto cleanup;
     }
 
-    FD_ZERO(&read_fds);
-    FD_ZERO(&write_fds);
-    FD_SET(signal_pipe[0], &read_fds);
-    /*FD_SET(STDIN_FILENO, &read_fds);*/
+    main_reactor = reactor_new();
+    if (main_reactor == NULL) {
+        warn(_("Cannot create event reactor - %s\n"), errstr);
+        goto cleanup;
+    }
+    reactor_watch_read(main_reactor, signal_pipe[0], (ReactorCallback) read_signal_input, NULL);
+
+    transfer_limits = mmap(NULL, sizeof(DCTransferLimits), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if (transfer_limits == MAP_FAILED) {
+        transfer_limits = NULL;
+        warn(_("Cannot allocate shared memory - %s\n"), errstr);
+        goto cleanup;
+    }
+    ratelimit_init(&transfer_limits->upload, 0);
+    ratelimit_init(&transfer_limits->download, 0);
+    update_transfer_limits();
 
     hub_recvq = byteq_new(128);
     hub_sendq = byteq_new(128);
@@ -1289,64 +1636,15 @@ main (int argc, char **argv)
     screen_prepare();
 
     while (running) {
-        fd_set res_read_fds;
-        fd_set res_write_fds;
         int res;
-        struct timeval tv;
-        tv.tv_sec = 1;
-        tv.tv_usec = 0;
 
         screen_redisplay_prompt();
 
-        res_read_fds = read_fds;
-        res_write_fds = write_fds;
-        res = TEMP_FAILURE_RETRY(select(FD_SETSIZE, &res_read_fds, &res_write_fds, NULL, &tv));
+        res = TEMP_FAILURE_RETRY(reactor_dispatch(main_reactor, -1));
         if (res < 0) {
-            warn(_("Cannot select - %s\n"), errstr);
+            warn(_("Cannot wait for events - %s\n"), errstr);
             break;
         }
-
-        if (running && FD_ISSET(signal_pipe[0], &res_read_fds))
-            read_signal_input();
-        if (running && FD_ISSET(STDIN_FILENO, &res_read_fds))
-            screen_read_input();
-        if (running && listen_socket >= 0 && FD_ISSET(listen_socket, &res_read_fds))
-            handle_listen_connection();
-        if (running && hub_socket >= 0 && FD_ISSET(hub_socket, &res_read_fds))
-            hub_input_available();
-        if (running && hub_socket >= 0 && FD_ISSET(hub_socket, &res_write_fds))
-            hub_now_writable();
-        if (running)
-            check_hub_activity();
-        if (running && search_socket >= 0 && FD_ISSET(search_socket, &res_read_fds))
-            search_input_available();
-        if (running && search_socket >= 0 && FD_ISSET(search_socket, &res_write_fds))
-            search_now_writable();
-        if (running && FD_ISSET(lookup_request_mq->fd, &res_write_fds))
-            lookup_request_fd_writable();
-        if (running && FD_ISSET(lookup_result_mq->fd, &res_read_fds))
-            lookup_result_fd_readable();
-        if (running && FD_ISSET(parse_request_mq->fd, &res_write_fds))
-            parse_request_fd_writable();
-        if (running && FD_ISSET(parse_result_mq->fd, &res_read_fds))
-            parse_result_fd_readable();
-        if (running && FD_ISSET(update_request_mq->fd, &res_write_fds))
-            update_request_fd_writable();
-        if (running && FD_ISSET(update_result_mq->fd, &res_read_fds))
-            update_result_fd_readable();
-
-        if (running) {
-            HMapIterator it;
-
-            hmap_iterator(user_conns, &it);
-            while (running && it.has_next(&it)) {
-                DCUserConn *uc = it.next(&it);
-                if (uc->put_mq != NULL && FD_ISSET(uc->put_mq->fd, &res_write_fds))
-                    user_request_fd_writable(uc);
-                if (uc->get_mq != NULL && FD_ISSET(uc->get_mq->fd, &res_read_fds))
-                    user_result_fd_readable(uc);
-            }
-        }
     }
 
 cleanup:
@@ -1377,6 +1675,8 @@ cleanup:
     hmap_foreach_value(user_conns, user_conn_cancel);
     /* XXX: follow up and wait for user connections to die? */
     hmap_free(user_conns);
+    for (c = 0; c < RECENT_UPLOADS; c++)
+        free(recent_uploads[c]);
 
     if (our_filelist != NULL)
         filelist_free(our_filelist);
@@ -1438,6 +1738,9 @@ cleanup:
         warn(_("Cannot close signal pipe - %s\n"), errstr);
     if (signal_pipe[1] >= 0 && close(signal_pipe[1]) < 0)
         warn(_("Cannot close signal pipe - %s\n"), errstr);
+    reactor_free(main_reactor);
+    if (transfer_limits != NULL)
+        munmap(transfer_limits, sizeof(DCTransferLimits));
 
     free(config_file);
 
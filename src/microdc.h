@@ -34,12 +34,22 @@
 #include "common/error.h"
 #include "common/hmap.h"
 #include "common/msgq.h"
+#include "common/ratelimit.h"
+#include "common/reactor.h"
 
 #define DC_CLIENT_BASE_KEY 5
 #define DC_HUB_TCP_PORT 411
 #define DC_CLIENT_UDP_PORT 412
 #define DC_USER_MAX_CONN 2
 
+#define DC_TTH_LENGTH 39		/* Length of a base32 encoded Tiger tree root */
+#define DC_TTH_SIZE 24			/* Size of a Tiger tree hash */
+/* Segmented downloads are split in segments of this size, and each
+ * segment is verified as a subtree of the Tiger tree. */
+#define DC_SEGMENT_SIZE (1024*1024)
+/* Times a file that fails verification is repaired before giving up. */
+#define DC_SEGMENT_MAX_REPAIRS 3
+
 #define SEARCH_TIME_THRESHOLD 60        /* Add no more results to searches after this many seconds elapsed */
 
 typedef enum {
@@ -63,6 +73,7 @@ typedef enum {
 typedef enum {
     DC_TF_NORMAL,		/* Normal file transfer */
     DC_TF_LIST,			/* Transfer of MyList.DcLst */
+    DC_TF_LEAVES,		/* Transfer of the TTH leaves of a file, to repair it */
 } DCTransferFlag;
 
 typedef enum {
@@ -86,12 +97,13 @@ typedef enum {
     DC_USER_LOCK,  	    	/* Waiting for $Lock */
     DC_USER_DIRECTION,     	/* Waiting for $Direction */
     DC_USER_SUPPORTS,     	/* Waiting for $Supports */
-    DC_USER_KEY,                /* Waiting for $Key */
+    DC_USER_KEY,                /* Waiting for the first file to download (only when receiving) */
     DC_USER_GET,   	    	/* Waiting for $Get (only when sending) */
     DC_USER_SEND_GET,  	    	/* Waiting for $Send or $Get (only when sending) */
     DC_USER_FILE_LENGTH,   	/* Waiting for $FileLength (only when receiving) */
     DC_USER_DATA_RECV,  	/* Waiting for file data (only when receiving) */
     DC_USER_DATA_SEND,
+    DC_USER_IDLE,		/* Waiting for main to queue more files (only when receiving) */
 } DCUserState;
 
 typedef enum {
@@ -116,12 +128,13 @@ typedef enum {
     DC_LS_TTH_MODE  = 2,
 } DCLsMode;
 
+/* Messages from user connections to main. Those that main replies to
+ * carry a request id after the message type, which main puts first in
+ * the reply. */
 typedef enum {
     DC_MSG_SCREEN_PUT,
-    DC_MSG_WANT_DOWNLOAD,
     DC_MSG_VALIDATE_DIR,
     DC_MSG_VALIDATE_NICK,
-    DC_MSG_GET_MY_NICK,
     DC_MSG_CHECK_DOWNLOAD,	/* get information on next download, allocate slot. */
     DC_MSG_CHECK_UPLOAD,	/* check that upload is allowed, allocate slot. */
     DC_MSG_UPLOAD_ENDED,	/* free slot and print info about upload. */
@@ -164,6 +177,22 @@ typedef enum {
     DC_SORT_MASK = (~DC_SORT_ASC)
 } DCUserSortType;
 
+typedef enum {
+    DC_ENGINE_PROCESS,	/* one forked process per user connection */
+    DC_ENGINE_REACTOR,	/* user connections run in the main process reactor */
+} DCTransferEngine;
+
+/* Transfer rate limits. This lives in memory shared with forked user
+ * connection processes, so that all transfers draw from the same buckets.
+ * The per-user rates are copied into each connection's own bucket.
+ */
+typedef struct _DCTransferLimits {
+    RateLimit upload;
+    RateLimit download;
+    uint64_t user_upload_rate;	/* bytes per second, 0 for unlimited */
+    uint64_t user_download_rate;
+} DCTransferLimits;
+
 typedef struct _DCUserConn DCUserConn;
 typedef struct _DCUserInfo DCUserInfo;
 typedef struct _DCFileList DCFileList;
@@ -175,9 +204,13 @@ typedef struct _DCSearchRequest DCSearchRequest;
 typedef struct _DCUDPMessage DCUDPMessage;
 typedef struct _DCSearchResponse DCSearchResponse;
 typedef struct _DCQueuedFile DCQueuedFile;
+typedef struct _DCSegmentedFile DCSegmentedFile;
+typedef struct _DCFileListBuffer DCFileListBuffer;
+typedef struct _DCHashWorker DCHashWorker;
 typedef struct _DCVariable DCVariable;
 typedef struct _DCLookup DCLookup; /* defined in lookup.c */
 typedef struct _DCFileListParse DCFileListParse; /* defined in filelist-in.c */
+typedef struct _DCUserConnLocal DCUserConnLocal; /* defined in user.c */
 
 typedef void (*DCCompletorFunction)(DCCompletionInfo *ci);
 typedef void (*DCBuiltinCommandHandler)(int argc, char **argv);
@@ -291,20 +324,65 @@ struct _DCFileList {
             char    has_tth;
             char    tth[39];
             time_t  mtime;
+            uint64_t location;	/* where the file starts on disk, to order hashing */
         } reg;
         struct {
             char *real_path;
             HMap *children;
+            dev_t dev;	/* device of real_path, 0 until a file in it has been seen */
         } dir;
     };
 };
 
+struct _DCHashWorker {
+    pid_t pid;
+    MsgQ *request_mq;
+    MsgQ *result_mq;
+    DCFileList *hashing;	/* file being hashed, NULL if idle */
+    dev_t dev;			/* device of hashing */
+    bool discard;		/* hashing was removed from the share, drop the result */
+    void *userdata;
+};
+
+/* Each message from a hash worker starts with one of these. */
+typedef enum {
+    DC_HASH_RESULT,		/* STR root, BLOB leaves, INT64 elapsed and CPU usec */
+    DC_HASH_PROGRESS,		/* INT64 bytes hashed so far */
+} DCHashMessage;
+
 struct _DCQueuedFile {
     char *filename;  /* XXX: should make this relative, not absolute */
     char *base_path; /* XXX: so that catfiles(base_path, filename) works. */
     DCTransferFlag flag;
     DCQueuedStatus status;
     uint64_t length;
+    DCSegmentedFile *segmented; /* non-NULL if downloaded in segments from all sources of the same TTH */
+    bool no_leaves;		/* the user could not send the TTH leaves of segmented */
+};
+
+struct _DCSegmentedFile {
+    uint32_t refcount;
+    char *tth;		/* upper case root hash, key of segmented_files */
+    char *local_file;	/* the .part file, in filesystem charset */
+    char *map_file;	/* segments done, saved for resuming */
+    uint64_t size;
+    uint32_t segment_count;
+    uint32_t done_count;
+    uint8_t *segments;	/* state of each segment */
+    uint8_t *roots;	/* Tiger tree root of each segment done, DC_TTH_SIZE bytes each */
+    bool repair;	/* failed verification, the TTH leaves are needed to repair it */
+    uint32_t repairs;	/* times the file has been repaired */
+    time_t last_search;	/* when more sources were last searched for */
+};
+
+/* A published file list, mapped into memory so that it can be
+ * uploaded without reading it from disk. */
+struct _DCFileListBuffer {
+    uint32_t refcount;
+    uint32_t generation;	/* changes each time a new list is published */
+    char *filename;	/* the list file in listing_dir */
+    void *data;		/* NULL if size is 0 */
+    size_t size;
 };
 
 struct _DCUserInfo {
@@ -330,17 +408,26 @@ struct _DCUserConn {
     bool disconnecting;
     DCUserInfo *info;	/* if info!=NULL then info->conn must contain this DCUserConn. */
     DCTransferDirection dir;
-    pid_t pid;
+    pid_t pid;		/* -1 if running in the main process */
+    DCUserConnLocal *local; /* non-NULL if running in the main process */
     //int main_socket;
     //IPC *ipc;
     MsgQ *get_mq;
     MsgQ *put_mq;	/* Note: The main process may only put message on put_mq as a result of
-                         * a message just received on get_mq.
+                         * a message just received on get_mq, or to reply to idle_request.
                          */
     bool occupied_slot; /* true if used_*_slots were increased for this user connection */
     bool occupied_minislot; /* true if used_mini_slots were increased for this user connection */
     uint32_t queue_pos;
     bool queued_valid;		/* true unless the QueuedFile by queue_pos has been removed */
+    DCSegmentedFile *segmented; /* non-NULL if downloading a segment of this file */
+    uint64_t segment_start;
+    uint64_t segment_length;
+    bool fetching_leaves;	/* getting the TTH leaves of segmented to repair it */
+    bool idle;			/* no more files to download, waiting for new ones */
+    int32_t idle_request;	/* the DC_MSG_CHECK_DOWNLOAD request to reply to when idle */
+    bool idle_can_segment;
+    bool idle_can_send_leaves;
     char *transfer_file;
     char *local_file;
     bool transferring;
@@ -379,6 +466,13 @@ extern HMap *pending_userinfo;
 extern uint32_t display_flags;
 extern uint32_t log_flags;
 extern DCUserSortType user_sort_order;
+extern DCTransferEngine transfer_engine;
+extern uint32_t upload_limit;
+extern uint32_t download_limit;
+extern uint32_t user_upload_limit;
+extern uint32_t user_download_limit;
+extern uint32_t idle_connections;
+extern uint32_t idle_connection_timeout;
 
 extern uint16_t listen_port;
 extern char *my_tag;
@@ -392,8 +486,7 @@ extern char *listing_dir;
 extern bool is_active;
 extern bool auto_reconnect;
 extern uint32_t my_ul_slots;
-extern fd_set read_fds;
-extern fd_set write_fds;
+extern Reactor *main_reactor;
 extern char *my_password;
 extern PtrV *delete_files;  /* XXX: use LList? */
 extern PtrV *delete_dirs;   /* XXX: use LList? */
@@ -423,7 +516,7 @@ void hub_connect(struct sockaddr_in *addr);
 void hub_disconnect(void);
 void hub_reconnect(void);
 void hub_now_writable(void);
-void check_hub_activity();
+void schedule_hub_activity_check();
 bool send_my_info(void);
 extern struct sockaddr_in hub_addr;
 extern char *hub_name;
@@ -473,6 +566,9 @@ char *huffman_encode(const uint8_t *data, uint32_t data_size, uint32_t *out_size
 
 /* user.c */
 void user_main(int get_fd[2], int put_fd[2], struct sockaddr_in *addr, int sock);
+bool user_local_start(DCUserConn *uc, struct sockaddr_in *addr, int sock);
+void user_local_release(DCUserConnLocal *ucl);
+void user_local_replied(DCUserConnLocal *ucl);
 
 /* main.c */
 /*bool get_user_conn_status(DCUserConn *uc);*/
@@ -484,6 +580,9 @@ uint32_t get_user_conn_count(DCUserInfo *info);
 bool get_package_file(const char *name, char **outname);
 void transfer_completion_generator(DCCompletionInfo *ci);
 void user_conn_cancel(DCUserConn *uc);
+bool user_conn_wake(DCUserInfo *ui);
+void user_conn_trim_idle(void);
+void user_conn_dispatch(DCUserConn *uc);
 void warn_file_error(int res, bool write, const char *filename);
 void warn_socket_error(int res, bool write, const char *subject, ...);
 void add_search_result(struct sockaddr_in *addr, char *results, uint32_t resultlen);
@@ -493,6 +592,8 @@ DCUserConn *user_connection_new(struct sockaddr_in *addr, int socket);
 char *user_conn_status_to_string(DCUserConn *uc, time_t now);
 extern uint64_t bytes_received;
 extern uint64_t bytes_sent;
+extern DCTransferLimits *transfer_limits;
+void update_transfer_limits(void);
 
 /* fs.c */
 DCFileList *new_file_node(const char *name, DCFileType type, DCFileList *parent);
@@ -557,6 +658,7 @@ bool parse_ip_and_port(char *source, struct sockaddr_in *addr, uint16_t defport)
 char *join_strings(char **strs, int count, char mid);
 PtrV *wordwrap(const char *str, size_t len, size_t first_width, size_t other_width);
 struct dirent *xreaddir(DIR *dh);
+PtrV *xreaddir_by_inode(DIR *dh);
 
 #define LONGEST_ELAPSED_TIME 22 /* 123456789012dNNhNNmNNs */
 char *elapsed_time_to_string(time_t elapsed, char *buf);
@@ -573,6 +675,21 @@ char *search_selection_to_string(DCSearchSelection *sr);
 void search_string_new(DCSearchString *sp, const char *p, int len);
 void search_hash_new(DCSearchString *sp, const char *p, int len);
 void search_string_free(DCSearchString *sp);
+void send_tth_search(const char *tth);
+
+/* segment.c */
+DCSegmentedFile *segmented_file_get(const char *tth, uint64_t size, const char *local_file);
+void segmented_file_unref(DCSegmentedFile *sf);
+bool segmented_file_is_complete(DCSegmentedFile *sf);
+bool segmented_file_reserve(DCSegmentedFile *sf, bool to_end, uint64_t *offset, uint64_t *length);
+void segmented_file_release(DCSegmentedFile *sf, uint64_t offset, uint64_t length, const uint8_t *roots, size_t roots_size);
+int segmented_file_verify(DCSegmentedFile *sf);
+void segmented_file_reset(DCSegmentedFile *sf);
+int segmented_file_repair(DCSegmentedFile *sf, const uint8_t *leaves, size_t leaves_size);
+bool segmented_file_leaves_failed(DCSegmentedFile *sf, DCQueuedFile *queued);
+void segmented_file_finish(DCSegmentedFile *sf);
+bool segmented_file_add_source(DCSegmentedFile *sf, DCUserInfo *ui, const char *filename);
+void segmented_file_search_result(DCSearchResponse *sr);
 
 /* variables.c */
 void cmd_set(int argc, char **argv);
@@ -602,12 +719,21 @@ void parse_request_fd_writable(void);
 void* data_to_filelist(void *dataptr, DCFileList **outnode);
 void  filelist_to_data(DCFileList *node, void **dataptr, size_t *sizeptr);
 
+/* hash.c */
+DCHashWorker *hash_worker_new(PtrV *others);
+void hash_worker_free(DCHashWorker *worker);
+void hash_worker_set_idle_io(DCHashWorker *worker, bool idle);
+uint64_t file_disk_location(const char *filename, const struct stat *st);
+
 /* local_flist.c */
 extern MsgQ *update_request_mq;
 extern MsgQ *update_result_mq;
 extern pid_t update_child;
 extern char* update_status;
 extern time_t filelist_refresh_timeout;
+extern uint32_t hash_workers;
+extern bool hash_sidecars;
+extern bool hash_idle_io;
 bool local_file_list_update_init(void);
 bool local_file_list_init(void);
 void local_file_list_update_finish(void);
@@ -617,6 +743,11 @@ bool update_request_set_listing_dir(const char* dir);
 bool update_request_set_hub_charset(const char* charset);
 bool update_request_set_fs_charset(const char* charset);
 bool update_request_set_filelist_refresh_timeout(time_t seconds);
+bool update_request_set_hash_workers(uint32_t count);
+bool update_request_set_hash_sidecars(bool enabled);
+bool update_request_set_hash_idle_io(bool enabled);
+DCFileListBuffer *file_list_buffer_lookup(const char *filename);
+void file_list_buffer_unref(DCFileListBuffer *buffer);
 /*
 DCFileListParse *add_parse_request(DCFileListParseCallback callback, const char *filename, void *userdata);
 void cancel_parse_request(DCFileListParse *parse);
@@ -312,7 +312,7 @@ user_input(char *line)
             screen_state = SCREEN_RL_DISPLAYED;
     } else {
         rl_callback_handler_remove();
-        FD_CLR(STDIN_FILENO, &read_fds);
+        reactor_unwatch_read(main_reactor, STDIN_FILENO);
         screen_state = SCREEN_NO_HANDLER;
     }
 }
@@ -343,7 +343,7 @@ screen_suspend(void)
 {
     if (screen_state == SCREEN_RL_DISPLAYED || screen_state == SCREEN_RL_CLEARED) {
         rl_callback_handler_remove();
-        FD_CLR(STDIN_FILENO, &read_fds);
+        reactor_unwatch_read(main_reactor, STDIN_FILENO);
         if (screen_state == SCREEN_RL_DISPLAYED)
             putchar('\n');
         suspend_msgs = ptrv_new();
@@ -383,7 +383,7 @@ screen_finish(void)
         rl_callback_handler_remove();
         if (screen_state == SCREEN_RL_DISPLAYED)
             putchar('\n');
-        FD_CLR(STDIN_FILENO, &read_fds);
+        reactor_unwatch_read(main_reactor, STDIN_FILENO);
     }
 
     if (screen_state >= SCREEN_NO_HANDLER) {
@@ -601,7 +601,7 @@ screen_prepare(void)
     }
     if (screen_state == SCREEN_NO_HANDLER) {
         rl_callback_handler_install(screen_prompt, user_input);
-        FD_SET(STDIN_FILENO, &read_fds);
+        reactor_watch_read(main_reactor, STDIN_FILENO, (ReactorCallback) screen_read_input, NULL);
     } else if (screen_state == SCREEN_RL_CLEARED) {
         rl_set_prompt(screen_prompt);
         rl_redisplay();
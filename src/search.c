@@ -28,6 +28,7 @@
 #include <time.h>		/* ? */
 #include "xalloc.h"		/* Gnulib */
 #include "xstrndup.h"		/* Gnulib */
+#include "xvasprintf.h"		/* Gnulib */
 #include "quotearg.h"		/* Gnulib */
 #include "gettext.h"		/* Gnulib/GNU gettext */
 #define _(s) gettext(s)
@@ -637,6 +638,19 @@ compare_search_selection(DCSearchSelection *s1, DCSearchSelection *s2)
     return 0;
 }
 
+static void
+send_search(DCSearchDataType datatype, const char *hub_args)
+{
+    if (is_active) {
+        hub_putf("$Search %s:%u F?F?0?%d?%s|", inet_ntoa(local_addr.sin_addr), listen_port, datatype, hub_args);
+    } else {
+        char *hub_my_nick;
+        hub_my_nick = main_to_hub_string(my_nick);
+        hub_putf("$Search Hub:%s F?F?0?%d?%s|", hub_my_nick, datatype, hub_args);
+        free(hub_my_nick);
+    }
+}
+
 bool
 add_search_request_type(char *args, DCSearchDataType datatype)
 {
@@ -707,21 +721,25 @@ add_search_request_type(char *args, DCSearchDataType datatype)
 
     /* convert search string from local to hub charset */
     hub_args = main_to_hub_string(args);
-
-    if (is_active) {
-        hub_putf("$Search %s:%u F?F?0?%d?%s|", inet_ntoa(local_addr.sin_addr), listen_port, datatype, hub_args);
-    } else {
-        char *hub_my_nick;
-        hub_my_nick = main_to_hub_string(my_nick);
-        hub_putf("$Search Hub:%s F?F?0?%d?%s|", hub_my_nick, datatype, hub_args);
-        free(hub_my_nick);
-    }
-
+    send_search(datatype, hub_args);
     free(hub_args);
 
     return true;
 }
 
+/* Search for sources of a file without adding a search request.
+ * The results are picked up by segmented_file_search_result.
+ */
+void
+send_tth_search(const char *tth)
+{
+    char *hub_args;
+
+    hub_args = xasprintf("TTH:%s", tth);
+    send_search(DC_SEARCH_CHECKSUM, hub_args);
+    free(hub_args);
+}
+
 bool
 add_search_request(char *args)
 {
@@ -757,6 +775,7 @@ handle_search_result(char *buf, uint32_t len)
         warn(_("Unterminated or invalid $SR, discarding: %s\n"), quotearg_mem(buf, len));
         return;
     }
+    segmented_file_search_result(sr);
 
     for (c = 0; c < our_searches->cur; c++) {
         DCSearchRequest *sd = our_searches->buf[c];
@@ -0,0 +1,674 @@
+/* segment.c - Segmented downloads from multiple sources
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <config.h>
+#include <ctype.h>		/* C89 */
+#include <errno.h>		/* C89 */
+#include <stdio.h>		/* C89 */
+#include <stdlib.h>		/* C89 */
+#include <string.h>		/* C89 */
+#include <inttypes.h>		/* ? */
+#include <time.h>		/* ? */
+#include <fcntl.h>		/* POSIX */
+#include <unistd.h>		/* POSIX */
+#include <sys/stat.h>		/* POSIX */
+#include <sys/param.h>		/* MIN, MAX */
+#include "xalloc.h"		/* Gnulib */
+#include "xstrndup.h"		/* Gnulib */
+#include "xvasprintf.h"		/* Gnulib */
+#include "full-read.h"		/* Gnulib */
+#include "quotearg.h"		/* Gnulib */
+#include "quote.h"		/* Gnulib */
+#include "dirname.h"		/* Gnulib */
+#include "gettext.h"		/* Gnulib/GNU gettext */
+#define _(s) gettext(s)
+#define N_(s) gettext_noop(s)
+#include "tth/tigertree.h"
+#include "tth/base32.h"
+#include "microdc.h"
+
+/* A download reserves a run of missing segments, at most a quarter of
+ * what is missing (so that other sources get something to do) and at
+ * most SEGMENT_MAX_RUN.
+ */
+#define SEGMENT_SPLIT 4
+#define SEGMENT_MAX_RUN 64
+/* How often to search for more sources of an incomplete file, and how
+ * often to check if it is time to do that for some file. Only one file
+ * is searched for at a time, not to trigger flood protection in hubs.
+ */
+#define SOURCE_SEARCH_INTERVAL (10*60)	/* seconds */
+#define SOURCE_SEARCH_CHECK_INTERVAL 60	/* seconds */
+
+#define SEGMENT_MAP_SUFFIX ".segments"
+/* The map has a line for each segment, with its base32 encoded root
+ * if it is done, or one of these. */
+#define SEGMENT_MAP_MISSING "-"
+#define SEGMENT_MAP_UNHASHED "?"
+
+typedef enum {
+    DC_SEGMENT_MISSING,
+    DC_SEGMENT_ACTIVE,		/* reserved by a download */
+    DC_SEGMENT_DONE,
+    DC_SEGMENT_UNHASHED,	/* done, but its root is not known */
+} DCSegmentState;
+
+#define SEGMENT_IS_DONE(s) ((s) >= DC_SEGMENT_DONE)
+
+static HMap *segmented_files = NULL;	/* TTH -> DCSegmentedFile */
+static ReactorTimer *source_search_timer = NULL;
+
+static void
+normalize_tth(char *tth)
+{
+    for (; *tth != '\0'; tth++)
+        *tth = toupper(*tth);
+}
+
+/* Save which segments are done, and their roots. The map is written to a temporary
+ * file first, so that an interrupted write never leaves a map that
+ * claims segments that were not downloaded.
+ */
+static void
+save_segment_map(DCSegmentedFile *sf)
+{
+    char *tmp_file;
+    FILE *fh;
+    uint32_t c;
+
+    tmp_file = xasprintf("%s.tmp", sf->map_file);
+    fh = fopen(tmp_file, "w");
+    if (fh == NULL) {
+        warn(_("%s: Cannot open file for writing - %s\n"), quotearg(tmp_file), errstr);
+        free(tmp_file);
+        return;
+    }
+    fprintf(fh, "%s %" PRIu64 " %d\n", sf->tth, sf->size, DC_SEGMENT_SIZE);
+    for (c = 0; c < sf->segment_count; c++) {
+        if (sf->segments[c] == DC_SEGMENT_DONE) {
+            char *root = base32_encode(sf->roots + c*DC_TTH_SIZE, DC_TTH_SIZE);
+            fprintf(fh, "%s\n", root);
+            free(root);
+        } else {
+            fprintf(fh, "%s\n", sf->segments[c] == DC_SEGMENT_UNHASHED ? SEGMENT_MAP_UNHASHED : SEGMENT_MAP_MISSING);
+        }
+    }
+    if (fclose(fh) != 0) {
+        warn(_("%s: Cannot close file - %s\n"), quotearg(tmp_file), errstr);
+        unlink(tmp_file);
+    } else if (rename(tmp_file, sf->map_file) < 0) {
+        warn(_("%s: Cannot rename file to %s - %s\n"), quotearg_n(0, tmp_file), quote_n(1, sf->map_file), errstr);
+    }
+    free(tmp_file);
+}
+
+/* Find out which segments have been downloaded already. If there is
+ * no segment map, the .part file may be left from an ordinary download
+ * and then everything up to its size is probably done. Segments whose
+ * root is not known are hashed and compared with the TTH leaves before
+ * they are trusted, see segmented_file_repair.
+ */
+static void
+load_segment_map(DCSegmentedFile *sf)
+{
+    char tth[40];
+    char line[DC_TTH_LENGTH+2];
+    uint64_t size;
+    int segment_size;
+    struct stat st;
+    FILE *fh;
+    uint32_t c;
+
+    fh = fopen(sf->map_file, "r");
+    if (fh == NULL) {
+        size_t len = strlen(sf->local_file);
+
+        if (len > 5 && strcmp(sf->local_file + len - 5, ".part") == 0
+                && stat(sf->local_file, &st) == 0 && S_ISREG(st.st_mode)) {
+            uint64_t done = MIN((uint64_t) st.st_size, sf->size);
+
+            for (c = 0; c < sf->segment_count && MIN((uint64_t) (c+1) * DC_SEGMENT_SIZE, sf->size) <= done; c++) {
+                sf->segments[c] = DC_SEGMENT_UNHASHED;
+                sf->done_count++;
+            }
+            sf->repair = (c > 0);
+        }
+        return;
+    }
+    if (fscanf(fh, "%39s %" SCNu64 " %d\n", tth, &size, &segment_size) != 3
+            || strcasecmp(tth, sf->tth) != 0 || size != sf->size || segment_size != DC_SEGMENT_SIZE) {
+        warn(_("%s: Ignoring invalid segment map\n"), quotearg(sf->map_file));
+        fclose(fh);
+        return;
+    }
+    for (c = 0; c < sf->segment_count && fgets(line, sizeof(line), fh) != NULL; c++) {
+        line[strcspn(line, "\n")] = '\0';
+        if (strcmp(line, SEGMENT_MAP_UNHASHED) == 0) {
+            sf->segments[c] = DC_SEGMENT_UNHASHED;
+            sf->done_count++;
+            sf->repair = true;
+        } else if (strlen(line) == DC_TTH_LENGTH
+                   && base32_decode(line, sf->roots + c*DC_TTH_SIZE, DC_TTH_SIZE) == DC_TTH_SIZE) {
+            sf->segments[c] = DC_SEGMENT_DONE;
+            sf->done_count++;
+        } else if (strcmp(line, SEGMENT_MAP_MISSING) != 0) {
+            break;
+        }
+    }
+    fclose(fh);
+}
+
+/* Search for more sources of the incomplete file that was searched for
+ * the longest time ago.
+ */
+static void
+search_for_sources(void *data)
+{
+    DCSegmentedFile *oldest = NULL;
+    HMapIterator it;
+    time_t now;
+
+    reactor_timer_set(source_search_timer, SOURCE_SEARCH_CHECK_INTERVAL * 1000);
+    if (hub_state < DC_HUB_LOGGED_IN || time(&now) == (time_t) -1)
+        return;
+    hmap_iterator(segmented_files, &it);
+    while (it.has_next(&it)) {
+        DCSegmentedFile *sf = it.next(&it);
+        if (!segmented_file_is_complete(sf) && (oldest == NULL || sf->last_search < oldest->last_search))
+            oldest = sf;
+    }
+    if (oldest != NULL && oldest->last_search + SOURCE_SEARCH_INTERVAL <= now) {
+        flag_putf(DC_DF_DEBUG, _("Searching for more sources of %s.\n"), quote(base_name(oldest->local_file)));
+        oldest->last_search = now;
+        send_tth_search(oldest->tth);
+    }
+}
+
+/* Remove sf from segmented_files, unless it has been removed already
+ * and another download of the same file has taken its place.
+ */
+static void
+forget_segmented_file(DCSegmentedFile *sf)
+{
+    if (segmented_files == NULL || hmap_get(segmented_files, sf->tth) != sf)
+        return;
+    hmap_remove(segmented_files, sf->tth);
+    if (hmap_is_empty(segmented_files)) {
+        hmap_free(segmented_files);
+        segmented_files = NULL;
+        reactor_timer_free(source_search_timer);
+        source_search_timer = NULL;
+    }
+}
+
+/* Return the segmented download of the file with root hash tth, creating
+ * it if necessary. local_file is the .part file in filesystem charset,
+ * and is only used if the file is new. The caller owns a reference to the
+ * returned file.
+ */
+DCSegmentedFile *
+segmented_file_get(const char *tth, uint64_t size, const char *local_file)
+{
+    DCSegmentedFile *sf;
+    char *key;
+
+    key = xstrndup(tth, DC_TTH_LENGTH);
+    normalize_tth(key);
+    if (segmented_files == NULL) {
+        segmented_files = hmap_new();
+        source_search_timer = reactor_timer_new(main_reactor, search_for_sources, NULL);
+        reactor_timer_set(source_search_timer, SOURCE_SEARCH_CHECK_INTERVAL * 1000);
+    }
+    sf = hmap_get(segmented_files, key);
+    if (sf != NULL) {
+        free(key);
+        sf->refcount++;
+        return sf;
+    }
+
+    sf = xmalloc(sizeof(DCSegmentedFile));
+    sf->refcount = 1;
+    sf->tth = key;
+    sf->local_file = xstrdup(local_file);
+    sf->map_file = xasprintf("%s%s", local_file, SEGMENT_MAP_SUFFIX);
+    sf->size = size;
+    sf->segment_count = (size + DC_SEGMENT_SIZE - 1) / DC_SEGMENT_SIZE;
+    sf->done_count = 0;
+    sf->segments = xcalloc(sf->segment_count, sizeof(uint8_t));
+    sf->roots = xmalloc(sf->segment_count * DC_TTH_SIZE);
+    sf->last_search = 0; /* search at the next check */
+    sf->repair = false;
+    sf->repairs = 0;
+    load_segment_map(sf);
+    hmap_put(segmented_files, sf->tth, sf);
+    return sf;
+}
+
+void
+segmented_file_unref(DCSegmentedFile *sf)
+{
+    sf->refcount--;
+    if (sf->refcount == 0) {
+        forget_segmented_file(sf);
+        free(sf->tth);
+        free(sf->local_file);
+        free(sf->map_file);
+        free(sf->segments);
+        free(sf->roots);
+        free(sf);
+    }
+}
+
+bool
+segmented_file_is_complete(DCSegmentedFile *sf)
+{
+    return sf->done_count == sf->segment_count;
+}
+
+/* Reserve the next part of the file to download. If to_end is true,
+ * the source can only send everything from an offset to the end of the
+ * file, and that is only done if no other source is downloading
+ * anything. Returns false if there is nothing to download.
+ */
+bool
+segmented_file_reserve(DCSegmentedFile *sf, bool to_end, uint64_t *offset, uint64_t *length)
+{
+    uint32_t missing = 0;
+    uint32_t first = sf->segment_count;
+    uint32_t run;
+    uint32_t c;
+
+    for (c = 0; c < sf->segment_count; c++) {
+        if (sf->segments[c] == DC_SEGMENT_ACTIVE && to_end)
+            return false;
+        if (sf->segments[c] == DC_SEGMENT_MISSING) {
+            if (first == sf->segment_count)
+                first = c;
+            missing++;
+        }
+    }
+    if (missing == 0)
+        return false;
+
+    run = to_end ? sf->segment_count - first : MIN(MAX(missing / SEGMENT_SPLIT, 1), SEGMENT_MAX_RUN);
+    for (c = first; c < first + run && c < sf->segment_count; c++) {
+        if (sf->segments[c] == DC_SEGMENT_ACTIVE)
+            break;
+        if (SEGMENT_IS_DONE(sf->segments[c]) && !to_end)
+            break;
+        if (sf->segments[c] == DC_SEGMENT_MISSING)
+            sf->segments[c] = DC_SEGMENT_ACTIVE;
+    }
+    *offset = (uint64_t) first * DC_SEGMENT_SIZE;
+    *length = MIN((uint64_t) c * DC_SEGMENT_SIZE, sf->size) - *offset;
+    return true;
+}
+
+/* Give back a part reserved with segmented_file_reserve. roots holds
+ * the roots of the segments downloaded from offset, roots_size bytes in
+ * all. The rest of the segments are available to other sources again.
+ */
+void
+segmented_file_release(DCSegmentedFile *sf, uint64_t offset, uint64_t length, const uint8_t *roots, size_t roots_size)
+{
+    uint32_t first = offset / DC_SEGMENT_SIZE;
+    uint32_t done_count = sf->done_count;
+    uint32_t c;
+
+    for (c = first; c < sf->segment_count && (uint64_t) c * DC_SEGMENT_SIZE < offset + length; c++) {
+        if (sf->segments[c] != DC_SEGMENT_ACTIVE)
+            continue;
+        if ((c - first + 1) * DC_TTH_SIZE <= roots_size) {
+            memcpy(sf->roots + c*DC_TTH_SIZE, roots + (c - first)*DC_TTH_SIZE, DC_TTH_SIZE);
+            sf->segments[c] = DC_SEGMENT_DONE;
+            sf->done_count++;
+        } else {
+            sf->segments[c] = DC_SEGMENT_MISSING;
+        }
+    }
+    if (sf->done_count != done_count)
+        save_segment_map(sf);
+}
+
+/* Compare the root of the Tiger tree of a complete file with its TTH.
+ * Segments are power of two sized subtrees. Returns 1 if the
+ * file is good, 0 if it is not and -1 if it cannot be verified because
+ * the roots of some segments are not known.
+ */
+int
+segmented_file_verify(DCSegmentedFile *sf)
+{
+    unsigned char tth[DC_TTH_SIZE];
+    unsigned char root[DC_TTH_SIZE];
+    uint32_t c;
+
+    for (c = 0; c < sf->segment_count; c++) {
+        if (sf->segments[c] != DC_SEGMENT_DONE)
+            return -1;
+    }
+    if (base32_decode(sf->tth, tth, DC_TTH_SIZE) != DC_TTH_SIZE)
+        return -1;
+
+    tt_combine(sf->roots, sf->segment_count, root);
+    return memcmp(root, tth, DC_TTH_SIZE) == 0;
+}
+
+/* Count the sources of the file, and those of them that could not
+ * send its TTH leaves. If clear is true, the sources are given another
+ * chance to send the leaves. If others is not NULL, the users that may
+ * still send the leaves are added to it.
+ */
+static uint32_t
+count_sources(DCSegmentedFile *sf, bool clear, uint32_t *no_leaves, PtrV *others)
+{
+    HMapIterator it;
+    uint32_t count = 0;
+
+    *no_leaves = 0;
+    hmap_iterator(hub_users, &it);
+    while (it.has_next(&it)) {
+        DCUserInfo *ui = it.next(&it);
+        uint32_t c;
+
+        for (c = 0; c < ui->download_queue->cur; c++) {
+            DCQueuedFile *queued = ui->download_queue->buf[c];
+
+            if (queued->segmented != sf)
+                continue;
+            if (clear)
+                queued->no_leaves = false;
+            if (queued->no_leaves)
+                (*no_leaves)++;
+            else if (others != NULL)
+                ptrv_append(others, ui);
+            count++;
+        }
+    }
+    return count;
+}
+
+/* Forget all segments of a file that failed verification, so that it
+ * is downloaded again. Segments being downloaded are left to their
+ * downloads.
+ */
+void
+segmented_file_reset(DCSegmentedFile *sf)
+{
+    uint32_t no_leaves;
+    uint32_t c;
+
+    for (c = 0; c < sf->segment_count; c++) {
+        if (sf->segments[c] != DC_SEGMENT_ACTIVE)
+            sf->segments[c] = DC_SEGMENT_MISSING;
+    }
+    sf->done_count = 0;
+    sf->repair = false;
+    count_sources(sf, true, &no_leaves, NULL);
+    save_segment_map(sf);
+}
+
+/* Called when the source queued could not send the TTH leaves needed
+ * to repair the file. queued may be NULL if it was unqueued meanwhile.
+ * The repair is left to the other sources, which are woken up or
+ * connected to in case they have nothing else to download. Once every
+ * source has failed, the segments cannot be trusted, so the whole file
+ * is downloaded again and true is returned.
+ */
+bool
+segmented_file_leaves_failed(DCSegmentedFile *sf, DCQueuedFile *queued)
+{
+    uint32_t no_leaves;
+    PtrV *others;
+    uint32_t c;
+
+    if (queued != NULL)
+        queued->no_leaves = true;
+    others = ptrv_new();
+    if (count_sources(sf, false, &no_leaves, others) == no_leaves) {
+        ptrv_free(others);
+        segmented_file_reset(sf);
+        return true;
+    }
+    sf->repair = true;
+    /* Waking a connection may end the repair, so the sources are
+     * collected first. */
+    sf->refcount++;
+    for (c = 0; c < others->cur && sf->repair; c++) {
+        DCUserInfo *ui = others->buf[c];
+
+        if (!user_conn_wake(ui) && !has_user_conn(ui, DC_DIR_RECEIVE) && ui->conn_count < DC_USER_MAX_CONN)
+            hub_connect_user(ui); /* Ignore errors */
+    }
+    segmented_file_unref(sf);
+    ptrv_free(others);
+    return false;
+}
+
+/* Compute the root of segment c from the data in the .part file.
+ * buf has room for DC_SEGMENT_SIZE bytes.
+ */
+static bool
+hash_segment(DCSegmentedFile *sf, int fd, uint32_t c, uint8_t *buf, unsigned char *root)
+{
+    uint64_t offset = (uint64_t) c * DC_SEGMENT_SIZE;
+    size_t len = MIN(sf->size - offset, DC_SEGMENT_SIZE);
+    TT_CONTEXT tt;
+
+    if (lseek(fd, offset, SEEK_SET) == (off_t) -1 || full_read(fd, buf, len) != len)
+        return false;
+    tt_init(&tt, NULL, 0);
+    tt_blocks(&tt, buf, len / BLOCKSIZE);
+    if (len % BLOCKSIZE != 0)
+        tt_leaf(&tt, buf + len - len % BLOCKSIZE, len % BLOCKSIZE);
+    tt_digest(&tt, root);
+    return true;
+}
+
+/* Hash the segments whose root is not known, so that they can be
+ * compared with the TTH leaves. Segments that cannot be read are
+ * missing.
+ */
+static void
+hash_unhashed_segments(DCSegmentedFile *sf)
+{
+    uint8_t *buf = NULL;
+    int fd;
+    uint32_t c;
+
+    fd = open(sf->local_file, O_RDONLY);
+    if (fd < 0 && errno != ENOENT)
+        warn(_("%s: Cannot open file for reading - %s\n"), quotearg(sf->local_file), errstr);
+    for (c = 0; c < sf->segment_count; c++) {
+        if (sf->segments[c] != DC_SEGMENT_UNHASHED)
+            continue;
+        if (buf == NULL)
+            buf = xmalloc(DC_SEGMENT_SIZE);
+        if (fd >= 0 && hash_segment(sf, fd, c, buf, sf->roots + c*DC_TTH_SIZE)) {
+            sf->segments[c] = DC_SEGMENT_DONE;
+        } else {
+            sf->segments[c] = DC_SEGMENT_MISSING;
+            sf->done_count--;
+        }
+    }
+    if (fd >= 0)
+        close(fd);
+    free(buf);
+}
+
+/* Find the segments of a file that are damaged, using the leaves of its
+ * Tiger tree (leaves_size bytes at leaves), and forget them so that only
+ * those are downloaded again. This is done when the file failed
+ * verification, and for segments found in the .part file whose roots
+ * are not known. Leaves are power of two sized subtrees of at least
+ * 1024 bytes, so either a group of leaves combine into the root of a
+ * segment, or a group of segment roots combine into a leaf. Returns the
+ * number of damaged segments, or -1 if the leaves are not of this file.
+ */
+int
+segmented_file_repair(DCSegmentedFile *sf, const uint8_t *leaves, size_t leaves_size)
+{
+    unsigned char tth[DC_TTH_SIZE];
+    unsigned char root[DC_TTH_SIZE];
+    uint64_t leaf_count;
+    uint64_t leaf_size;
+    uint32_t damaged = 0;
+    uint32_t no_leaves;
+    bool *bad;
+    uint32_t c;
+
+    if (leaves_size == 0 || leaves_size % DC_TTH_SIZE != 0)
+        return -1;
+    if (base32_decode(sf->tth, tth, DC_TTH_SIZE) != DC_TTH_SIZE)
+        return -1;
+    leaf_count = leaves_size / DC_TTH_SIZE;
+    tt_combine(leaves, leaf_count, root);
+    if (memcmp(root, tth, DC_TTH_SIZE) != 0)
+        return -1;
+    for (leaf_size = 1024; leaf_size * leaf_count < sf->size; leaf_size *= 2);
+    if ((MAX(sf->size, 1) + leaf_size - 1) / leaf_size != leaf_count)
+        return -1;
+
+    hash_unhashed_segments(sf);
+    count_sources(sf, true, &no_leaves, NULL);
+    bad = xcalloc(MAX(sf->segment_count, 1), sizeof(bool));
+    if (leaf_size <= DC_SEGMENT_SIZE) {
+        uint64_t per = DC_SEGMENT_SIZE / leaf_size;
+
+        for (c = 0; c < sf->segment_count; c++) {
+            if (sf->segments[c] != DC_SEGMENT_DONE)
+                continue;
+            tt_combine(leaves + c*per*DC_TTH_SIZE, MIN(per, leaf_count - c*per), root);
+            bad[c] = memcmp(root, sf->roots + c*DC_TTH_SIZE, DC_TTH_SIZE) != 0;
+        }
+    } else {
+        uint32_t per = leaf_size / DC_SEGMENT_SIZE;
+        uint32_t first;
+
+        for (first = 0; first < sf->segment_count; first += per) {
+            uint32_t count = MIN(per, sf->segment_count - first);
+
+            for (c = first; c < first + count; c++) {
+                if (sf->segments[c] != DC_SEGMENT_DONE)
+                    break;
+            }
+            if (c < first + count)
+                continue; /* the leaf cannot be compared yet */
+            tt_combine(sf->roots + first*DC_TTH_SIZE, count, root);
+            if (memcmp(root, leaves + (first / per)*DC_TTH_SIZE, DC_TTH_SIZE) != 0)
+                memset(bad + first, true, count * sizeof(bool));
+        }
+    }
+
+    for (c = 0; c < sf->segment_count; c++) {
+        if (bad[c]) {
+            sf->segments[c] = DC_SEGMENT_MISSING;
+            sf->done_count--;
+            damaged++;
+        }
+    }
+    free(bad);
+    save_segment_map(sf);
+    return damaged;
+}
+
+/* Called when the last segment has been downloaded. The queued file
+ * is done for all sources. The file is no longer found by TTH, so that
+ * queueing it again starts a new download.
+ */
+void
+segmented_file_finish(DCSegmentedFile *sf)
+{
+    HMapIterator it;
+
+    forget_segmented_file(sf);
+    if (unlink(sf->map_file) < 0 && errno != ENOENT)
+        warn(_("%s: Cannot remove file - %s\n"), quotearg(sf->map_file), errstr);
+
+    hmap_iterator(hub_users, &it);
+    while (it.has_next(&it)) {
+        DCUserInfo *ui = it.next(&it);
+        uint32_t c;
+
+        for (c = 0; c < ui->download_queue->cur; c++) {
+            DCQueuedFile *queued = ui->download_queue->buf[c];
+            if (queued->segmented == sf)
+                queued->status = DC_QS_DONE;
+        }
+    }
+}
+
+/* Queue the file for download from ui as well, unless it already is.
+ * filename is the name of the file on that user, in local namespace.
+ */
+bool
+segmented_file_add_source(DCSegmentedFile *sf, DCUserInfo *ui, const char *filename)
+{
+    DCQueuedFile *queued;
+    uint32_t c;
+
+    if (strcmp(ui->nick, my_nick) == 0)
+        return false;
+    for (c = 0; c < ui->download_queue->cur; c++) {
+        queued = ui->download_queue->buf[c];
+        if (queued->segmented == sf)
+            return false;
+    }
+
+    queued = xmalloc(sizeof(DCQueuedFile));
+    queued->filename = xstrdup(filename);
+    queued->base_path = xstrndup(filename, strrchr(filename, '/') + 1 - filename);
+    queued->flag = DC_TF_NORMAL;
+    queued->status = DC_QS_QUEUED;
+    queued->length = sf->size;
+    queued->segmented = sf;
+    queued->no_leaves = false;
+    sf->refcount++;
+    ptrv_append(ui->download_queue, queued);
+
+    if (!user_conn_wake(ui) && !has_user_conn(ui, DC_DIR_RECEIVE) && ui->conn_count < DC_USER_MAX_CONN)
+        hub_connect_user(ui); /* Ignore errors */
+    return true;
+}
+
+/* Add the user of a search result as a source if it has a file that we
+ * are downloading in segments.
+ */
+void
+segmented_file_search_result(DCSearchResponse *sr)
+{
+    DCSegmentedFile *sf;
+    char *tth;
+    char *filename;
+
+    if (segmented_files == NULL || sr->filetype != DC_TYPE_REG || strncmp(sr->hub_name, "TTH:", 4) != 0)
+        return;
+    tth = xstrndup(sr->hub_name + 4, DC_TTH_LENGTH);
+    normalize_tth(tth);
+    sf = hmap_get(segmented_files, tth);
+    free(tth);
+    if (sf == NULL || sf->size != sr->filesize || segmented_file_is_complete(sf))
+        return;
+
+    filename = translate_remote_to_local(sr->filename);
+    if (segmented_file_add_source(sf, sr->userinfo, filename)) {
+        flag_putf(DC_DF_SEARCH_RESULTS, _("Found another source of %s: %s.\n"),
+                  quote_n(0, base_name(sf->local_file)), quotearg_n(1, sr->userinfo->nick));
+    }
+    free(filename);
+}
@@ -0,0 +1,101 @@
+#!/bin/sh
+# hash-queue-delete.sh - Delete queued files while they wait to be hashed
+#
+# Copyright (C) 2026 agent <agent@local>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Library General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation,
+# Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+
+# A directory is shared and its hash worker is stopped, so that the files
+# stay in the hash queue. Some of them, including a whole subdirectory,
+# are then deleted and a refresh removes them from the file list. Once
+# the worker continues, the file list process must still be running and
+# the remaining files must be hashed.
+
+MICRODC2=${MICRODC2:-./microdc2}
+
+if ! command -v pgrep >/dev/null 2>&1 || ! command -v mkfifo >/dev/null 2>&1; then
+    echo "hash-queue-delete: pgrep or mkfifo missing, skipped"
+    exit 0
+fi
+
+tmp=`mktemp -d "${TMPDIR:-/tmp}/microdc2-test.XXXXXX"` || exit 1
+pid=
+trap 'test -n "$pid" && kill $pid 2>/dev/null; rm -rf "$tmp"' 0
+trap 'exit 1' 1 2 15
+
+hashed()
+{
+    grep -o 'TTH=' "$xml" | wc -l
+}
+
+fail()
+{
+    echo "hash-queue-delete: $*"
+    cat "$tmp/out"
+    exit 1
+}
+
+mkdir -p "$tmp/home/.microdc2" "$tmp/share/sub" || exit 1
+for f in f0 f1 f2 f3 sub/g0 sub/g1; do
+    dd if=/dev/urandom of="$tmp/share/$f" bs=1048576 count=16 2>/dev/null || exit 1
+done
+
+mkfifo "$tmp/in" || exit 1
+HOME="$tmp/home" TMPDIR="$tmp" "$MICRODC2" -n <"$tmp/in" >"$tmp/out" 2>&1 &
+pid=$!
+exec 3>"$tmp/in"
+echo "set filelist_refresh_interval 1" >&3
+echo "set hash_workers 1" >&3
+echo "share $tmp/share" >&3
+
+# The file list process is a child of microdc2, the workers its children.
+updater=
+workers=
+tries=0
+while test -z "$workers" && test $tries -lt 100; do
+    for child in `pgrep -P $pid`; do
+        workers=`pgrep -P $child` && updater=$child && break
+    done
+    workers=`echo $workers`
+    test -n "$workers" && break
+    sleep 0.1
+    tries=`expr $tries + 1`
+done
+test -n "$workers" || fail "no hash worker was started"
+kill -STOP $workers
+
+rm -rf "$tmp/share/f0" "$tmp/share/sub"
+sleep 3
+kill -CONT $workers
+
+xml=
+tries=0
+while test $tries -lt 30; do
+    xml=`echo "$tmp"/microdc2.$pid/files.xml`
+    test -f "$xml" && test `hashed` -eq 3 && break
+    sleep 1
+    tries=`expr $tries + 1`
+done
+kill -0 $updater 2>/dev/null || fail "the file list process died"
+test -f "$xml" || fail "no file list was written"
+grep 'Name="f0"' "$xml" >/dev/null && fail "a deleted file is still listed"
+grep 'Name="sub"' "$xml" >/dev/null && fail "a deleted directory is still listed"
+test `hashed` -eq 3 || fail "the remaining files were not hashed"
+
+echo "exit" >&3
+exec 3>&-
+wait $pid
+pid=
+exit 0
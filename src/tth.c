@@ -16,37 +16,100 @@
 #include "dirname.h"		/* Gnulib */
 
 #include "tth/tth.h"
+#include "tth/tigertree.h"
+#include "tth/tth_sidecar.h"
 
 #define errstr (strerror(errno))
 
 enum {
     VERSION_OPT = 256,
-    HELP_OPT
+    HELP_OPT,
+    SELF_TEST_OPT
 };
 
-static const char *short_opts = "v";
+static const char *short_opts = "vs";
 static struct option long_opts[] = {
+    { "sidecar", no_argument, NULL, 's' },
     { "version", no_argument, NULL, VERSION_OPT },
     { "help", no_argument, NULL, HELP_OPT },
+    { "self-test", no_argument, NULL, SELF_TEST_OPT },
     { 0, }
 };
 
 const char version_etc_copyright[] =
     "Copyright (C) 2006 Vladimir Chugunov";
 
+/* Return true if filename is in a sidecar directory. */
+static int
+is_sidecar(const char *filename)
+{
+    const char *base = strrchr(filename, '/');
+    size_t len = strlen(TTH_SIDECAR_DIRECTORY);
+
+    return base != NULL && base - filename >= len
+        && strncmp(base - len, TTH_SIDECAR_DIRECTORY, len) == 0
+        && (base - filename == len || base[-len-1] == '/');
+}
+
+/* Hash filename and print its root. With sidecar, the root and leaves are
+ * also saved in the sidecar of the file, unless one is there already. */
+static int
+hash_file(const char *filename, int sidecar)
+{
+    struct stat st, st_after;
+    char root[TTH_SIDECAR_ROOT_LENGTH+1];
+    char *tthl = NULL;
+    size_t tthl_size;
+    char *hash;
+
+    if (sidecar && (is_sidecar(filename) || stat(filename, &st) < 0 || !S_ISREG(st.st_mode)))
+        sidecar = 0;
+    if (sidecar && tth_sidecar_read(filename, &st, root, &tthl, &tthl_size) == 0 && tthl != NULL) {
+        free(tthl);
+        printf("%40s %s\n", root, filename);
+        return 0;
+    }
+
+    hash = tth(filename, &tthl, &tthl_size);
+    if (hash == NULL) {
+        printf("Cannot process file %s - %s\n", filename, errstr);
+        return -1;
+    }
+    printf("%40s %s\n", hash, filename);
+    /* The file may have changed while it was hashed. */
+    if (sidecar && stat(filename, &st_after) == 0 && st_after.st_size == st.st_size
+            && st_after.st_mtime == st.st_mtime && st_after.st_ctime == st.st_ctime
+            && tth_sidecar_write(filename, &st, hash, tthl, tthl_size) < 0) {
+        printf("Cannot save hash of %s - %s\n", filename, errstr);
+    }
+    free(tthl);
+    free(hash);
+    return 0;
+}
+
 int main(int argc, char* argv[])
 {
-    int print_help = 0, i;
+    int print_help = 0, sidecar = 0, i;
 
     int opt = -1, long_idx = -1;
     while (!print_help && (-1 != (opt = getopt_long(argc, argv, short_opts, long_opts, &long_idx)))) {
         switch (opt) {
+        case 's':
+            sidecar = 1;
+            break;
         case VERSION_OPT:
             version_etc(stdout, NULL, base_name(argv[0]), VERSION, "Vladimir Chugunov", NULL);
             exit(EXIT_SUCCESS);
         case HELP_OPT:
             print_help = 1;
             break;
+        case SELF_TEST_OPT:
+            if (tt_self_test() != 0) {
+                printf("Self-test failed\n");
+                exit(EXIT_FAILURE);
+            }
+            printf("Self-test passed\n");
+            exit(EXIT_SUCCESS);
         default:
             fprintf(stderr, "unknown option value %d\n", opt);
             break;
@@ -54,11 +117,14 @@ int main(int argc, char* argv[])
     }
 
     if (argc < 2 || print_help) {
-        fprintf(stderr, "Usage: %s file [file...]\n\n", base_name(argv[0]));
+        fprintf(stderr, "Usage: %s [-s|--sidecar] file [file...]\n\n", base_name(argv[0]));
 
         fprintf(stderr,
                 "Calculate Tiger Tree Hash.\n\n"
                 "Available options:\n"
+                "    -s, --sidecar      - save hashes in " TTH_SIDECAR_DIRECTORY " next to the files,\n"
+                "                         where microdc2 picks them up instead of hashing\n"
+                "        --self-test    - check the Tiger implementations against each other\n"
                 "        --version      - print version information\n"
                 "        --help         - print this help\n\n");
 
@@ -66,19 +132,7 @@ int main(int argc, char* argv[])
     }
 
     for (i = optind; i < argc; i++) {
-        char* filename = argv[i];
-        char* tthl = NULL;
-        size_t tthl_size;
-        char* hash = tth(filename, &tthl, &tthl_size);
-        if (tthl != NULL) {
-            free(tthl);
-        }
-        if (tth != NULL) {
-            printf("%40s %s\n", hash, filename);
-            free(hash);
-        } else {
-            printf("Cannot process file %s - %s\n", filename, errstr);
-        }
+        hash_file(argv[i], sidecar);
         fflush(stdout);
     }
 
@@ -37,6 +37,36 @@ char* base32_encode(const unsigned char* buffer, int len)
     return digest;
 }
 
+/* Decode the base32 string in into at most outlen bytes of out.
+ * Returns the number of bytes decoded, or -1 if in contains other
+ * characters than those of the base32 alphabet (case is ignored).
+ */
+int base32_decode(const char* in, unsigned char* out, int outlen)
+{
+    int j = 0;
+    int bits_remain = 0;
+    unsigned short value = 0;
+
+    for (; *in != '\0' && j < outlen; in++) {
+        int idx;
+        if (*in >= 'A' && *in <= 'Z')
+            idx = *in - 'A';
+        else if (*in >= 'a' && *in <= 'z')
+            idx = *in - 'a';
+        else if (*in >= '2' && *in <= '7')
+            idx = *in - '2' + 26;
+        else
+            return -1;
+        value = (value << 5) | idx;
+        bits_remain += 5;
+        if (bits_remain >= 8) {
+            out[j++] = (value >> (bits_remain-8)) & 0xFF;
+            bits_remain -= 8;
+        }
+    }
+    return j;
+}
+
 #if 0
 char* base32_decode(const unsigned char* buffer, int len)
 {
@@ -8,6 +8,7 @@ extern "C" {
 // user must call free() funtion on pointer returned from these functions
 
     char* base32_encode(const unsigned char* in, int inlen);
+    int base32_decode(const char* in, unsigned char* out, int outlen);
 
 #if defined(__cplusplus)
 }
@@ -14,6 +14,8 @@
 #include <config.h>
 #endif
 
+#include <string.h>
+
 #define _ULL(x) x##ull
 
 #ifdef WORDS_BIGENDIAN
@@ -245,3 +247,397 @@ void tiger(word64 *str, word64 length, word64 res[3])
     ((word64*)(&(temp[56])))[0] = ((word64)length)<<3;
     tiger_compress(((word64*)temp), res);
 }
+
+/* Compress the 64 bytes at str, which need not be aligned. */
+static void tiger_compress_bytes(const byte *str, word64 state[3])
+{
+#if USE_BIG_ENDIAN
+    byte temp[64];
+    int j;
+
+    for (j = 0; j < 64; j++)
+        temp[j^7] = str[j];
+    tiger_compress((word64 *) temp, state);
+#else
+    tiger_compress((word64 *) str, state);
+#endif
+}
+
+/* Pad the last n bytes of a message of length bytes in temp, and
+ * compress them. */
+static void tiger_final_bytes(byte temp[64], word64 n, word64 length, word64 state[3])
+{
+    word64 bits = length << 3;
+    int k;
+
+    temp[n++] = 0x01;
+    memset(temp + n, 0, 64 - n);
+    if (((n + 7) & ~7) > 56) {
+        tiger_compress_bytes(temp, state);
+        memset(temp, 0, 56);
+    }
+    for (k = 0; k < 8; k++)
+        temp[56 + k] = (byte) (bits >> (8 * k));
+    tiger_compress_bytes(temp, state);
+}
+
+/* Hash the byte prefix followed by length bytes of str, without copying
+ * str behind the prefix first. Tiger tree leaves and nodes are hashed
+ * this way. str need not be aligned.
+ */
+void tiger_prefixed(byte prefix, const byte *str, word64 length, word64 res[3])
+{
+    byte temp[64];
+    word64 total = length + 1;
+    word64 i;
+
+    res[0] = _ULL(0x0123456789ABCDEF);
+    res[1] = _ULL(0xFEDCBA9876543210);
+    res[2] = _ULL(0xF096A5B4C3B2E187);
+
+    /* Only the first block holds the prefix, the others start one byte
+     * back in str. */
+    for (i = 0; total - i >= 64; i += 64) {
+        if (i == 0) {
+            temp[0] = prefix;
+            memcpy(temp + 1, str, 63);
+            tiger_compress_bytes(temp, res);
+        } else {
+            tiger_compress_bytes(str + i - 1, res);
+        }
+    }
+    if (i == 0) {
+        temp[0] = prefix;
+        memcpy(temp + 1, str, length);
+    } else {
+        memcpy(temp, str + i - 1, total - i);
+    }
+    tiger_final_bytes(temp, total - i, total, res);
+}
+
+/* Multi-buffer Tiger: four messages of the same length are hashed at
+ * once, which is what hashing the leaves of a Tiger tree needs. The
+ * compression function is run for all four in the same loop, either in
+ * the lanes of AVX2 registers with the S boxes looked up by gathers,
+ * or interleaved in plain registers so that the table lookups of the
+ * four can be in flight at the same time.
+ */
+
+#if !USE_BIG_ENDIAN && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TIGER_AVX2 1
+#include <immintrin.h>
+#endif
+
+typedef void (*TigerCompress4)(const word64 *str[4], word64 state[4][3]);
+
+static void tiger_compress_4way_scalar(const word64 *str[4], word64 state[4][3])
+{
+    word64 a[4], b[4], c[4], aa[4], bb[4], cc[4];
+    word64 x0[4], x1[4], x2[4], x3[4], x4[4], x5[4], x6[4], x7[4];
+    word64 *pa, *pb, *pc, *pt;
+    int pass_no, l;
+
+    for (l = 0; l < 4; l++) {
+        a[l] = aa[l] = state[l][0];
+        b[l] = bb[l] = state[l][1];
+        c[l] = cc[l] = state[l][2];
+        x0[l] = str[l][0]; x1[l] = str[l][1]; x2[l] = str[l][2]; x3[l] = str[l][3];
+        x4[l] = str[l][4]; x5[l] = str[l][5]; x6[l] = str[l][6]; x7[l] = str[l][7];
+    }
+
+#define round4(a,b,c,x,mul) \
+      for (l = 0; l < 4; l++) { round(a[l],b[l],c[l],x[l],mul) }
+
+    pa = a; pb = b; pc = c;
+    for (pass_no = 0; pass_no < PASSES; pass_no++) {
+        word64 mul = (pass_no == 0 ? 5 : pass_no == 1 ? 7 : 9);
+        if (pass_no != 0) {
+            for (l = 0; l < 4; l++) {
+                x0[l] -= x7[l] ^ _ULL(0xA5A5A5A5A5A5A5A5);
+                x1[l] ^= x0[l];
+                x2[l] += x1[l];
+                x3[l] -= x2[l] ^ ((~x1[l])<<19);
+                x4[l] ^= x3[l];
+                x5[l] += x4[l];
+                x6[l] -= x5[l] ^ ((~x4[l])>>23);
+                x7[l] ^= x6[l];
+                x0[l] += x7[l];
+                x1[l] -= x0[l] ^ ((~x7[l])<<19);
+                x2[l] ^= x1[l];
+                x3[l] += x2[l];
+                x4[l] -= x3[l] ^ ((~x2[l])>>23);
+                x5[l] ^= x4[l];
+                x6[l] += x5[l];
+                x7[l] -= x6[l] ^ _ULL(0x0123456789ABCDEF);
+            }
+        }
+        round4(pa,pb,pc,x0,mul)
+        round4(pb,pc,pa,x1,mul)
+        round4(pc,pa,pb,x2,mul)
+        round4(pa,pb,pc,x3,mul)
+        round4(pb,pc,pa,x4,mul)
+        round4(pc,pa,pb,x5,mul)
+        round4(pa,pb,pc,x6,mul)
+        round4(pb,pc,pa,x7,mul)
+        pt = pa; pa = pc; pc = pb; pb = pt;
+    }
+#undef round4
+
+    for (l = 0; l < 4; l++) {
+        state[l][0] = pa[l] ^ aa[l];
+        state[l][1] = pb[l] - bb[l];
+        state[l][2] = pc[l] + cc[l];
+    }
+}
+
+#if defined(TIGER_AVX2)
+
+#define gather(t,v,shift) \
+      _mm256_i64gather_epi64((const long long *) (t), \
+                             _mm256_and_si256(_mm256_srli_epi64((v), (shift)), ff), 8)
+
+#define round_avx2(a,b,c,x,mul) \
+      c = _mm256_xor_si256(c, x); \
+      a = _mm256_sub_epi64(a, _mm256_xor_si256( \
+              _mm256_xor_si256(gather(t1,c,0), gather(t2,c,16)), \
+              _mm256_xor_si256(gather(t3,c,32), gather(t4,c,48)))); \
+      b = _mm256_add_epi64(b, _mm256_xor_si256( \
+              _mm256_xor_si256(gather(t4,c,8), gather(t3,c,24)), \
+              _mm256_xor_si256(gather(t2,c,40), gather(t1,c,56)))); \
+      b = mul(b);
+
+/* There is no 64-bit multiplication in AVX2, but these are small. */
+#define mul5(v) _mm256_add_epi64(_mm256_slli_epi64((v), 2), (v))
+#define mul7(v) _mm256_sub_epi64(_mm256_slli_epi64((v), 3), (v))
+#define mul9(v) _mm256_add_epi64(_mm256_slli_epi64((v), 3), (v))
+
+#define pass_avx2(a,b,c,mul) \
+      round_avx2(a,b,c,x0,mul) \
+      round_avx2(b,c,a,x1,mul) \
+      round_avx2(c,a,b,x2,mul) \
+      round_avx2(a,b,c,x3,mul) \
+      round_avx2(b,c,a,x4,mul) \
+      round_avx2(c,a,b,x5,mul) \
+      round_avx2(a,b,c,x6,mul) \
+      round_avx2(b,c,a,x7,mul)
+
+#define not_avx2(v) _mm256_xor_si256((v), ones)
+
+#define key_schedule_avx2 \
+      x0 = _mm256_sub_epi64(x0, _mm256_xor_si256(x7, _mm256_set1_epi64x(_ULL(0xA5A5A5A5A5A5A5A5)))); \
+      x1 = _mm256_xor_si256(x1, x0); \
+      x2 = _mm256_add_epi64(x2, x1); \
+      x3 = _mm256_sub_epi64(x3, _mm256_xor_si256(x2, _mm256_slli_epi64(not_avx2(x1), 19))); \
+      x4 = _mm256_xor_si256(x4, x3); \
+      x5 = _mm256_add_epi64(x5, x4); \
+      x6 = _mm256_sub_epi64(x6, _mm256_xor_si256(x5, _mm256_srli_epi64(not_avx2(x4), 23))); \
+      x7 = _mm256_xor_si256(x7, x6); \
+      x0 = _mm256_add_epi64(x0, x7); \
+      x1 = _mm256_sub_epi64(x1, _mm256_xor_si256(x0, _mm256_slli_epi64(not_avx2(x7), 19))); \
+      x2 = _mm256_xor_si256(x2, x1); \
+      x3 = _mm256_add_epi64(x3, x2); \
+      x4 = _mm256_sub_epi64(x4, _mm256_xor_si256(x3, _mm256_srli_epi64(not_avx2(x2), 23))); \
+      x5 = _mm256_xor_si256(x5, x4); \
+      x6 = _mm256_add_epi64(x6, x5); \
+      x7 = _mm256_sub_epi64(x7, _mm256_xor_si256(x6, _mm256_set1_epi64x(_ULL(0x0123456789ABCDEF))));
+
+#define load_avx2(i) \
+      _mm256_set_epi64x(str[3][i], str[2][i], str[1][i], str[0][i])
+
+__attribute__((target("avx2")))
+static void tiger_compress_4way_avx2(const word64 *str[4], word64 state[4][3])
+{
+    const __m256i ff = _mm256_set1_epi64x(0xFF);
+    const __m256i ones = _mm256_set1_epi64x(-1);
+    __m256i a, b, c, aa, bb, cc;
+    __m256i x0, x1, x2, x3, x4, x5, x6, x7;
+    word64 out[3][4];
+    int l;
+
+    a = aa = _mm256_set_epi64x(state[3][0], state[2][0], state[1][0], state[0][0]);
+    b = bb = _mm256_set_epi64x(state[3][1], state[2][1], state[1][1], state[0][1]);
+    c = cc = _mm256_set_epi64x(state[3][2], state[2][2], state[1][2], state[0][2]);
+    x0 = load_avx2(0); x1 = load_avx2(1); x2 = load_avx2(2); x3 = load_avx2(3);
+    x4 = load_avx2(4); x5 = load_avx2(5); x6 = load_avx2(6); x7 = load_avx2(7);
+
+    /* PASSES is 3, so the passes are unrolled as in the Alpha code. */
+    pass_avx2(a,b,c,mul5)
+    key_schedule_avx2
+    pass_avx2(c,a,b,mul7)
+    key_schedule_avx2
+    pass_avx2(b,c,a,mul9)
+
+    a = _mm256_xor_si256(a, aa);
+    b = _mm256_sub_epi64(b, bb);
+    c = _mm256_add_epi64(c, cc);
+    _mm256_storeu_si256((__m256i *) out[0], a);
+    _mm256_storeu_si256((__m256i *) out[1], b);
+    _mm256_storeu_si256((__m256i *) out[2], c);
+    for (l = 0; l < 4; l++) {
+        state[l][0] = out[0][l];
+        state[l][1] = out[1][l];
+        state[l][2] = out[2][l];
+    }
+}
+
+#undef gather
+#undef round_avx2
+#undef mul5
+#undef mul7
+#undef mul9
+#undef pass_avx2
+#undef not_avx2
+#undef key_schedule_avx2
+#undef load_avx2
+
+#endif
+
+static TigerCompress4 tiger_compress_4way = NULL;
+
+static TigerCompress4 tiger_select_4way(void)
+{
+#if defined(TIGER_AVX2)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return tiger_compress_4way_avx2;
+#endif
+    return tiger_compress_4way_scalar;
+}
+
+/* Hash four messages of length bytes each, preceded by the byte prefix
+ * unless it is negative. */
+static void tiger_4way_with(TigerCompress4 kernel, int prefix, const byte *str[4], word64 length, word64 res[4][3])
+{
+#if USE_BIG_ENDIAN
+    int l;
+
+    for (l = 0; l < 4; l++) {
+        if (prefix < 0)
+            tiger((word64 *) str[l], length, res[l]);
+        else
+            tiger_prefixed(prefix, str[l], length, res[l]);
+    }
+#else
+    const word64 *blocks[4];
+    word64 temp[4][8];
+    word64 off = (prefix < 0 ? 0 : 1);
+    word64 total = length + off;
+    word64 i, j;
+    int l;
+
+    for (l = 0; l < 4; l++) {
+        res[l][0] = _ULL(0x0123456789ABCDEF);
+        res[l][1] = _ULL(0xFEDCBA9876543210);
+        res[l][2] = _ULL(0xF096A5B4C3B2E187);
+    }
+
+    /* As in tiger_prefixed, only the first block is copied to make room
+     * for the prefix. */
+    for (i = 0; total - i >= 64; i += 64) {
+        for (l = 0; l < 4; l++) {
+            if (i == 0 && off) {
+                byte *t = (byte *) temp[l];
+                t[0] = prefix;
+                memcpy(t + 1, str[l], 63);
+                blocks[l] = temp[l];
+            } else {
+                blocks[l] = (const word64 *) (str[l] + i - off);
+            }
+        }
+        kernel(blocks, res);
+    }
+
+    /* Padding, as in tiger(). */
+    j = total - i;
+    for (l = 0; l < 4; l++) {
+        byte *t = (byte *) temp[l];
+        if (i == 0 && off) {
+            t[0] = prefix;
+            memcpy(t + 1, str[l], j - 1);
+        } else {
+            memcpy(t, str[l] + i - off, j);
+        }
+        t[j] = 0x01;
+        memset(t + j + 1, 0, 64 - (j + 1));
+        blocks[l] = temp[l];
+    }
+    if (((j + 1 + 7) & ~7) > 56) {
+        kernel(blocks, res);
+        for (l = 0; l < 4; l++)
+            memset(temp[l], 0, 64);
+    }
+    for (l = 0; l < 4; l++)
+        temp[l][7] = total << 3;
+    kernel(blocks, res);
+#endif
+}
+
+/* Hash four messages of length bytes each. */
+void tiger_4way(const byte *str[4], word64 length, word64 res[4][3])
+{
+    if (tiger_compress_4way == NULL)
+        tiger_compress_4way = tiger_select_4way();
+    tiger_4way_with(tiger_compress_4way, -1, str, length, res);
+}
+
+/* Hash the byte prefix followed by length bytes of each of str, as
+ * tiger_prefixed does. */
+void tiger_prefixed_4way(byte prefix, const byte *str[4], word64 length, word64 res[4][3])
+{
+    if (tiger_compress_4way == NULL)
+        tiger_compress_4way = tiger_select_4way();
+    tiger_4way_with(tiger_compress_4way, prefix, str, length, res);
+}
+
+/* Check tiger() against a published test vector, and tiger_prefixed and
+ * every 4-way kernel this CPU can run against tiger(). Returns 0 if all
+ * agree.
+ */
+int tiger_self_test(void)
+{
+    static const word64 empty[3] = {
+        _ULL(0x24F0130C63AC9332), _ULL(0x16166E76B1BB925F), _ULL(0xF373DE2D49584E7A)
+    };
+    static const word64 lengths[] = { 0, 1, 54, 55, 56, 62, 63, 64, 65, 119, 120, 1024, 1025 };
+    TigerCompress4 kernels[2];
+    int kernel_count = 0;
+    byte data[4][1+1025];
+    word64 res[3], res4[4][3], prefixed4[4][3];
+    const byte *str[4], *after_prefix[4];
+    unsigned i, k;
+    int l;
+
+    tiger((word64 *) data[0], 0, res);
+    if (memcmp(res, empty, sizeof(res)) != 0)
+        return -1;
+
+    for (l = 0; l < 4; l++) {
+        for (i = 0; i < sizeof(data[l]); i++)
+            data[l][i] = (byte) (i * 7 + l * 131 + (i >> 8));
+        data[l][0] = '\0';
+        str[l] = data[l];
+        after_prefix[l] = data[l] + 1;
+    }
+    kernels[kernel_count++] = tiger_compress_4way_scalar;
+    if (tiger_select_4way() != tiger_compress_4way_scalar)
+        kernels[kernel_count++] = tiger_select_4way();
+
+    for (k = 0; k < kernel_count; k++) {
+        for (i = 0; i < sizeof(lengths)/sizeof(*lengths); i++) {
+            tiger_4way_with(kernels[k], -1, str, lengths[i], res4);
+            tiger_4way_with(kernels[k], '\0', after_prefix, lengths[i], prefixed4);
+            for (l = 0; l < 4; l++) {
+                tiger((word64 *) data[l], lengths[i], res);
+                if (memcmp(res, res4[l], sizeof(res)) != 0)
+                    return -1;
+                tiger((word64 *) data[l], lengths[i] + 1, res);
+                if (memcmp(res, prefixed4[l], sizeof(res)) != 0)
+                    return -1;
+                tiger_prefixed('\0', data[l] + 1, lengths[i], res4[l]);
+                if (memcmp(res, res4[l], sizeof(res)) != 0)
+                    return -1;
+            }
+        }
+    }
+    return 0;
+}
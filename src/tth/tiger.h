@@ -33,6 +33,10 @@ extern "C" {
 #endif
 
     void tiger(word64 *str, word64 length, word64 *res);
+    void tiger_prefixed(byte prefix, const byte *str, word64 length, word64 res[3]);
+    void tiger_4way(const byte *str[4], word64 length, word64 res[4][3]);
+    void tiger_prefixed_4way(byte prefix, const byte *str[4], word64 length, word64 res[4][3]);
+    int tiger_self_test(void);
 
 #if defined(__cplusplus)
 }
@@ -68,12 +68,13 @@ static void tt_compose(TT_CONTEXT *ctx) {
     ctx->top -= TIGERSIZE;                      // update top ptr
 }
 
-void tt_block(TT_CONTEXT *ctx)
+/* Push the leaf hash that has been stored at the top of the stack, and
+ * combine the completed subtrees. */
+static void tt_push(TT_CONTEXT *ctx)
 {
     word64 b;
     unsigned depth;
 
-    tiger((word64*)ctx->leaf,(word64)ctx->index+1,(word64*)ctx->top);
 #if USE_BIG_ENDIAN
     tt_endian((byte *)ctx->top);
 #endif
@@ -95,6 +96,51 @@ void tt_block(TT_CONTEXT *ctx)
     }
 }
 
+void tt_block(TT_CONTEXT *ctx)
+{
+    tiger((word64*)ctx->leaf,(word64)ctx->index+1,(word64*)ctx->top);
+    tt_push(ctx);
+}
+
+/* Hash a leaf of len bytes (at most BLOCKSIZE) at data. Unlike
+ * tt_block, data needs no room for the leaf prefix and is not modified.
+ */
+void tt_leaf(TT_CONTEXT *ctx, const unsigned char *data, unsigned len)
+{
+    tiger_prefixed('\0', data, (word64)len, (word64*)ctx->top);
+    tt_push(ctx);
+}
+
+/* Hash count full leaves of BLOCKSIZE bytes each from data, four at a
+ * time with tiger_prefixed_4way. This is the same as calling tt_leaf
+ * for each.
+ */
+void tt_blocks(TT_CONTEXT *ctx, const unsigned char *data, unsigned count)
+{
+    const byte *str[4];
+    word64 res[4][3];
+    int l;
+
+    while (count > 0) {
+        int n = (count < 4 ? count : 4);
+
+        if (n == 4) {
+            for (l = 0; l < 4; l++)
+                str[l] = data + l*BLOCKSIZE;
+            tiger_prefixed_4way('\0', str, (word64)BLOCKSIZE, res);
+        } else {
+            for (l = 0; l < n; l++)
+                tiger_prefixed('\0', data + l*BLOCKSIZE, (word64)BLOCKSIZE, res[l]);
+        }
+        for (l = 0; l < n; l++) {
+            memcpy(ctx->top, res[l], TIGERSIZE);
+            tt_push(ctx);
+        }
+        data += n*BLOCKSIZE;
+        count -= n;
+    }
+}
+
 // no need to call this directly; tt_digest calls it for you
 static void tt_final(TT_CONTEXT *ctx)
 {
@@ -154,6 +200,89 @@ void tt_digest(TT_CONTEXT *ctx, byte *s)
     memmove(s,ctx->nodes, TIGERSIZE);
 }
 
+/* Combine the hashes of two adjacent subtrees into the hash of their
+ * parent node. */
+void tt_node(const unsigned char *left, const unsigned char *right, unsigned char *hash)
+{
+    word64 node[(1+NODESIZE+7)/8];
+    word64 res[3];
+
+    ((byte *)node)[0] = '\1';
+    memcpy((byte *)node+1, left, TIGERSIZE);
+    memcpy((byte *)node+1+TIGERSIZE, right, TIGERSIZE);
+    tiger(node, (word64)(NODESIZE+1), res);
+#if USE_BIG_ENDIAN
+    tt_endian((byte *)res);
+#endif
+    memcpy(hash, res, TIGERSIZE);
+}
+
+/* Compute the root of a tree from the hashes of count adjacent subtrees
+ * of equal, power of two, size (except for the last one which may be
+ * smaller), such as the leaf level of a file. */
+void tt_combine(const unsigned char *hashes, word64 count, unsigned char *hash)
+{
+    unsigned char stack[64*TIGERSIZE];
+    unsigned char *top = stack;
+    word64 b;
+    word64 i;
+
+    for (i = 1; i <= count; i++) {
+        memcpy(top, hashes + (i-1)*TIGERSIZE, TIGERSIZE);
+        top += TIGERSIZE;
+        for (b = i; b == ((b >> 1)<<1); b >>= 1) { // while evenly divisible by 2...
+            tt_node(top - 2*TIGERSIZE, top - TIGERSIZE, top - 2*TIGERSIZE);
+            top -= TIGERSIZE;
+        }
+    }
+    while (top - TIGERSIZE > stack) {
+        tt_node(top - 2*TIGERSIZE, top - TIGERSIZE, top - 2*TIGERSIZE);
+        top -= TIGERSIZE;
+    }
+    memcpy(hash, stack, TIGERSIZE);
+}
+
+/* Check the Tiger kernels, and that a tree hashed with tt_blocks and
+ * tt_leaf has the same root as one hashed a leaf at a time with
+ * tt_block. Returns 0 if they agree.
+ */
+int tt_self_test(void)
+{
+    static TT_CONTEXT one, batched;
+    unsigned char data[13*BLOCKSIZE+300];
+    unsigned char unaligned[1+sizeof(data)];
+    unsigned char leaf[1+BLOCKSIZE];
+    unsigned char root1[TIGERSIZE], root2[TIGERSIZE];
+    unsigned i;
+
+    if (tiger_self_test() != 0)
+        return -1;
+
+    for (i = 0; i < sizeof(data); i++)
+        data[i] = (unsigned char) (i * 13 + (i >> 10));
+
+    tt_init(&one, NULL, 0);
+    for (i = 0; i < 14; i++) {
+        leaf[0] = '\0';
+        one.index = (i < 13 ? BLOCKSIZE : 300);
+        memcpy(leaf+1, data + i*BLOCKSIZE, one.index);
+        one.leaf = leaf;
+        tt_block(&one);
+    }
+    one.index = 0;
+    tt_digest(&one, root1);
+
+    /* Leaves are hashed where the reader left them, at any alignment. */
+    memcpy(unaligned+1, data, sizeof(data));
+    tt_init(&batched, NULL, 0);
+    tt_blocks(&batched, unaligned+1, 13);
+    tt_leaf(&batched, unaligned+1 + 13*BLOCKSIZE, 300);
+    batched.index = 0;
+    tt_digest(&batched, root2);
+
+    return memcmp(root1, root2, TIGERSIZE) == 0 ? 0 : -1;
+}
+
 #if USE_BIG_ENDIAN
 void tt_endian(byte *s)
 {
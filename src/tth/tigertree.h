@@ -41,8 +41,13 @@ extern "C" {
     void tt_init(TT_CONTEXT *ctx, unsigned char *tthl, unsigned depth);
 //void tt_update(TT_CONTEXT *ctx, unsigned char *buffer, word32 len);
     void tt_block(TT_CONTEXT *ctx);
+    void tt_leaf(TT_CONTEXT *ctx, const unsigned char *data, unsigned len);
+    void tt_blocks(TT_CONTEXT *ctx, const unsigned char *data, unsigned count);
     void tt_digest(TT_CONTEXT *ctx, unsigned char *hash);
+    void tt_node(const unsigned char *left, const unsigned char *right, unsigned char *hash);
+    void tt_combine(const unsigned char *hashes, word64 count, unsigned char *hash);
     void tt_copy(TT_CONTEXT *dest, TT_CONTEXT *src);
+    int tt_self_test(void);
 #if defined(__cplusplus)
 }
 #endif
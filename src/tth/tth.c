@@ -28,10 +28,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <signal.h>
+#include <setjmp.h>
 #include <assert.h>
 
 #include "tigertree.h"
 #include "base32.h"
+#include "tth_reader.h"
+#include "tth.h"
 
 
 //#define _TRACE
@@ -41,12 +45,11 @@
 #define TRACE(x)
 #endif
 
-const size_t default_block_level    = 6;
-const int    max_block_count        = (1 << 6);
-
 #define MAXHASHES ( ((word64)1) << 9  )
-/* blocksize for one leaf is 65536 bytes */
-#define STARTDEPTH 6
+
+/* Leaves are at least 64 KiB, and there are at most MAXHASHES of them. */
+const size_t default_block_level    = 6;
+const int    max_block_count        = MAXHASHES;
 
 int calc_block_level(word64 filesize, int max_block_count)
 {
@@ -55,17 +58,54 @@ int calc_block_level(word64 filesize, int max_block_count)
     return level;
 }
 
+/* A mapped file that is truncated while it is hashed raises SIGBUS when
+ * the missing pages are touched. The file is then treated as one that
+ * could not be read. */
+static sigjmp_buf truncated_jmp;
+
+static void
+truncated_handler(int sig)
+{
+    siglongjmp(truncated_jmp, 1);
+}
+
+/* Return the base32 encoded root of the Tiger tree of filename, and its
+ * leaf level (the concatenated hashes of each leaf block) in tthl and
+ * tthl_len.
+ */
 char* tth(const char* filename, char **tthl, size_t *tthl_len)
+{
+    return tth_resume(filename, tthl, tthl_len, 0, NULL, 0, NULL, NULL);
+}
+
+/* As tth, but with the leaves of the first start bytes of the file
+ * already known to be start_tthl, as they were passed to progress by an
+ * earlier call for the same file. Hashing starts from the beginning if
+ * start is not at the end of a leaf.
+ */
+char* tth_resume(const char* filename, char **tthl, size_t *tthl_len,
+                 off_t start, const char *start_tthl, size_t start_tthl_len,
+                 TTHProgressCallback progress, void *userdata)
 {
     char *tth;
-    size_t numbytes;
-    unsigned char root[24];
+    ssize_t numbytes;
+    unsigned char root[TIGERSIZE];
     unsigned char *cur;
+    unsigned char *leaves;
+    unsigned char *data;
     TT_CONTEXT tt;
-    unsigned char buf[1 + 512 * BLOCKSIZE];
+    TTHReader reader;
     struct stat sb;
     unsigned leaf_cnt, level;
     size_t leaf_blocksize;
+    size_t leaf_pos;
+    struct sigaction sigact, old_sigact;
+    /* Changed between sigsetjmp and siglongjmp. */
+    volatile off_t total = 0;
+    volatile int stopped = 0;
+
+    *tthl_len = 0;
+    *tthl = NULL;
 
     int fd = open(filename, O_RDONLY);
     if ((fd == -1) || ( fstat(fd, &sb) == -1)) {
@@ -77,52 +117,88 @@ char* tth(const char* filename, char **tthl, size_t *tthl_len)
 
     //TRACE(("level == %d, leaf_blocksize == %d\n", level, leaf_blocksize));
 
-    /* get memry for leaves */
+    /* get memory for leaves, there is one even if the file is empty */
     leaf_cnt = sb.st_size / leaf_blocksize;
-    if (sb.st_size % leaf_blocksize)
+    if (sb.st_size % leaf_blocksize || leaf_cnt == 0)
         leaf_cnt++;
-
-    //TRACE(("leaf_cnt == %d\n", leaf_cnt));
-
-    /*
-    if (leaf_cnt >= 2) {
-        *tthl_len = leaf_cnt * TIGERSIZE;
-        *tthl = malloc(leaf_cnt * TIGERSIZE);
-        if (*tthl == NULL)
-            return NULL;
-    } else */
-    {
-        *tthl_len = 0;
-        *tthl = NULL;
+    leaves = malloc(leaf_cnt * TIGERSIZE);
+    if (start <= 0 || start >= sb.st_size || start % leaf_blocksize != 0
+            || start_tthl_len != (size_t) (start / leaf_blocksize) * TIGERSIZE)
+        start = 0;
+    if (leaves != NULL && start > 0)
+        memcpy(leaves, start_tthl, start_tthl_len);
+    total = start;
+    if (leaves == NULL || tth_reader_open(&reader, fd, start) < 0) {
+        free(leaves);
+        close(fd);
+        return NULL;
     }
 
-    tt_init(&tt, *tthl, level);
-    tt.leaf = buf;
-    buf[0] = '\0';
-
-    while ( (numbytes = read(fd, &buf[1], sizeof(buf) - 1) ) > 0) {
-        tt.index = BLOCKSIZE;
-        for (cur = &buf[1]; cur + BLOCKSIZE <= &buf[numbytes + 1]; cur += BLOCKSIZE) {
-            tt.leaf = cur - 1;
-            tt.leaf[0] = '\0';
-            tt_block(&tt);
+    /* Each leaf block is a subtree of its own, whose root is saved
+     * when the block is complete. */
+    tt_init(&tt, NULL, 0);
+    *tthl_len = (start > 0 ? start_tthl_len : 0);
+    leaf_pos = 0;
+
+    memset(&sigact, 0, sizeof(sigact));
+    sigact.sa_handler = truncated_handler;
+    sigemptyset(&sigact.sa_mask);
+    sigaction(SIGBUS, &sigact, &old_sigact);
+
+    /* Full blocks are hashed in place, in batches that end at leaf
+     * boundaries. Only the last chunk ends with a partial block. */
+    if (sigsetjmp(truncated_jmp, 1) != 0) {
+        numbytes = -1;
+    } else {
+        while (!stopped && (numbytes = tth_reader_next(&reader, &data) ) > 0) {
+            total += numbytes;
+            cur = data;
+            while (!stopped && cur < data + numbytes) {
+                size_t count = (data + numbytes - cur) / BLOCKSIZE;
+                if (count == 0) {
+                    leaf_pos += data + numbytes - cur;
+                    tt_leaf(&tt, cur, data + numbytes - cur);
+                    cur = data + numbytes;
+                } else {
+                    if (leaf_pos < leaf_blocksize && count > (leaf_blocksize - leaf_pos) / BLOCKSIZE)
+                        count = (leaf_blocksize - leaf_pos) / BLOCKSIZE;
+                    tt_blocks(&tt, cur, count);
+                    cur += count * BLOCKSIZE;
+                    leaf_pos += count * BLOCKSIZE;
+                }
+                if (leaf_pos == leaf_blocksize && *tthl_len < leaf_cnt * TIGERSIZE) {
+                    tt_digest(&tt, leaves + *tthl_len);
+                    *tthl_len += TIGERSIZE;
+                    tt_init(&tt, NULL, 0);
+                    leaf_pos = 0;
+                    if (progress != NULL && progress(userdata, total - (data + numbytes - cur), (char *) leaves, *tthl_len) != 0)
+                        stopped = 1;
+                }
+            }
         }
-        tt.index = numbytes - (cur - &buf[1]);
-        tt.leaf = cur - 1;
-        tt.leaf[0] = '\0';
     }
+    sigaction(SIGBUS, &old_sigact, NULL);
 
+    /* The file may have changed size while it was read. */
+    if (stopped || numbytes < 0 || total != sb.st_size) {
+        tth_reader_close(&reader);
+        close(fd);
+        free(leaves);
+        *tthl_len = 0;
+        return NULL;
+    }
+    /* An empty file has a single empty leaf. */
+    if ((leaf_pos > 0 || *tthl_len == 0) && *tthl_len < leaf_cnt * TIGERSIZE) {
+        if (total == 0)
+            tt_leaf(&tt, (const unsigned char *) "", 0);
+        tt_digest(&tt, leaves + *tthl_len);
+        *tthl_len += TIGERSIZE;
+    }
+    tth_reader_close(&reader);
     close(fd);
 
-    tt_digest(&tt, root);
-
-    if (*tthl_len) {
-        if (*tthl_len != (tt.tthl - *(unsigned char **)tthl)) {
-            fprintf(stderr, "*tthl_len == %d, (tt.tthl - *(unsigned char **)tthl) == %d\n", *tthl_len, (tt.tthl - *(unsigned char **)tthl));
-            fflush(stderr);
-        }
-        assert(*tthl_len == (tt.tthl - *(unsigned char **)tthl));
-    }
+    tt_combine(leaves, leaf_cnt, root);
+    *tthl = (char *)leaves;
 
     tth = base32_encode(root, sizeof(root));
 
@@ -1,6 +1,7 @@
 #ifndef __TTH_H
 #define __TTH_H
 
+#include <sys/types.h>
 #include "tiger.h"
 
 #if defined(__cplusplus)
@@ -11,6 +12,15 @@ extern "C" {
 
     char* tth(const char* filename, char **tthl, size_t *tthl_len);
 
+/* Called by tth_resume each time a leaf is complete, with the number of
+ * bytes hashed so far and the leaves up to there. Hashing stops if it
+ * returns non-zero. */
+    typedef int (*TTHProgressCallback)(void *userdata, off_t done, const char *tthl, size_t tthl_len);
+
+    char* tth_resume(const char* filename, char **tthl, size_t *tthl_len,
+                     off_t start, const char *start_tthl, size_t start_tthl_len,
+                     TTHProgressCallback progress, void *userdata);
+
 #if defined(__cplusplus)
 }
 #endif
@@ -0,0 +1,173 @@
+/*
+ * tth_reader.c
+ * This file is part of microdc
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/* Sequential reading of files to be hashed. Regular files are mapped in
+ * large windows and hashed in place, with the kernel asked to read the
+ * next window while the current one is hashed, so that disk and CPU are
+ * busy at the same time. Files that cannot be mapped are read into a
+ * buffer a chunk at a time, relying on the kernel's readahead.
+ */
+
+#include <config.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tth_reader.h"
+
+/* Map the window of the file at r->offset, and have the kernel start
+ * reading the one after it. */
+static int
+map_window(TTHReader *r)
+{
+    size_t len = TTH_READER_MAP_SIZE;
+    void *map;
+
+    if ((off_t) len > r->size - r->offset)
+        len = r->size - r->offset;
+    map = mmap(NULL, len, PROT_READ, MAP_SHARED, r->fd, r->offset);
+    if (map == MAP_FAILED)
+        return -1;
+    madvise(map, len, MADV_SEQUENTIAL);
+#if defined(POSIX_FADV_WILLNEED)
+    if (r->offset + (off_t) len < r->size)
+        posix_fadvise(r->fd, r->offset + len, TTH_READER_MAP_SIZE, POSIX_FADV_WILLNEED);
+#endif
+    r->map = map;
+    r->map_len = len;
+    r->map_used = 0;
+    return 0;
+}
+
+/* Fill len bytes of buf from offset, unless the end of file comes first. */
+static ssize_t
+read_fully(int fd, unsigned char *buf, size_t len, off_t offset)
+{
+    size_t count = 0;
+
+    while (count < len) {
+        ssize_t res = pread(fd, buf + count, len - count, offset + count);
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res < 0)
+            return -1;
+        if (res == 0)
+            break;
+        count += res;
+    }
+    return count;
+}
+
+/* Prepare to read fd from start, which must be a multiple of the page
+ * size. Returns -1 if memory could not be allocated.
+ */
+int
+tth_reader_open(TTHReader *r, int fd, off_t start)
+{
+    struct stat sb;
+    void *mem;
+
+    memset(r, 0, sizeof(*r));
+    r->fd = fd;
+    r->offset = start;
+
+    /* Empty files need no mapping, and mapping may not be supported by
+     * the file system, then the file is read. */
+    if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size > start) {
+        r->size = sb.st_size;
+#if defined(POSIX_FADV_WILLNEED)
+        posix_fadvise(fd, start, TTH_READER_MAP_SIZE, POSIX_FADV_WILLNEED);
+#endif
+        if (map_window(r) == 0) {
+            r->mapped = 1;
+            return 0;
+        }
+    }
+
+#if defined(POSIX_FADV_SEQUENTIAL)
+    posix_fadvise(fd, start, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    if (posix_memalign(&mem, 4096, TTH_READER_CHUNK_SIZE) != 0)
+        return -1;
+    r->buf = mem;
+    return 0;
+}
+
+/* Return the next chunk of the file in data, which stays valid until
+ * the next call and must not be modified. Only the last chunk is not a
+ * multiple of the Tiger tree block size. Returns 0 at the end of file
+ * and -1 on error, which includes the file changing size while it was
+ * mapped.
+ */
+ssize_t
+tth_reader_next(TTHReader *r, unsigned char **data)
+{
+    ssize_t res;
+
+    if (r->eof)
+        return 0;
+
+    if (r->mapped) {
+        struct stat sb;
+
+        if (r->map_used) {
+            munmap(r->map, r->map_len);
+            r->offset += r->map_len;
+            r->map = NULL;
+            r->map_len = 0;
+            if (r->offset >= r->size) {
+                r->eof = 1;
+                if (fstat(r->fd, &sb) < 0 || sb.st_size != r->size)
+                    return -1;
+                return 0;
+            }
+            if (map_window(r) < 0)
+                return -1;
+        }
+        r->map_used = 1;
+        *data = r->map;
+        return r->map_len;
+    }
+
+    res = read_fully(r->fd, r->buf, TTH_READER_CHUNK_SIZE, r->offset);
+    if (res < 0)
+        return -1;
+    if (res < TTH_READER_CHUNK_SIZE)
+        r->eof = 1;
+    r->offset += res;
+    *data = r->buf;
+    return res;
+}
+
+void
+tth_reader_close(TTHReader *r)
+{
+    if (r->map != NULL) {
+        munmap(r->map, r->map_len);
+        r->map = NULL;
+    }
+    free(r->buf);
+    r->buf = NULL;
+}
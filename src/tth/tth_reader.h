@@ -0,0 +1,59 @@
+/*
+ * tth_reader.h
+ * This file is part of microdc
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __TTH_READER_H
+#define __TTH_READER_H
+
+#include <sys/types.h>
+
+/* Regular files are mapped in windows of this size. Other files are
+ * read in chunks of TTH_READER_CHUNK_SIZE. Both sizes are multiples of
+ * the page size and of the Tiger tree block size. */
+#define TTH_READER_MAP_SIZE (64*1024*1024)
+#define TTH_READER_CHUNK_SIZE (1024*1024)
+
+typedef struct _TTHReader TTHReader;
+
+struct _TTHReader {
+    int fd;
+    off_t offset;		/* where the next chunk to return starts */
+    int eof;
+    unsigned char *buf;		/* NULL if the file is mapped */
+
+    /* The file is mapped a window at a time if mapped is set. */
+    int mapped;
+    off_t size;			/* size of the file when it was opened */
+    unsigned char *map;		/* window starting at offset */
+    size_t map_len;
+    int map_used;		/* the window has been returned */
+};
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+    int tth_reader_open(TTHReader *reader, int fd, off_t start);
+    ssize_t tth_reader_next(TTHReader *reader, unsigned char **data);
+    void tth_reader_close(TTHReader *reader);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif // ifndef __TTH_READER_H
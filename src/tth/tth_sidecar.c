@@ -0,0 +1,223 @@
+/*
+ * tth_sidecar.c
+ * This file is part of microdc
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/* Sidecar files hold the hash of a shared file, so that it can be hashed
+ * ahead of time, for example on the machine the disks are in. The format
+ * is the one microdc_tth has always written, in host byte order:
+ *
+ *   uint64_t size, time_t mtime, time_t ctime    of the hashed file
+ *   char root[39]                                 base32 encoded root
+ *   leaves                                        optional, TIGERSIZE each
+ *
+ * The leaves were added later. Readers that stop after the root are not
+ * bothered by them.
+ */
+
+#include <config.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "tigertree.h"
+#include "base32.h"
+#include "tth_sidecar.h"
+
+/* A sidecar is not read if it claims more leaves than a file can have. */
+#define MAX_SIDECAR_LEAVES 1024
+
+/* Return the name of the sidecar of filename. */
+char *
+tth_sidecar_filename(const char *filename)
+{
+    const char *base = strrchr(filename, '/');
+    size_t dir_len = (base == NULL ? 0 : base + 1 - filename);
+    char *name;
+
+    base = (base == NULL ? filename : base + 1);
+    name = malloc(dir_len + strlen(TTH_SIDECAR_DIRECTORY) + 1 + strlen(base) + 5);
+    if (name != NULL)
+        sprintf(name, "%.*s%s/%s.tth", (int) dir_len, filename, TTH_SIDECAR_DIRECTORY, base);
+    return name;
+}
+
+static int
+read_fully(int fd, void *buf, size_t len)
+{
+    size_t count = 0;
+
+    while (count < len) {
+        ssize_t res = read(fd, (char *) buf + count, len - count);
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res <= 0)
+            return -1;
+        count += res;
+    }
+    return 0;
+}
+
+static int
+write_fully(int fd, const void *buf, size_t len)
+{
+    size_t count = 0;
+
+    while (count < len) {
+        ssize_t res = write(fd, (const char *) buf + count, len - count);
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res < 0)
+            return -1;
+        count += res;
+    }
+    return 0;
+}
+
+/* Check that tth is a base32 encoded root. */
+static int
+valid_root(const char *tth)
+{
+    int c;
+
+    for (c = 0; c < TTH_SIDECAR_ROOT_LENGTH; c++) {
+        if (!((tth[c] >= 'A' && tth[c] <= 'Z') || (tth[c] >= '2' && tth[c] <= '7')))
+            return 0;
+    }
+    return 1;
+}
+
+/* Read the sidecar of filename, whose status is st. If the sidecar was
+ * written for the file as it is now, its root is copied to tth (which
+ * must have room for TTH_SIDECAR_ROOT_LENGTH+1 characters) and 0 is
+ * returned. If the sidecar has leaves that match the root, they are
+ * returned in tthl, to be freed by the caller, otherwise tthl is NULL.
+ * Returns -1 if there is no usable sidecar.
+ */
+int
+tth_sidecar_read(const char *filename, const struct stat *st, char *tth, char **tthl, size_t *tthl_len)
+{
+    char *sidecar = tth_sidecar_filename(filename);
+    struct stat sidecar_st;
+    uint64_t size;
+    time_t mtime, ctime;
+    int fd;
+    int res = -1;
+
+    *tthl = NULL;
+    *tthl_len = 0;
+    if (sidecar == NULL)
+        return -1;
+    fd = open(sidecar, O_RDONLY);
+    free(sidecar);
+    if (fd < 0)
+        return -1;
+
+    if (fstat(fd, &sidecar_st) == 0
+            && read_fully(fd, &size, sizeof(size)) == 0 && size == (uint64_t) st->st_size
+            && read_fully(fd, &mtime, sizeof(mtime)) == 0 && mtime == st->st_mtime
+            && read_fully(fd, &ctime, sizeof(ctime)) == 0 && ctime == st->st_ctime
+            && read_fully(fd, tth, TTH_SIDECAR_ROOT_LENGTH) == 0 && valid_root(tth)) {
+        off_t leaves_len = sidecar_st.st_size - (off_t) (sizeof(size) + sizeof(mtime) + sizeof(ctime) + TTH_SIDECAR_ROOT_LENGTH);
+
+        tth[TTH_SIDECAR_ROOT_LENGTH] = '\0';
+        res = 0;
+
+        /* Leaves that do not add up to the root are ignored. */
+        if (leaves_len > 0 && leaves_len % TIGERSIZE == 0 && leaves_len <= MAX_SIDECAR_LEAVES * TIGERSIZE) {
+            unsigned char *leaves = malloc(leaves_len);
+            unsigned char root[TIGERSIZE];
+            char *encoded = NULL;
+
+            if (leaves != NULL && read_fully(fd, leaves, leaves_len) == 0) {
+                tt_combine(leaves, leaves_len / TIGERSIZE, root);
+                encoded = base32_encode(root, sizeof(root));
+            }
+            if (encoded != NULL && strcmp(encoded, tth) == 0) {
+                *tthl = (char *) leaves;
+                *tthl_len = leaves_len;
+            } else {
+                free(leaves);
+            }
+            free(encoded);
+        }
+    }
+    close(fd);
+    return res;
+}
+
+/* Write the sidecar of filename, whose status is st, creating the
+ * sidecar directory if needed. tthl may be NULL. Returns -1 with errno
+ * set on failure.
+ */
+int
+tth_sidecar_write(const char *filename, const struct stat *st, const char *tth, const char *tthl, size_t tthl_len)
+{
+    char *sidecar = tth_sidecar_filename(filename);
+    char *tmp_sidecar;
+    uint64_t size = st->st_size;
+    time_t mtime = st->st_mtime;
+    time_t ctime = st->st_ctime;
+    int fd;
+    int res = -1;
+
+    if (sidecar == NULL)
+        return -1;
+    tmp_sidecar = malloc(strlen(sidecar) + 5);
+    if (tmp_sidecar == NULL) {
+        free(sidecar);
+        return -1;
+    }
+    sprintf(tmp_sidecar, "%s.tmp", sidecar);
+
+    fd = open(tmp_sidecar, O_CREAT|O_WRONLY|O_TRUNC, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+    if (fd < 0 && errno == ENOENT) {
+        char *dir = strrchr(tmp_sidecar, '/');
+        *dir = '\0';
+        if (mkdir(tmp_sidecar, S_IRWXU|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH) == 0 || errno == EEXIST) {
+            *dir = '/';
+            fd = open(tmp_sidecar, O_CREAT|O_WRONLY|O_TRUNC, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+        }
+    }
+    if (fd >= 0) {
+        if (write_fully(fd, &size, sizeof(size)) == 0
+                && write_fully(fd, &mtime, sizeof(mtime)) == 0
+                && write_fully(fd, &ctime, sizeof(ctime)) == 0
+                && write_fully(fd, tth, TTH_SIDECAR_ROOT_LENGTH) == 0
+                && (tthl == NULL || write_fully(fd, tthl, tthl_len) == 0))
+            res = 0;
+        if (close(fd) < 0)
+            res = -1;
+        if (res == 0)
+            res = rename(tmp_sidecar, sidecar);
+        if (res < 0) {
+            int saved_errno = errno;
+            unlink(tmp_sidecar);
+            errno = saved_errno;
+        }
+    }
+    free(tmp_sidecar);
+    free(sidecar);
+    return res;
+}
@@ -0,0 +1,44 @@
+/*
+ * tth_sidecar.h
+ * This file is part of microdc
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __TTH_SIDECAR_H
+#define __TTH_SIDECAR_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/* Hashes of the files in a directory may be kept in this directory in
+ * it, one file named <name>.tth for each. */
+#define TTH_SIDECAR_DIRECTORY ".microdc_tth"
+/* Length of a base32 encoded root. */
+#define TTH_SIDECAR_ROOT_LENGTH 39
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+    char *tth_sidecar_filename(const char *filename);
+    int tth_sidecar_read(const char *filename, const struct stat *st, char *tth, char **tthl, size_t *tthl_len);
+    int tth_sidecar_write(const char *filename, const struct stat *st, const char *tth, const char *tthl, size_t tthl_len);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif // ifndef __TTH_SIDECAR_H
@@ -1,3 +1,391 @@
+#include <config.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "xalloc.h"		/* Gnulib */
+#include "xvasprintf.h"		/* Gnulib */
+#include "dirname.h"		/* Gnulib */
+#include "microdc.h"
 #include "tth_file.h"
+#include "tth/tth_sidecar.h"
+
+const char tth_directory_name[] = TTH_SIDECAR_DIRECTORY;
+
+/* The leaves of shared files are kept in files named after their TTH in
+ * this directory, next to the saved file list. */
+static const char tthl_directory_name[] = "tthl";
+
+/* The roots of files that have been hashed are remembered in this file by
+ * device, inode, size, modification time and ctime, so that files are not
+ * hashed again when their directories are renamed, or when they are
+ * unshared and shared again. The mtime can be set back after the file is
+ * changed, so the ctime is part of the key as well, even though renaming
+ * a file changes it on most file systems. Each line is
+ *
+ *   <dev> <ino> <size> <mtime> <ctime> <tth>
+ *
+ * New roots are appended, later lines replace earlier ones with the same
+ * key. The file is rewritten without the replaced lines when it is loaded
+ * and they make up most of it.
+ */
+static const char tth_cache_name[] = "tth-cache";
+
+/* Files that were being hashed when hashing stopped, or that take long to
+ * hash, have the leaves hashed so far saved in this directory, in a file
+ * named after their device and inode. The file starts with the line
+ *
+ *   <size> <mtime> <ctime> <bytes hashed>
+ *
+ * followed by the leaves. Hashing resumes from there if the file has not
+ * changed. */
+static const char tth_checkpoint_directory_name[] = "hashing";
+
+/* Checkpoints are not trusted to hold more than this many bytes of leaves. */
+#define TTH_CHECKPOINT_MAX_LEAVES (64*1024)
+
+typedef struct _TTHCacheEntry TTHCacheEntry;
+
+struct _TTHCacheEntry {
+    char *key;
+    char tth[DC_TTH_LENGTH+1];
+};
+
+static HMap *tth_cache = NULL;
+static FILE *tth_cache_fh = NULL;
+
+/* Return the name of the file holding the leaves of the file whose
+ * root hash is tth (DC_TTH_LENGTH characters, not necessarily null
+ * terminated).
+ */
+char *
+tthl_filename(const char *tth)
+{
+    char *dir;
+    char *filename;
+
+    get_package_file(tthl_directory_name, &dir);
+    filename = xasprintf("%s/%.*s", dir, DC_TTH_LENGTH, tth);
+    free(dir);
+    return filename;
+}
+
+bool
+has_tthl(const char *tth)
+{
+    char *filename = tthl_filename(tth);
+    struct stat st;
+    bool res;
+
+    res = (stat(filename, &st) == 0);
+    free(filename);
+    return res;
+}
+
+/* Save the leaves of tth. They are written to a temporary file first, so
+ * that an incomplete file is never served.
+ */
+bool
+save_tthl(const char *tth, const void *leaves, size_t size)
+{
+    char *filename = tthl_filename(tth);
+    char *tmp_filename = xasprintf("%s.tmp", filename);
+    FILE *fh;
+    bool res = false;
+
+    fh = fopen(tmp_filename, "w");
+    if (fh == NULL && errno == ENOENT) {
+        char *dir = dir_name(filename);
+        if (mkdir(dir, 0777) == 0)
+            fh = fopen(tmp_filename, "w");
+        free(dir);
+    }
+    if (fh != NULL) {
+        res = (fwrite(leaves, 1, size, fh) == size);
+        res = (fclose(fh) == 0) && res;
+        if (res)
+            res = (rename(tmp_filename, filename) == 0);
+        if (!res)
+            unlink(tmp_filename);
+    }
+    free(tmp_filename);
+    free(filename);
+    return res;
+}
+
+static char *
+tth_cache_key(const struct stat *st)
+{
+    return xasprintf("%" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRId64 " %" PRId64,
+                     (uint64_t) st->st_dev, (uint64_t) st->st_ino,
+                     (uint64_t) st->st_size, (int64_t) st->st_mtime, (int64_t) st->st_ctime);
+}
+
+static void
+tth_cache_entry_free(TTHCacheEntry *entry)
+{
+    free(entry->key);
+    free(entry);
+}
+
+/* Write all entries to filename, replacing it. */
+static bool
+tth_cache_rewrite(const char *filename)
+{
+    char *tmp_filename = xasprintf("%s.tmp", filename);
+    HMapIterator it;
+    FILE *fh;
+    bool res = false;
+
+    fh = fopen(tmp_filename, "w");
+    if (fh != NULL) {
+        res = true;
+        hmap_iterator(tth_cache, &it);
+        while (it.has_next(&it) && res) {
+            TTHCacheEntry *entry = it.next(&it);
+            res = (fprintf(fh, "%s %s\n", entry->key, entry->tth) >= 0);
+        }
+        res = (fclose(fh) == 0) && res;
+        if (res)
+            res = (rename(tmp_filename, filename) == 0);
+        if (!res)
+            unlink(tmp_filename);
+    }
+    free(tmp_filename);
+    return res;
+}
+
+/* Read the cache of file roots, and open it for adding new ones. */
+void
+tth_cache_load(void)
+{
+    char *filename;
+    char line[256];
+    uint32_t lines = 0;
+    FILE *fh;
+
+    tth_cache_free();
+    tth_cache = hmap_new();
+    if (!get_package_file(tth_cache_name, &filename))
+        return;
+
+    fh = fopen(filename, "r");
+    if (fh != NULL) {
+        while (fgets(line, sizeof(line), fh) != NULL) {
+            char *tth;
+            char *p;
+            int fields = 1;
+            TTHCacheEntry *entry;
+
+            line[strcspn(line, "\n")] = '\0';
+            tth = strrchr(line, ' ');
+            lines++;
+            if (tth == NULL || strlen(tth+1) != DC_TTH_LENGTH)
+                continue;
+            *tth++ = '\0';
+            /* Lines from before the ctime was in the key never match. */
+            for (p = line; (p = strchr(p, ' ')) != NULL; p++)
+                fields++;
+            if (fields != 5)
+                continue;
+
+            entry = hmap_get(tth_cache, line);
+            if (entry == NULL) {
+                entry = xmalloc(sizeof(TTHCacheEntry));
+                entry->key = xstrdup(line);
+                hmap_put(tth_cache, entry->key, entry);
+            }
+            strcpy(entry->tth, tth);
+        }
+        fclose(fh);
+    }
+
+    if (lines > 2 * hmap_size(tth_cache) + 1024)
+        tth_cache_rewrite(filename);
+    tth_cache_fh = fopen(filename, "a");
+    free(filename);
+}
+
+/* Return the root of the file st was returned for, if it has been hashed
+ * before, or NULL. */
+const char *
+tth_cache_lookup(const struct stat *st)
+{
+    char *key;
+    TTHCacheEntry *entry;
+
+    if (tth_cache == NULL)
+        return NULL;
+    key = tth_cache_key(st);
+    entry = hmap_get(tth_cache, key);
+    free(key);
+    return entry != NULL ? entry->tth : NULL;
+}
+
+/* Remember that the file st was returned for has the root tth. */
+void
+tth_cache_add(const struct stat *st, const char *tth)
+{
+    char *key;
+    TTHCacheEntry *entry;
+
+    if (tth_cache == NULL)
+        return;
+    key = tth_cache_key(st);
+    entry = hmap_get(tth_cache, key);
+    if (entry != NULL) {
+        free(key);
+        if (strncmp(entry->tth, tth, DC_TTH_LENGTH) == 0)
+            return;
+    } else {
+        entry = xmalloc(sizeof(TTHCacheEntry));
+        entry->key = key;
+        hmap_put(tth_cache, entry->key, entry);
+    }
+    memcpy(entry->tth, tth, DC_TTH_LENGTH);
+    entry->tth[DC_TTH_LENGTH] = '\0';
+    if (tth_cache_fh != NULL) {
+        fprintf(tth_cache_fh, "%s %s\n", entry->key, entry->tth);
+        fflush(tth_cache_fh);
+    }
+}
+
+void
+tth_cache_free(void)
+{
+    if (tth_cache_fh != NULL) {
+        fclose(tth_cache_fh);
+        tth_cache_fh = NULL;
+    }
+    if (tth_cache != NULL) {
+        hmap_foreach_value(tth_cache, tth_cache_entry_free);
+        hmap_free(tth_cache);
+        tth_cache = NULL;
+    }
+}
+
+static char *
+tth_checkpoint_filename(const struct stat *st)
+{
+    char *dir;
+    char *filename;
+
+    get_package_file(tth_checkpoint_directory_name, &dir);
+    filename = xasprintf("%s/%" PRIu64 ".%" PRIu64, dir,
+                         (uint64_t) st->st_dev, (uint64_t) st->st_ino);
+    free(dir);
+    return filename;
+}
+
+/* Return the leaves saved for the file st was returned for, and how many
+ * bytes of it they cover. Returns false if there is no checkpoint, or if
+ * the file has changed since it was made. */
+bool
+tth_checkpoint_load(const struct stat *st, off_t *done, char **leaves, size_t *size)
+{
+    char *filename = tth_checkpoint_filename(st);
+    char line[128];
+    uint64_t cp_size, cp_done;
+    int64_t cp_mtime, cp_ctime;
+    char *buf;
+    size_t len;
+    FILE *fh;
+
+    fh = fopen(filename, "r");
+    free(filename);
+    if (fh == NULL)
+        return false;
+    if (fgets(line, sizeof(line), fh) == NULL
+            || sscanf(line, "%" SCNu64 " %" SCNd64 " %" SCNd64 " %" SCNu64,
+                      &cp_size, &cp_mtime, &cp_ctime, &cp_done) != 4
+            || cp_size != (uint64_t) st->st_size
+            || cp_mtime != (int64_t) st->st_mtime
+            || cp_ctime != (int64_t) st->st_ctime
+            || cp_done >= cp_size) {
+        fclose(fh);
+        return false;
+    }
+    buf = xmalloc(TTH_CHECKPOINT_MAX_LEAVES);
+    len = fread(buf, 1, TTH_CHECKPOINT_MAX_LEAVES, fh);
+    fclose(fh);
+    if (len == 0) {
+        free(buf);
+        return false;
+    }
+    *done = cp_done;
+    *leaves = buf;
+    *size = len;
+    return true;
+}
+
+/* Save the leaves of the first done bytes of the file st was returned for.
+ * The checkpoint is written to a temporary file first, so that a
+ * checkpoint that was not completely written is never used. */
+bool
+tth_checkpoint_save(const struct stat *st, off_t done, const char *leaves, size_t size)
+{
+    char *filename = tth_checkpoint_filename(st);
+    char *tmp_filename = xasprintf("%s.tmp", filename);
+    FILE *fh;
+    bool res = false;
+
+    fh = fopen(tmp_filename, "w");
+    if (fh == NULL && errno == ENOENT) {
+        char *dir = dir_name(filename);
+        if (mkdir(dir, 0777) == 0)
+            fh = fopen(tmp_filename, "w");
+        free(dir);
+    }
+    if (fh != NULL) {
+        res = (fprintf(fh, "%" PRIu64 " %" PRId64 " %" PRId64 " %" PRIu64 "\n",
+                       (uint64_t) st->st_size, (int64_t) st->st_mtime,
+                       (int64_t) st->st_ctime, (uint64_t) done) > 0);
+        res = (fwrite(leaves, 1, size, fh) == size) && res;
+        res = (fclose(fh) == 0) && res;
+        if (res)
+            res = (rename(tmp_filename, filename) == 0);
+        if (!res)
+            unlink(tmp_filename);
+    }
+    free(tmp_filename);
+    free(filename);
+    return res;
+}
+
+void
+tth_checkpoint_remove(const struct stat *st)
+{
+    char *filename = tth_checkpoint_filename(st);
+
+    unlink(filename);
+    free(filename);
+}
+
+/* Remove all checkpoints. Those of files that were unshared or deleted
+ * while they were hashed are otherwise never removed. */
+void
+tth_checkpoint_clear(void)
+{
+    char *dir;
+    DIR *dh;
+    struct dirent *ent;
 
-const char tth_directory_name[] = ".microdc_tth";
+    get_package_file(tth_checkpoint_directory_name, &dir);
+    dh = opendir(dir);
+    if (dh != NULL) {
+        while ((ent = readdir(dh)) != NULL) {
+            if (ent->d_name[0] != '.') {
+                char *filename = catfiles(dir, ent->d_name);
+                unlink(filename);
+                free(filename);
+            }
+        }
+        closedir(dh);
+    }
+    free(dir);
+}
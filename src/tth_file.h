@@ -1,10 +1,26 @@
 #ifndef __TTH_FILE_H
 #define __TTH_FILE_H
 
+#include <sys/stat.h>
+
 #define IS_CURRENT_DIR(x) ((x)[0] == '.' && (x)[1] == '\0')
 #define IS_PARENT_DIR(x)  ((x)[0] == '.' && (x)[1] == '.' && (x)[2] == '\0')
 #define IS_SPECIAL_DIR(x) (IS_CURRENT_DIR(x) || IS_PARENT_DIR(x) || strncmp(x, tth_directory_name, strlen(tth_directory_name)) == 0)
 
 extern const char tth_directory_name[];
 
+char *tthl_filename(const char *tth);
+bool has_tthl(const char *tth);
+bool save_tthl(const char *tth, const void *leaves, size_t size);
+
+void tth_cache_load(void);
+const char *tth_cache_lookup(const struct stat *st);
+void tth_cache_add(const struct stat *st, const char *tth);
+void tth_cache_free(void);
+
+bool tth_checkpoint_load(const struct stat *st, off_t *done, char **leaves, size_t *size);
+bool tth_checkpoint_save(const struct stat *st, off_t done, const char *leaves, size_t size);
+void tth_checkpoint_remove(const struct stat *st);
+void tth_checkpoint_clear(void);
+
 #endif // ifndef __TTH_FILE_H
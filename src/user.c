@@ -1,4 +1,4 @@
-/* user.c - User communication (in separate process)
+/* user.c - User communication (in separate process or main reactor)
  *
  * Copyright (C) 2004, 2005 Oskar Liljeblad
  * Copyright (C) 2006 Alexey Illarionov <littlesavage@rambler.ru>
@@ -30,8 +30,12 @@
 #include <sys/socket.h>		/* ? */
 #include <sys/types.h>		/* ? */
 #include <netinet/in.h>		/* ? */
+#include <netinet/tcp.h>	/* ? */
 #include <arpa/inet.h>		/* ? */
 #include <inttypes.h>		/* ? */
+#if defined(__linux__)
+#include <sys/sendfile.h>	/* Linux */
+#endif
 #include "dirname.h"		/* Gnulib */
 #include "full-write.h"		/* Gnulib */
 #include "xstrndup.h"		/* Gnulib */
@@ -58,10 +62,42 @@
 
 #define DEFAULT_RECVQ_SIZE (64*1024)
 #define DEFAULT_SENDQ_SIZE (64*1024)
+/* Upper limit of data passed to sendfile or splice at once, so that one
+ * transfer cannot hold up other connections in the same reactor for long. */
+#define ZERO_COPY_BLOCK_SIZE (1024*1024)
+/* Downloaded data is written back and dropped from the page cache in
+ * windows of this size. */
+#define DOWNLOAD_WRITEBACK_SIZE (8*1024*1024)
+/* Uploaded files are read ahead of the sending position by this much. */
+#define UPLOAD_READAHEAD_SIZE (4*1024*1024)
+/* Socket buffers and the upload send queue are sized after the
+ * bandwidth-delay product, measured this often during transfers. */
+#define BDP_SAMPLE_INTERVAL 1000 /* milliseconds */
+#define MIN_SOCKET_BUFFER_SIZE (64*1024)
+#define MAX_SOCKET_BUFFER_SIZE (16*1024*1024)
+/* Rate limited transfers wait until at least this much may be sent or
+ * received, rather than moving tiny blocks. */
+#define MIN_THROTTLE_BLOCK_SIZE 4096
+/* Transfer progress is reported to main at most this often. Main only
+ * needs it for the transfers command and to account for the bytes
+ * transferred when the transfer ends, which is always reported. */
+#define TRANSFER_STATUS_INTERVAL 250 /* milliseconds */
+/* TTH leaves we accept when repairing a file. Clients send at most a
+ * few thousand leaves, this allows for many more. */
+#define MAX_LEAVES_SIZE (1024*1024)
 
 #define USER_CONN_IDLE_TIMEOUT (3*60)
 
-typedef struct _DCUserConnLocal DCUserConnLocal;
+/* Called when the reply to a request to main has arrived. */
+typedef void (*UserReplyHandler)(DCUserConnLocal *ucl);
+
+/* How an upload was requested, and so how to answer it once main has
+ * allowed it. */
+typedef enum {
+    DC_UPLOAD_GET,		/* $Get, answered with $FileLength */
+    DC_UPLOAD_UGETBLOCK,	/* $UGetBlock, answered with $Sending */
+    DC_UPLOAD_ADCGET,		/* $ADCGET, answered with $ADCSND */
+} DCUploadRequest;
 
 struct _DCUserConnLocal {
     MsgQ *get_mq;/*=NULL*/
@@ -76,10 +112,30 @@ struct _DCUserConnLocal {
     uint16_t dir_rand;
     bool we_connected;
     DCTransferDirection our_dir;
+    char *our_nick;		/* our nick when the connection was started */
     DCUserState user_state/* = DC_USER_CONNECT*/;
+    int32_t request_id;		/* id of the last request to main */
+    UserReplyHandler reply_handler; /* handles the reply to request_id, NULL if none is awaited */
+    bool input_paused;		/* user_socket is not read until the reply arrives */
+    int corked;			/* user_putf only queues commands while > 0 */
+    bool we_download;		/* from main, along with the nick validation */
+    bool key_expected;		/* $Direction has been handled but not $Key */
+    uint32_t idle_timeout;	/* seconds to wait for more files in DC_USER_IDLE */
+    DCUploadRequest upload_request; /* the upload request main is asked about */
+    DCAdcgetType upload_type;
+    uint64_t upload_offset;
+    uint64_t upload_length;	/* UINT64_MAX for the rest of the file */
+    char *upload_id;		/* type and identifier to repeat in $ADCSND */
     bool user_running/* = true*/;
-    fd_set user_read_fds;
-    fd_set user_write_fds;
+    Reactor *reactor;
+    ReactorTimer *idle_timer;
+    uint64_t last_activity;	/* reactor time of last socket I/O */
+
+    /* These are only used when running in the main process. */
+    bool in_process;
+    bool busy;			/* one of our handlers is on the stack */
+    DCUserConn *uc;		/* NULL once main has let go of us */
+    ScreenWriter main_writer;
 
     PtrV*  supports;
 
@@ -88,11 +144,35 @@ struct _DCUserConnLocal {
     char *share_file;	/* complete filename in shared file namespace. */
     char *local_file;	/* complete filename in local physical file namespace. */
     int transfer_fd;	/* file descriptor for opened local_file */
+    DCFileListBuffer *list_buffer; /* file list sent from memory instead of transfer_fd */
     uint64_t file_pos;	/* how much of local_file that has been written */
     uint64_t final_pos;	/* how much of local_file shuld be written */
     uint64_t file_size;	/* the final size of local_file */
     uint64_t transfer_pos;	/* how much that has been read (but not necessarily written yet) */
     bool local_exists;	/* does local_file exist already? */
+    bool zero_copy;	/* transfer data without copying it through user_sendq/user_recvq */
+    int splice_pipe[2];	/* used to splice downloads from socket to file */
+    uint64_t writeback_pos; /* how much of local_file that writeback has been started for */
+    uint64_t dropped_pos; /* how much of local_file that has been dropped from the page cache */
+    uint64_t readahead_pos; /* how much of local_file that readahead has been requested for */
+    bool hot_file;	/* local_file is uploaded to others as well, keep it in the page cache */
+    uint64_t bdp_sample_time; /* reactor time of last bandwidth-delay product sample */
+    uint64_t bdp_sample_pos; /* transfer_pos at the time of last sample */
+    uint64_t status_time; /* reactor time progress was last reported to main */
+    uint64_t status_pos; /* progress not yet reported to main, if status_pending */
+    bool status_pending;
+    size_t socket_buffer_size; /* SO_SNDBUF/SO_RCVBUF we have asked for, or 0 */
+    size_t sendq_target;	/* how much file data to keep in user_sendq when uploading */
+    RateLimit user_limit;	/* limit of this user, in the direction of our transfer */
+    ReactorTimer *throttle_timer; /* set while the socket is not watched due to rate limits */
+    bool verify;	/* hash downloaded data, so that main can verify it */
+    TT_CONTEXT tt;	/* Tiger tree of the segment being received */
+    unsigned char tt_leaf[1+BLOCKSIZE]; /* leaf being received, after the leaf prefix */
+    uint64_t hash_pos;	/* how much of local_file that has been hashed */
+    uint8_t *roots;	/* roots of the segments hashed so far */
+    size_t roots_size;
+    char *hash_buf;	/* for reading back data written with splice */
+    bool leaves;	/* receiving TTH leaves into roots instead of a file */
     //} dl;
     //struct {
     //char *share_file;	/* complete filename in shared file namespace. */
@@ -108,6 +188,12 @@ struct _DCUserConnLocal {
 static DCUserConnLocal *cur_ucl;
 
 static void upload_file(DCUserConnLocal *ucl);
+static void download_next_file(DCUserConnLocal *ucl);
+static void handle_user_input(DCUserConnLocal *ucl);
+static void user_socket_readable(DCUserConnLocal *ucl);
+static void user_socket_writable(DCUserConnLocal *ucl);
+static void user_throttle_timer_expired(DCUserConnLocal *ucl);
+static void user_conn_local_free(DCUserConnLocal *ucl);
 
 /* NOTE: All the code below assumes that main never disconnects a user
  * (close on main_socket) on purpose. The user must do this first if
@@ -122,7 +208,8 @@ static void upload_file(DCUserConnLocal *ucl);
 static void
 fatal_error(DCUserConnLocal *ucl, int res, bool writing) /* XXX: rename communication_error or something */
 {
-    warn_writer = default_warn_writer;
+    if (!ucl->in_process)
+        warn_writer = default_warn_writer;
     /* These tests are for the case when the main process closed
      * the connection first. The first test is when reading (and
      * the result is EOF because of closed pipe), and the second
@@ -136,6 +223,37 @@ fatal_error(DCUserConnLocal *ucl, int res, bool writing) /* XXX: rename communic
     ucl->user_running = false;
 }
 
+/* Report progress that has not been reported to main yet. */
+static bool
+flush_user_status(DCUserConnLocal *ucl)
+{
+    int res;
+
+    if (!ucl->status_pending)
+        return true;
+    ucl->status_pending = false;
+    ucl->status_time = reactor_now(ucl->reactor);
+    res = msgq_put_sync(ucl->put_mq, MSGQ_INT, DC_MSG_TRANSFER_STATUS, MSGQ_INT64, ucl->status_pos, MSGQ_END);
+    if (res <= 0) {
+        fatal_error(ucl, res, true);
+        return false;
+    }
+    return true;
+}
+
+/* Note the transfer progress, and report it to main unless that was
+ * done less than TRANSFER_STATUS_INTERVAL ago.
+ */
+static bool
+send_user_status(DCUserConnLocal *ucl, uint64_t pos)
+{
+    ucl->status_pos = pos;
+    ucl->status_pending = true;
+    if (reactor_now(ucl->reactor) - ucl->status_time < TRANSFER_STATUS_INTERVAL)
+        return true;
+    return flush_user_status(ucl);
+}
+
 /* This function should be called when the user process decided to
  * terminate itself (but the communication to the main process
  * is still usable).
@@ -145,6 +263,8 @@ terminate_process(DCUserConnLocal *ucl)
 {
     int res;
 
+    if (!flush_user_status(ucl))
+        return;
     ucl->user_running = false;
     res = msgq_put_sync(ucl->put_mq, MSGQ_INT, DC_MSG_TERMINATING, MSGQ_END);
     if (res <= 0) {
@@ -164,17 +284,143 @@ check_state(DCUserConnLocal *ucl, char *buf, DCUserState state)
     return true;
 }
 
-static bool
-send_user_status(DCUserConnLocal *ucl, uint64_t pos)
+static void
+start_bdp_sampling(DCUserConnLocal *ucl)
 {
-    int res;
+    ucl->bdp_sample_time = reactor_now(ucl->reactor);
+    ucl->bdp_sample_pos = ucl->transfer_pos;
+}
 
-    res = msgq_put_sync(ucl->put_mq, MSGQ_INT, DC_MSG_TRANSFER_STATUS, MSGQ_INT64, pos, MSGQ_END);
-    if (res <= 0) {
-        fatal_error(ucl, res, true);
-        return false;
+#if defined(__linux__)
+/* Return the largest socket buffer that can be set without privileges,
+ * from /proc/sys/net/core/wmem_max or rmem_max, or SIZE_MAX if that is
+ * not known.
+ */
+static size_t
+socket_buffer_max(bool send)
+{
+    static size_t max[2] = { 0, 0 };
+    size_t *cached = &max[send ? 1 : 0];
+
+    if (*cached == 0) {
+        FILE *fh = fopen(send ? "/proc/sys/net/core/wmem_max" : "/proc/sys/net/core/rmem_max", "r");
+        unsigned long value;
+
+        *cached = SIZE_MAX;
+        if (fh != NULL) {
+            if (fscanf(fh, "%lu", &value) == 1 && value > 0)
+                *cached = value;
+            fclose(fh);
+        }
     }
-    return true;
+    return *cached;
+}
+#endif
+
+/* Estimate the bandwidth-delay product of the connection from the
+ * recent transfer rate and the round-trip time measured by the kernel.
+ * The socket buffer in the direction of the transfer is grown to twice
+ * that, leaving room for the rate to increase, and uploads keep as
+ * much file data queued when they cannot use sendfile.
+ */
+static void
+adapt_socket_buffers(DCUserConnLocal *ucl)
+{
+#if defined(__linux__) && defined(TCP_INFO)
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    uint64_t now;
+    uint64_t rate;
+    uint64_t size;
+    int optname;
+    int value;
+
+    now = reactor_now(ucl->reactor);
+    if (now - ucl->bdp_sample_time < BDP_SAMPLE_INTERVAL)
+        return;
+    rate = (ucl->transfer_pos - ucl->bdp_sample_pos) * 1000 / (now - ucl->bdp_sample_time);
+    start_bdp_sampling(ucl);
+
+    if (getsockopt(ucl->user_socket, IPPROTO_TCP, TCP_INFO, &info, &len) < 0)
+        return;
+    /* tcpi_rtt is in microseconds. */
+    size = 2 * rate * info.tcpi_rtt / 1000000;
+    size = MAX(size, MIN_SOCKET_BUFFER_SIZE);
+    size = MIN(size, MAX_SOCKET_BUFFER_SIZE);
+
+    ucl->sendq_target = size;
+    /* Never shrink buffers, which would throttle a recovering connection. */
+    if (size <= ucl->socket_buffer_size)
+        return;
+
+    /* Setting the buffer size turns off the kernel's autotuning of it
+     * for good. It is only set when it raises the buffer above what the
+     * kernel has already grown it to. The kernel reports twice the size
+     * that was set, and caps what is set at wmem_max or rmem_max.
+     */
+    optname = (ucl->our_dir == DC_DIR_SEND ? SO_SNDBUF : SO_RCVBUF);
+    size = MIN(size, socket_buffer_max(ucl->our_dir == DC_DIR_SEND));
+    len = sizeof(value);
+    if (getsockopt(ucl->user_socket, SOL_SOCKET, optname, &value, &len) < 0 || value < 0)
+        return;
+    if (2 * size <= (uint64_t) value)
+        return;
+    ucl->socket_buffer_size = size;
+    value = size;
+    if (setsockopt(ucl->user_socket, SOL_SOCKET, optname, &value, sizeof(value)) < 0)
+        flag_putf(DC_DF_DEBUG, _("Cannot set socket buffer size - %s\n"), errstr);
+#endif
+}
+
+/* Return how many bytes, at most max, the global and per-user rate
+ * limits allow to be transferred now. If that is less than a
+ * reasonable block, stop watching the socket until the limits allow
+ * one, and return 0. That way throttled connections sleep in the
+ * reactor instead of being woken up over and over by a ready socket.
+ */
+static size_t
+transfer_allowance(DCUserConnLocal *ucl, size_t max)
+{
+    bool upload = (ucl->user_state == DC_USER_DATA_SEND);
+    RateLimit *global = upload ? &transfer_limits->upload : &transfer_limits->download;
+    size_t allowed;
+    size_t block;
+    uint64_t delay;
+
+    ratelimit_set_rate(&ucl->user_limit, upload ? transfer_limits->user_upload_rate : transfer_limits->user_download_rate);
+    allowed = ratelimit_available(global, max);
+    allowed = ratelimit_available(&ucl->user_limit, allowed);
+    block = MIN(MIN_THROTTLE_BLOCK_SIZE, max);
+    if (allowed >= block)
+        return allowed;
+
+    delay = MAX(ratelimit_delay(global, block), ratelimit_delay(&ucl->user_limit, block));
+    if (upload)
+        reactor_unwatch_write(ucl->reactor, ucl->user_socket);
+    else
+        reactor_unwatch_read(ucl->reactor, ucl->user_socket);
+    reactor_timer_set(ucl->throttle_timer, MAX(delay, 1));
+    return 0;
+}
+
+static void
+transfer_consumed(DCUserConnLocal *ucl, size_t len)
+{
+    if (ucl->user_state == DC_USER_DATA_SEND)
+        ratelimit_consume(&transfer_limits->upload, len);
+    else
+        ratelimit_consume(&transfer_limits->download, len);
+    ratelimit_consume(&ucl->user_limit, len);
+}
+
+/* Start watching the socket again once the rate limits allow it. */
+static void
+resume_transfer(DCUserConnLocal *ucl)
+{
+    if (ucl->user_state == DC_USER_DATA_SEND)
+        reactor_watch_write(ucl->reactor, ucl->user_socket, (ReactorCallback) user_socket_writable, ucl);
+    else if (ucl->user_state == DC_USER_DATA_RECV)
+        reactor_watch_read(ucl->reactor, ucl->user_socket, (ReactorCallback) user_socket_readable, ucl);
 }
 
 static void
@@ -191,6 +437,51 @@ user_screen_writer(DCDisplayFlag flag, const char *format, va_list args)
         fatal_error(ucl, res, true); /* delay handling until later. */
 }
 
+/* Write what is in user_sendq, and watch user_socket for writing if
+ * not all of it could be written.
+ */
+static bool
+flush_user_sendq(DCUserConnLocal *ucl)
+{
+    int res;
+
+    res = byteq_write(ucl->user_sendq, ucl->user_socket);
+    if (res == 0 || (res < 0 && errno != EAGAIN)) {
+        warn_socket_error(res, true, _("user"));
+        terminate_process(ucl); /* MSG: socket error above */
+        return false;
+    }
+    if (ucl->user_sendq->cur > 0)
+        reactor_watch_write(ucl->reactor, ucl->user_socket, (ReactorCallback) user_socket_writable, ucl);
+    return true;
+}
+
+/* Hold back the commands put with user_putf until user_uncork, so that
+ * all commands sent in response to what the user sent go out in a
+ * single write. Corking nests.
+ */
+static void
+user_cork(DCUserConnLocal *ucl)
+{
+    ucl->corked++;
+}
+
+static void
+user_uncork(DCUserConnLocal *ucl)
+{
+    if (--ucl->corked > 0 || ucl->user_sendq->cur == 0)
+        return;
+    /* A command put just before terminating is still sent if possible. */
+    if (!ucl->user_running) {
+        byteq_write(ucl->user_sendq, ucl->user_socket);
+        return;
+    }
+    /* When sending a file, the command is written with the first block. */
+    if (ucl->user_state == DC_USER_DATA_SEND)
+        return;
+    flush_user_sendq(ucl);
+}
+
 /* Put some data onto the connection, printf style.
  */
 bool
@@ -198,11 +489,10 @@ user_putf(DCUserConnLocal *ucl, const char *format, ...)
 {
     va_list args;
     uint32_t oldcur;
-    int res;
 
     oldcur = ucl->user_sendq->cur;
     va_start(args, format);
-    res = byteq_vappendf(ucl->user_sendq, format, args);
+    byteq_vappendf(ucl->user_sendq, format, args);
     va_end(args);
 
     /* byteq_vappendf cannot fail. */
@@ -215,101 +505,147 @@ user_putf(DCUserConnLocal *ucl, const char *format, ...)
     if (ucl->data_size/*DL*/ == 0)
         dump_command(_("-->"), ucl->user_sendq->buf+oldcur, ucl->user_sendq->cur-oldcur);
 
-    res = byteq_write(ucl->user_sendq, ucl->user_socket);
-    if (res == 0 || (res < 0 && errno != EAGAIN)) {
-        warn_socket_error(res, true, _("user"));
-        terminate_process(ucl); /* MSG: socket error above */
-        return false;
-    }
-
-    if (oldcur == 0 && ucl->user_sendq->cur > 0)
-        FD_SET(ucl->user_socket, &ucl->user_write_fds);
+    if (ucl->corked > 0)
+        return true;
+    return flush_user_sendq(ucl);
+}
 
-    return true;
+/* Start a request to main that needs a reply. The returned id is put
+ * after the message type, and main puts it first in the reply, which is
+ * passed to handler when it arrives. Meanwhile the connection keeps
+ * serving its socket, but handles no more commands from the user.
+ */
+static int32_t
+new_request(DCUserConnLocal *ucl, UserReplyHandler handler)
+{
+    ucl->reply_handler = handler;
+    return ++ucl->request_id;
 }
 
-static bool
-wants_to_download(DCUserConnLocal *ucl, bool *reply)
+/* Pass the replies that have been received from main to their handlers. */
+static void
+handle_replies(DCUserConnLocal *ucl)
 {
-    int res;
+    user_cork(ucl);
+    while (ucl->user_running && msgq_has_complete_msg(ucl->get_mq)) {
+        UserReplyHandler handler = ucl->reply_handler;
+        int32_t id;
+
+        msgq_peek(ucl->get_mq, MSGQ_INT32, &id, MSGQ_END);
+        if (handler == NULL || id != ucl->request_id) {
+            warn(_("Received unknown message from main process, shutting down process.\n"));
+            ucl->user_running = false;
+            break;
+        }
+        ucl->reply_handler = NULL;
+        handler(ucl);
+    }
+    user_uncork(ucl);
+}
 
-    res = msgq_put_sync(ucl->put_mq, MSGQ_INT, DC_MSG_WANT_DOWNLOAD, MSGQ_END);
+/* Check the result of putting a request started with new_request.
+ * Main handles requests from in-process connections immediately, so
+ * their replies are handled right away.
+ */
+static void
+request_sent(DCUserConnLocal *ucl, int res)
+{
     if (res <= 0) {
+        ucl->reply_handler = NULL;
         fatal_error(ucl, res, true);
-        return false;
+        return;
     }
-    res = msgq_get_sync(ucl->get_mq, MSGQ_BOOL, reply, MSGQ_END);
-    if (res <= 0) {
-        fatal_error(ucl, res, false);
-        return false;
+    if (ucl->in_process)
+        handle_replies(ucl);
+}
+
+/* Read from user_socket and handle the commands received while a reply
+ * was awaited, once it has been handled.
+ */
+static void
+resume_user_input(DCUserConnLocal *ucl)
+{
+    if (!ucl->user_running || (ucl->reply_handler != NULL && ucl->user_state != DC_USER_IDLE))
+        return;
+    if (ucl->input_paused) {
+        ucl->input_paused = false;
+        reactor_watch_read(ucl->reactor, ucl->user_socket, (ReactorCallback) user_socket_readable, ucl);
     }
-    return true;
+    handle_user_input(ucl);
 }
 
 static bool
-direction_validate(DCUserConnLocal *ucl, DCTransferDirection dir)
+send_my_nick_and_lock(DCUserConnLocal *ucl)
 {
-    bool reply;
-    int res;
+    char *hub_my_nick;
 
-    res = msgq_put_sync(ucl->put_mq, MSGQ_INT, DC_MSG_VALIDATE_DIR, MSGQ_INT, dir, MSGQ_END);
-    if (res <= 0) {
-        fatal_error(ucl, res, true);
-        return false;
-    }
-    res = msgq_get_sync(ucl->get_mq, MSGQ_BOOL, &reply, MSGQ_END);
-    if (res <= 0) {
-        fatal_error(ucl, res, false);
+    hub_my_nick = main_to_hub_string(ucl->our_nick);
+    if (!user_putf(ucl, "$MyNick %s|", hub_my_nick)) {
+        free(hub_my_nick);
         return false;
     }
+    free(hub_my_nick);
+    return user_putf(ucl, "$Lock %s Pk=%s|", LOCK_STRING, LOCK_PK_STRING);
+}
+
+/* Reply to DC_MSG_VALIDATE_NICK, asked when $MyNick was received. Main
+ * also tells if we want to download from the user, so that the rest of
+ * the handshake can be answered without asking it again.
+ */
+static void
+nick_validated(DCUserConnLocal *ucl)
+{
+    int32_t id;
+    bool reply;
+
+    msgq_get(ucl->get_mq, MSGQ_INT32, &id, MSGQ_BOOL, &reply, MSGQ_BOOL, &ucl->we_download, MSGQ_END);
     if (!reply) {
-        warn(_("Too many connections to user, or no free slots.\n"));
+        warn(_("User %s not on hub, or too many connections to user.\n"), quotearg(ucl->user_nick));/*XXX: move main.c */
         terminate_process(ucl); /* MSG: msg above */
-        return false;
+        return;
     }
-    return true;
+    if (!ucl->we_connected && !send_my_nick_and_lock(ucl))
+        return;
+    ucl->user_state = DC_USER_LOCK;
 }
 
+/* Send our part of the handshake that follows $Lock. */
 static bool
-get_our_nick(DCUserConnLocal *ucl, char **str)
+send_direction_and_key(DCUserConnLocal *ucl, const char *key)
 {
-    int res;
-
-    res = msgq_put_sync(ucl->put_mq, MSGQ_INT, DC_MSG_GET_MY_NICK, MSGQ_END);
-    if (res <= 0) {
-        fatal_error(ucl, res, true);
+#if defined(HAVE_LIBXML2)
+    /*if (!user_putf(ucl, "$Supports XmlBZList|")) {*/
+    if (!user_putf(ucl, "$Supports MiniSlots XmlBZList ADCGet TTHF TTHL|"))
         return false;
-    }
-    res = msgq_get_sync(ucl->get_mq, MSGQ_STR, str, MSGQ_END);
-    if (res <= 0) {
-        fatal_error(ucl, res, false);
+#endif
+    if (!user_putf(ucl, "$Direction %s %d|", ucl->we_download ? "Download" : "Upload", ucl->dir_rand))
         return false;
-    }
-    return true;
+    return user_putf(ucl, "$Key %s|", key);
 }
 
-static bool
-nick_validate(DCUserConnLocal *ucl, const char *str)
+/* Reply to DC_MSG_VALIDATE_DIR. When receiving, the first file is
+ * requested right away. The $Key of the user is checked whenever it
+ * arrives, as nothing depends on it.
+ */
+static void
+direction_validated(DCUserConnLocal *ucl)
 {
+    int32_t id;
     bool reply;
-    int res;
 
-    res = msgq_put_sync(ucl->put_mq, MSGQ_INT, DC_MSG_VALIDATE_NICK, MSGQ_STR, str, MSGQ_END);
-    if (res <= 0) {
-        fatal_error(ucl, res, true);
-        return false;
-    }
-    res = msgq_get_sync(ucl->get_mq, MSGQ_BOOL, &reply, MSGQ_END);
-    if (res <= 0) {
-        fatal_error(ucl, res, false);
-        return false;
-    }
+    msgq_get(ucl->get_mq, MSGQ_INT32, &id, MSGQ_BOOL, &reply, MSGQ_END);
     if (!reply) {
-        warn(_("User %s not on hub, or too many connections to user.\n"), quotearg(str));/*XXX: move main.c */
+        warn(_("Too many connections to user, or no free slots.\n"));
         terminate_process(ucl); /* MSG: msg above */
-        return false;
+        return;
+    }
+    ucl->key_expected = true;
+    if (ucl->our_dir == DC_DIR_SEND) {
+        ucl->user_state = DC_USER_GET;
+    } else {
+        ucl->user_state = DC_USER_KEY;
+        download_next_file(ucl);
     }
-    return true;
 }
 
 static void
@@ -334,44 +670,73 @@ end_download(DCUserConnLocal *ucl, bool success, const char *reason_fmt, ...)
     va_start(args, reason_fmt);
     if (reason == NULL)
         reason = xvasprintf(reason_fmt, args);
-    res = msgq_put_sync(ucl->put_mq, MSGQ_INT, DC_MSG_DOWNLOAD_ENDED, MSGQ_BOOL, success, MSGQ_STR, reason, MSGQ_END);
+    flush_user_status(ucl);
+    res = msgq_put_sync(ucl->put_mq, MSGQ_INT, DC_MSG_DOWNLOAD_ENDED, MSGQ_BOOL, success, MSGQ_STR, reason,
+                        MSGQ_BLOB, ucl->roots, ucl->roots_size, MSGQ_END);
     if (res <= 0)
         fatal_error(ucl, res, true);
     free(reason);
     va_end(args);
 
+    free(ucl->roots);
+    ucl->roots = NULL;
+    ucl->roots_size = 0;
+    ucl->verify = false;
+    ucl->leaves = false;
+
     free(ucl->share_file/*DL*/);
     ucl->share_file/*DL*/ = NULL; /* if "user terminated" calls this function, then this is not necessary */
     free(ucl->local_file/*DL*/);
     ucl->local_file/*DL*/ = NULL; /* if "user terminated" calls this function, then this is not necessary */
 }
 
-/* This is called when the next file should be downloaded.
- * It will send $Get to the user.
- */
+static bool
+can_segment(DCUserConnLocal *ucl)
+{
+    return ucl->supports != NULL
+           && ptrv_find(ucl->supports, "ADCGet", (comparison_fn_t) strcasecmp) >= 0
+           && ptrv_find(ucl->supports, "TTHF", (comparison_fn_t) strcasecmp) >= 0;
+}
+
+/* True if the user advertised that it can send TTH leaves. */
+static bool
+can_send_leaves(DCUserConnLocal *ucl)
+{
+    return ucl->supports != NULL
+           && ptrv_find(ucl->supports, "ADCGet", (comparison_fn_t) strcasecmp) >= 0
+           && ptrv_find(ucl->supports, "TTHL", (comparison_fn_t) strcasecmp) >= 0;
+}
+
+/* Reply to DC_MSG_CHECK_DOWNLOAD. Send $Get or $ADCGET for the file. */
 static void
-download_next_file(DCUserConnLocal *ucl)
+next_file_received(DCUserConnLocal *ucl)
 {
+    int32_t id;
     int flag = 0;
     char *share_file;
     char *local_file, *conv_local_file;
     char *remote_file, *hub_remote_file;
+    char *tth;
     uint64_t resume_pos;
     uint64_t file_size;
+    uint64_t segment_start;
+    uint64_t segment_length;
+    int32_t idle_timeout;
     struct stat sb;
-    int res;
 
-    if (!ucl->user_running)
-        return;
-    res = msgq_put_sync(ucl->put_mq, MSGQ_INT, DC_MSG_CHECK_DOWNLOAD, MSGQ_END);
-    if (res <= 0) {
-        fatal_error(ucl, res, true);
-        return;
-    }
-    /* local_file is in filesystem charset */
-    res = msgq_get_sync(ucl->get_mq, MSGQ_STR, &local_file, MSGQ_STR, &share_file, MSGQ_INT64, &file_size, MSGQ_INT, &flag, MSGQ_END);
-    if (res <= 0) {
-        fatal_error(ucl, res, false);
+    /* local_file is in filesystem charset. If tth is not NULL, the
+     * file is downloaded in segments and we should get segment_length
+     * bytes from segment_start. If local_file is NULL and idle_timeout
+     * is not zero, main replies again when more files are queued. */
+    msgq_get(ucl->get_mq, MSGQ_INT32, &id, MSGQ_STR, &local_file, MSGQ_STR, &share_file, MSGQ_INT64, &file_size, MSGQ_INT, &flag,
+             MSGQ_STR, &tth, MSGQ_INT64, &segment_start, MSGQ_INT64, &segment_length, MSGQ_INT32, &idle_timeout, MSGQ_END);
+    if (local_file == NULL && idle_timeout > 0) {
+        flag_putf(DC_DF_CONNECTIONS, _("No more files to download, keeping connection for %d seconds.\n"), idle_timeout);
+        ucl->reply_handler = next_file_received;
+        ucl->user_state = DC_USER_IDLE;
+        ucl->idle_timeout = idle_timeout;
+        ucl->last_activity = reactor_now(ucl->reactor);
+        reactor_timer_set(ucl->idle_timer, ucl->idle_timeout * 1000);
         return;
     }
     if (local_file == NULL) {
@@ -415,6 +780,13 @@ download_next_file(DCUserConnLocal *ucl)
         unlink(local_file);
         ucl->local_exists = false;
         resume_pos = 0;
+    } else if (flag == DC_TF_LEAVES) {
+        ucl->local_exists = true;
+        resume_pos = 0;
+    } else if (tth != NULL) {
+        /* Other segments may be downloaded to the same file. */
+        ucl->local_exists = true;
+        resume_pos = segment_start;
     } else {
         if (lstat(local_file, &sb) != 0) {
             if (errno != ENOENT) {
@@ -438,6 +810,30 @@ download_next_file(DCUserConnLocal *ucl)
     }
     free(local_file);
 
+    ucl->user_state = DC_USER_FILE_LENGTH;
+    ucl->verify = (tth != NULL && flag != DC_TF_LEAVES);
+    ucl->leaves = (flag == DC_TF_LEAVES);
+    ucl->file_size = file_size;
+    ucl->final_pos = file_size;
+    ucl->file_pos = resume_pos;
+    ucl->transfer_pos = resume_pos;
+
+    if (ucl->leaves) {
+        /* The size of the leaves is known from $ADCSND. */
+        if (!user_putf(ucl, "$ADCGET tthl TTH/%s 0 -1|", tth))
+            end_download(ucl, false, _("communication error"));
+        free(tth);
+        return;
+    }
+    if (tth != NULL && can_segment(ucl)) {
+        ucl->final_pos = segment_start + segment_length;
+        if (!user_putf(ucl, "$ADCGET file TTH/%s %" PRIu64 " %" PRIu64 "|", tth, segment_start, segment_length))
+            end_download(ucl, false, _("communication error"));
+        free(tth);
+        return;
+    }
+    free(tth);
+
     remote_file = translate_local_to_remote(share_file);
     if (remote_file == NULL) {
         end_download(ucl, false, _("communication error"));
@@ -453,42 +849,40 @@ download_next_file(DCUserConnLocal *ucl)
     }
     free(remote_file);
     free(hub_remote_file);
-
-    ucl->user_state = DC_USER_FILE_LENGTH;
-    ucl->file_size = file_size;
-    ucl->file_pos = resume_pos;
-    ucl->transfer_pos = resume_pos;
 }
 
+/* This is called when the next file should be downloaded. Main is
+ * asked for it, and $Get is sent to the user when it has replied.
+ */
 static void
-open_download_file(DCUserConnLocal *ucl, uint64_t file_size)
+download_next_file(DCUserConnLocal *ucl)
 {
     int res;
-    char *conv_local_file, *conv_share_file;
 
-    if (ucl->file_size == UINT64_MAX) {
-        /* A file size of UINT64_MAX means that we did not know the size
-         * of the file in advance which is only true for file list files.
-         */
-        ucl->file_size = file_size;
-    } else if (file_size < ucl->file_size) {
-        end_download(ucl, false,
-                     _("remote file is smaller than local (expected %" PRIu64 ", got %" PRIu64 " %s)"),
-                     ucl->file_size, file_size, ngettext("byte", "bytes", file_size));
-        /* We're probably left in a weird state here. It is possible that
-         * some clients (at least DC++ 0.700) won't let us download more
-         * files from here.
-         */
-        download_next_file(ucl);
+    if (!ucl->user_running)
         return;
-    }
+    res = msgq_put_sync(ucl->put_mq, MSGQ_INT, DC_MSG_CHECK_DOWNLOAD, MSGQ_INT32, new_request(ucl, next_file_received),
+                        MSGQ_BOOL, can_segment(ucl), MSGQ_BOOL, can_send_leaves(ucl), MSGQ_END);
+    request_sent(ucl, res);
+}
+
+/* Open local_file for writing from file_pos. On failure the download
+ * is ended and false is returned.
+ */
+static bool
+open_download_fd(DCUserConnLocal *ucl)
+{
+    int flags;
+    char *conv_local_file;
 
     conv_local_file = main_to_fs_string(ucl->local_file);
 
+    /* Data written with splice is read back for hashing. */
+    flags = ucl->verify ? O_RDWR : O_WRONLY;
     if (ucl->local_exists) { /* Resuming */
-        ucl->transfer_fd/*DL*/ = open/*64*/(conv_local_file/*DL*/, O_CREAT|O_WRONLY, 0644);
+        ucl->transfer_fd/*DL*/ = open/*64*/(conv_local_file/*DL*/, O_CREAT|flags, 0644);
     } else {
-        ucl->transfer_fd/*DL*/ = open/*64*/(conv_local_file/*DL*/, O_CREAT|O_EXCL|O_WRONLY, 0644);
+        ucl->transfer_fd/*DL*/ = open/*64*/(conv_local_file/*DL*/, O_CREAT|O_EXCL|flags, 0644);
     }
 
     free(conv_local_file);
@@ -496,23 +890,57 @@ open_download_file(DCUserConnLocal *ucl, uint64_t file_size)
     if (ucl->transfer_fd/*DL*/ < 0) {
         warn(_("%s: Cannot open file for writing - %s\n"), quotearg(ucl->local_file/*DL*/), errstr);
         end_download(ucl, false, _("local error"));
-        download_next_file(ucl);
-        return;
+        return false;
     }
     if (ucl->file_pos != 0 && lseek(ucl->transfer_fd/*DL*/, ucl->file_pos, SEEK_SET) < 0) {
         warn(_("%s: Cannot seek to resume position - %s\n"), quotearg(ucl->local_file/*DL*/), errstr);
         end_download(ucl, false, _("local error"));
+        return false;
+    }
+#if defined(__linux__)
+    /* Reserve disk space for the rest of the file up front, so that large
+     * files are not fragmented. The file size is left as it is, because
+     * it is used as resume position if the download is interrupted.
+     */
+    if (ucl->final_pos > ucl->file_pos)
+        fallocate(ucl->transfer_fd/*DL*/, FALLOC_FL_KEEP_SIZE, ucl->file_pos, ucl->final_pos - ucl->file_pos); /* Ignore errors */
+#endif
+    ucl->writeback_pos = ucl->file_pos;
+    ucl->dropped_pos = ucl->file_pos;
+    return true;
+}
+
+/* Open local_file and start receiving data from file_pos to final_pos.
+ * If send is true, the remote user is waiting for $Send first. TTH
+ * leaves are received into memory instead.
+ */
+static void
+start_download(DCUserConnLocal *ucl, bool send)
+{
+    int res;
+    char *conv_share_file;
+
+    if (!ucl->leaves && !open_download_fd(ucl)) {
         download_next_file(ucl);
         return;
     }
+    start_bdp_sampling(ucl);
+    if (ucl->verify) {
+        /* Segments start at segment boundaries, so that the root of
+         * each of them is part of the Tiger tree of the file. */
+        tt_init(&ucl->tt, NULL, 0);
+        ucl->tt.leaf = ucl->tt_leaf;
+        ucl->tt_leaf[0] = '\0';
+        ucl->hash_pos = ucl->file_pos;
+    }
 
-    if (!user_putf(ucl, "$Send|")) {
+    if (send && !user_putf(ucl, "$Send|")) {
         end_download(ucl, false, _("communication error"));
         return;
     }
 
     conv_share_file = hub_to_main_string(ucl->share_file);
-    res = msgq_put_sync(ucl->put_mq, MSGQ_INT, DC_MSG_TRANSFER_START, MSGQ_STR, ucl->local_file, MSGQ_STR, conv_share_file, MSGQ_INT64, ucl->file_pos, MSGQ_INT64, ucl->file_size, MSGQ_END);
+    res = msgq_put_sync(ucl->put_mq, MSGQ_INT, DC_MSG_TRANSFER_START, MSGQ_STR, ucl->local_file, MSGQ_STR, conv_share_file, MSGQ_INT64, ucl->file_pos, MSGQ_INT64, ucl->final_pos, MSGQ_END);
     free(conv_share_file);
     if (res <= 0) {
         fatal_error(ucl, res, true);
@@ -520,13 +948,14 @@ open_download_file(DCUserConnLocal *ucl, uint64_t file_size)
         return;
     }
 
-    ucl->data_size/*DL*/ = ucl->file_size - ucl->file_pos;
+    ucl->data_size/*DL*/ = ucl->final_pos - ucl->file_pos;
     if (ucl->data_size/*DL*/ == 0) {
         end_download(ucl, true, _("no data to transfer"));
         download_next_file(ucl);
         return;
     }
     ucl->user_state = DC_USER_DATA_RECV;
+    ucl->zero_copy = !ucl->leaves;
 
     /* Places to go from here
      *   user_running becomes false
@@ -537,139 +966,266 @@ open_download_file(DCUserConnLocal *ucl, uint64_t file_size)
      */
 }
 
+/* Handle $FileLength, the reply to $Get. */
 static void
-end_upload(DCUserConnLocal *ucl, bool success, const char *reason)
+open_download_file(DCUserConnLocal *ucl, uint64_t file_size)
 {
-    int res;
-
+    if (ucl->file_size == UINT64_MAX) {
+        /* A file size of UINT64_MAX means that we did not know the size
+         * of the file in advance which is only true for file list files.
+         */
+        ucl->file_size = file_size;
+    } else if (file_size < ucl->file_size) {
+        end_download(ucl, false,
+                     _("remote file is smaller than local (expected %" PRIu64 ", got %" PRIu64 " %s)"),
+                     ucl->file_size, file_size, ngettext("byte", "bytes", file_size));
+        /* We're probably left in a weird state here. It is possible that
+         * some clients (at least DC++ 0.700) won't let us download more
+         * files from here.
+         */
+        download_next_file(ucl);
+        return;
+    }
+
+    ucl->final_pos = ucl->file_size;
+    start_download(ucl, true);
+}
+
+/* Start writeback of downloaded data in DOWNLOAD_WRITEBACK_SIZE windows,
+ * and drop the window before it from the page cache. Otherwise a large
+ * download would evict everything else from the cache. Nothing waits for
+ * the disk, since that would stall all other connections. Writeback of
+ * the previous window was started a window ago, so it has mostly
+ * completed, and pages that are still dirty are simply not dropped.
+ */
+static void
+download_writeback(DCUserConnLocal *ucl)
+{
+#if defined(__linux__)
+    if (ucl->file_pos - ucl->writeback_pos < DOWNLOAD_WRITEBACK_SIZE)
+        return;
+    /* Errors are ignored, these are only hints. */
+    sync_file_range(ucl->transfer_fd/*DL*/, ucl->writeback_pos, ucl->file_pos - ucl->writeback_pos, SYNC_FILE_RANGE_WRITE);
+    if (ucl->writeback_pos > ucl->dropped_pos) {
+        posix_fadvise(ucl->transfer_fd/*DL*/, ucl->dropped_pos, ucl->writeback_pos - ucl->dropped_pos, POSIX_FADV_DONTNEED);
+        ucl->dropped_pos = ucl->writeback_pos;
+    }
+    ucl->writeback_pos = ucl->file_pos;
+#endif
+}
+
+/* Add download data to the Tiger tree of the current segment. When a
+ * segment is complete, its root is saved for main to verify the file
+ * with once all segments are done. Hashing the data as it arrives saves
+ * reading the file again afterwards.
+ */
+static void
+download_hash(DCUserConnLocal *ucl, const char *buf, size_t len)
+{
+    while (len > 0) {
+        size_t size = MIN(len, BLOCKSIZE - ucl->tt.index);
+
+        memcpy(ucl->tt_leaf + 1 + ucl->tt.index, buf, size);
+        ucl->tt.index += size;
+        ucl->hash_pos += size;
+        buf += size;
+        len -= size;
+        if (ucl->tt.index == BLOCKSIZE) {
+            tt_block(&ucl->tt);
+            ucl->tt.index = 0;
+        }
+        if (ucl->hash_pos % DC_SEGMENT_SIZE == 0 || ucl->hash_pos == ucl->file_size) {
+            ucl->roots = xrealloc(ucl->roots, ucl->roots_size + DC_TTH_SIZE);
+            tt_digest(&ucl->tt, ucl->roots + ucl->roots_size);
+            ucl->roots_size += DC_TTH_SIZE;
+            tt_init(&ucl->tt, NULL, 0);
+            ucl->tt.leaf = ucl->tt_leaf;
+        }
+    }
+}
+
+/* Hash len bytes that were written to transfer_fd with splice. They
+ * were just written, so they are read back from the page cache.
+ */
+static bool
+download_hash_written(DCUserConnLocal *ucl, size_t len)
+{
+    if (ucl->hash_buf == NULL)
+        ucl->hash_buf = xmalloc(DEFAULT_RECVQ_SIZE);
+    while (len > 0) {
+        ssize_t res = pread(ucl->transfer_fd/*DL*/, ucl->hash_buf, MIN(len, DEFAULT_RECVQ_SIZE), ucl->hash_pos);
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res <= 0) {
+            warn_file_error(res, false, ucl->local_file/*DL*/);
+            return false;
+        }
+        download_hash(ucl, ucl->hash_buf, res);
+        len -= res;
+    }
+    return true;
+}
+
+/* Account for len bytes of download data that have been written to
+ * transfer_fd, and finish the download if it is complete.
+ */
+static void
+download_written(DCUserConnLocal *ucl, uint32_t len)
+{
+    ucl->file_pos += len;
+    ucl->transfer_pos += len;
+    ucl->data_size/*DL*/ -= len;
+    download_writeback(ucl);
+    adapt_socket_buffers(ucl);
+    send_user_status(ucl, ucl->file_pos);
+    if (ucl->file_pos == ucl->final_pos) {
+        end_download(ucl, true, _("transfer complete"));
+        download_next_file(ucl);
+    }
+}
+
+static void
+end_upload(DCUserConnLocal *ucl, bool success, const char *reason)
+{
+    int res;
+
     if (ucl->transfer_fd/*DL*/ >= 0) {
         close(ucl->transfer_fd/*DL*/);  /* Ignore errors */
         ucl->transfer_fd/*DL*/ = -1;
     }
+    if (ucl->list_buffer/*UL*/ != NULL) {
+        file_list_buffer_unref(ucl->list_buffer/*UL*/);
+        ucl->list_buffer/*UL*/ = NULL;
+    }
     free(ucl->share_file/*UL*/);
     ucl->share_file/*UL*/ = NULL;
     free(ucl->local_file/*UL*/);
     ucl->local_file/*UL*/ = NULL;
+    flush_user_status(ucl);
     res = msgq_put_sync(ucl->put_mq, MSGQ_INT, DC_MSG_UPLOAD_ENDED, MSGQ_BOOL, success, MSGQ_STR, reason, MSGQ_END);
     if (res <= 0)
         fatal_error(ucl, res, true);
 }
 
-static int
-open_upload_file_main(DCUserConnLocal *ucl, const char *str, uint64_t offset, DCAdcgetType type)
+/* Mark the file being uploaded with a read lock on its open file
+ * description, so that other uploads of it can tell, see
+ * upload_file_shared. The lock goes away when the file is closed.
+ */
+static void
+lock_upload_file(DCUserConnLocal *ucl)
 {
-    struct stat st;
-    bool may_upload;
-    char *share_file;
-    char *local_file, *conv_local_file;
-    int res;
+#if defined(F_OFD_SETLK)
+    struct flock lock;
 
-    if (strlen(str) > 0) {
-#if 0
-        if ( type == DC_ADCGET_TTHL) {
-            if (offset == 0)
-                offset = /*fsize*/ sizeof(uint64_t) + /*mtime*/sizeof(time_t)
-                                   + /*ctime*/ sizeof(time_t) + /*tth base32*/39;
-            else {
-                flag_putf(DC_DF_CONNECTIONS, _("%s: Incorrect offset in tthl request\n"), quotearg(ucl->local_file/*UL*/));
-                user_putf(ucl, "$Error Incorrect offset in tthl request|");
-                end_upload(ucl, false, _("Incorrect offset in tthl request"));
-
-                return -9;
-            }
-        }
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = F_RDLCK;
+    lock.l_whence = SEEK_SET;
+    fcntl(ucl->transfer_fd/*UL*/, F_OFD_SETLK, &lock); /* Ignore errors */
 #endif
-        if (type == DC_ADCGET_FILE)
-            share_file = translate_remote_to_local(str);
-        else
-            share_file = xstrdup(str);
+}
 
-        res = msgq_put_sync(ucl->put_mq, MSGQ_INT, DC_MSG_CHECK_UPLOAD, MSGQ_INT, type, MSGQ_STR, share_file, MSGQ_END);
-        if (res <= 0) {
-            free(share_file);
-            return -1;
-        }
-        res = msgq_get_sync(ucl->get_mq, MSGQ_BOOL, &may_upload, MSGQ_STR, &local_file, MSGQ_END);
-        if (res <= 0) {
-            free(share_file);
-            return -2;
-        }
-        if (!may_upload) {
-            user_putf(ucl, "$MaxedOut|");
-            free(share_file);
-            return -3;
-        }
+/* Return true if another upload of the same file has started since
+ * this one did. Its read lock conflicts with a write lock, whether it
+ * is in this process or another.
+ */
+static bool
+upload_file_shared(DCUserConnLocal *ucl)
+{
+#if defined(F_OFD_GETLK)
+    struct flock lock;
+
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = F_WRLCK;
+    lock.l_whence = SEEK_SET;
+    if (fcntl(ucl->transfer_fd/*UL*/, F_OFD_GETLK, &lock) == 0 && lock.l_type != F_UNLCK)
+        return true;
+#endif
+    return false;
+}
 
-        if (type == DC_ADCGET_FILE) {
-            ucl->share_file/*UL*/ = share_file;
-        } else {
-            free(share_file);
-            ucl->share_file = xstrdup(base_name(local_file));
-        }
-        ucl->local_file/*UL*/ = local_file;
-    } else {
-        ucl->local_file/*UL*/ = NULL;
-    }
+/* Open the file main has allowed us to upload, and answer the request
+ * for it. If local_file is NULL, it is not available. If list_generation
+ * is not zero, local_file is a file list that is sent from memory.
+ */
+static void
+open_upload_file(DCUserConnLocal *ucl, uint32_t list_generation)
+{
+    struct stat st;
+    char *conv_local_file = NULL;
+    uint64_t offset = ucl->upload_offset;
+    uint64_t file_size;
+    DCFileListBuffer *buffer = NULL;
 
     if (ucl->local_file/*UL*/ == NULL) {
         flag_putf(DC_DF_CONNECTIONS, _("%s: File Not Available\n"), quotearg(ucl->local_file/*UL*/));
         user_putf(ucl, "$Error File Not Available|");
         end_upload(ucl, false, _("no such shared file"));
-        return -4;
-    }
-
-    conv_local_file = main_to_fs_string(ucl->local_file);
-
-    if (stat(conv_local_file/*UL*/, &st) < 0) {
-        free (conv_local_file);
-        flag_putf(DC_DF_CONNECTIONS, _("%s: Cannot get file status - %s\n"), quotearg(ucl->local_file/*UL*/), errstr);
-        user_putf(ucl, "$Error File Not Available|");
-        end_upload(ucl, false, _("local error"));
-        return -5;
+        return;
     }
 
-#if 0
-    if ( type == DC_ADCGET_TTHL) {
-        if ( (offset + 2*TIGERSIZE > st.st_size)
-                || ( (st.st_size - offset) % TIGERSIZE)) {
+    /* A list published after this process was created is read from disk. */
+    if (list_generation != 0)
+        buffer = file_list_buffer_lookup(ucl->local_file);
+    if (buffer != NULL && buffer->generation == list_generation) {
+        file_size = buffer->size;
+    } else {
+        buffer = NULL;
+        conv_local_file = main_to_fs_string(ucl->local_file);
+        if (stat(conv_local_file/*UL*/, &st) < 0) {
             free (conv_local_file);
-            flag_putf(DC_DF_CONNECTIONS, _("%s: Resume offset %" PRIu64 " outside tthl file\n"), quotearg(ucl->local_file/*UL*/), offset);
+            flag_putf(DC_DF_CONNECTIONS, _("%s: Cannot get file status - %s\n"), quotearg(ucl->local_file/*UL*/), errstr);
             user_putf(ucl, "$Error File Not Available|");
-            end_upload(ucl, false, _("resume offset out of tthl range"));
-            return -10;
+            end_upload(ucl, false, _("local error"));
+            return;
         }
+        file_size = st.st_size;
     }
-#endif
 
-    if (offset > st.st_size) {
+    if (offset > file_size) {
         free (conv_local_file);
         flag_putf(DC_DF_CONNECTIONS, _("%s: Resume offset %" PRIu64 " outside file\n"), quotearg(ucl->local_file/*UL*/), offset);
         user_putf(ucl, "$Error Offset out of range|");
         end_upload(ucl, false, _("resume offset out of range"));
-        return -6;
+        return;
     }
-    ucl->transfer_fd/*UL*/ = open/*64*/(conv_local_file/*UL*/, O_RDONLY);
-    if (ucl->transfer_fd/*UL*/ < 0) {
+    if (buffer != NULL) {
+        flag_putf(DC_DF_CONNECTIONS, _("%s: Sending file list from memory\n"), quotearg(ucl->local_file/*UL*/));
+        buffer->refcount++;
+        ucl->list_buffer/*UL*/ = buffer;
+    } else {
+        ucl->transfer_fd/*UL*/ = open/*64*/(conv_local_file/*UL*/, O_RDONLY);
+        if (ucl->transfer_fd/*UL*/ < 0) {
+            free (conv_local_file);
+            flag_putf(DC_DF_CONNECTIONS, _("%s: Cannot open file for reading - %s\n"), quotearg(ucl->local_file/*UL*/), errstr);
+            user_putf(ucl, "$Error File Not Available|");
+            end_upload(ucl, false, _("local error"));
+            return;
+        }
         free (conv_local_file);
-        flag_putf(DC_DF_CONNECTIONS, _("%s: Cannot open file for reading - %s\n"), quotearg(ucl->local_file/*UL*/), errstr);
-        user_putf(ucl, "$Error File Not Available|");
-        end_upload(ucl, false, _("local error"));
-        return -7;
-    }
-    free (conv_local_file);
-    if (offset != 0 && lseek/*64*/(ucl->transfer_fd/*UL*/, offset, SEEK_SET) < 0) {
-        flag_putf(DC_DF_CONNECTIONS, _("%s: Cannot seek in file - %s\n"), quotearg(ucl->local_file/*UL*/), errstr);
-        user_putf(ucl, "$Error File Not Available|");
-        end_upload(ucl, false, _("local error"));
-        return -8;
+        if (offset != 0 && lseek/*64*/(ucl->transfer_fd/*UL*/, offset, SEEK_SET) < 0) {
+            flag_putf(DC_DF_CONNECTIONS, _("%s: Cannot seek in file - %s\n"), quotearg(ucl->local_file/*UL*/), errstr);
+            user_putf(ucl, "$Error File Not Available|");
+            end_upload(ucl, false, _("local error"));
+            return;
+        }
     }
 
+#if defined(__linux__)
+    if (ucl->transfer_fd/*UL*/ >= 0) {
+        posix_fadvise(ucl->transfer_fd/*UL*/, offset, 0, POSIX_FADV_SEQUENTIAL); /* Ignore errors */
+        lock_upload_file(ucl);
+    }
+#endif
     ucl->file_pos = offset;
     ucl->transfer_pos = offset;
+    ucl->readahead_pos = offset;
+    ucl->dropped_pos = offset;
     ucl->user_state = DC_USER_SEND_GET;
-    ucl->file_size = st.st_size;
-
-    return 0;
+    ucl->file_size = file_size;
+    if (ucl->upload_length == UINT64_MAX || offset + ucl->upload_length >= ucl->file_size)
+        ucl->final_pos = ucl->file_size;
+    else
+        ucl->final_pos = offset + ucl->upload_length;
 
     /* Places to go from here:
      *   user_running becomes false
@@ -682,46 +1238,84 @@ open_upload_file_main(DCUserConnLocal *ucl, const char *str, uint64_t offset, DC
      *     Will issue DC_MSG_UPLOAD_ENDED prior to setting state
      *     to DC_USER_GET.
      */
+    switch (ucl->upload_request) {
+    case DC_UPLOAD_GET:
+        if (!user_putf(ucl, "$FileLength %" PRIu64 "|", ucl->file_size))
+            end_upload(ucl, false, _("communication error"));
+        break;
+    case DC_UPLOAD_UGETBLOCK:
+        if (!user_putf(ucl, "$Sending %" PRIu64 "|", ucl->final_pos - ucl->file_pos)) {
+            end_upload(ucl, false, _("communication error"));
+            return;
+        }
+        upload_file(ucl);
+        break;
+    case DC_UPLOAD_ADCGET:
+        if (!user_putf(ucl, "$ADCSND %s %" PRIu64 " %" PRIu64 "|", ucl->upload_id,
+                       ucl->transfer_pos, ucl->final_pos - ucl->transfer_pos)) {
+            end_upload(ucl, false, _("communication error"));
+            return;
+        }
+        upload_file(ucl);
+        break;
+    }
 }
 
+/* Reply to DC_MSG_CHECK_UPLOAD. */
 static void
-open_upload_file(DCUserConnLocal *ucl, const char *str, uint64_t offset)
+upload_checked(DCUserConnLocal *ucl)
 {
-    if ( open_upload_file_main(ucl, str, offset, DC_ADCGET_FILE) < 0 )
-        return;
-
-    ucl->final_pos = ucl->file_size;
-
-    if (!user_putf(ucl, "$FileLength %" PRIu64 "|", ucl->file_size)) {
-        end_upload(ucl, false, _("communication error"));
+    int32_t id;
+    bool may_upload;
+    char *local_file;
+    uint32_t list_generation;
+
+    msgq_get(ucl->get_mq, MSGQ_INT32, &id, MSGQ_BOOL, &may_upload, MSGQ_STR, &local_file, MSGQ_INT32, &list_generation,
+             MSGQ_BOOL, &ucl->hot_file/*UL*/, MSGQ_END);
+    if (!may_upload) {
+        user_putf(ucl, "$MaxedOut|");
+        free(ucl->share_file/*UL*/);
+        ucl->share_file/*UL*/ = NULL;
         return;
     }
-
+    if (ucl->upload_type != DC_ADCGET_FILE && local_file != NULL) {
+        free(ucl->share_file/*UL*/);
+        ucl->share_file/*UL*/ = xstrdup(base_name(local_file));
+    }
+    ucl->local_file/*UL*/ = local_file;
+    open_upload_file(ucl, list_generation);
 }
 
-#if defined(HAVE_LIBXML2)
-
+/* Ask main if str may be uploaded, in reply to request. length is
+ * UINT64_MAX for the rest of the file.
+ */
 static void
-open_upload_file_block(DCUserConnLocal *ucl, const char *str, uint64_t offset, uint64_t numbytes)
+request_upload(DCUserConnLocal *ucl, DCUploadRequest request, DCAdcgetType type, const char *str, uint64_t offset, uint64_t length)
 {
+    int res;
 
-    if ( open_upload_file_main(ucl, str, offset, DC_ADCGET_FILE) < 0)
-        return;
-
-    if ((numbytes == (uint64_t)-1) ||
-            (offset + numbytes >= ucl->file_size))
-        ucl->final_pos = ucl->file_size;
-    else
-        ucl->final_pos = offset + numbytes;
-
-    if (!user_putf(ucl, "$Sending %" PRIu64 "|", ucl->final_pos - ucl->file_pos)) {
-        end_upload(ucl, false, _("communication error"));
+    ucl->upload_request = request;
+    ucl->upload_type = type;
+    ucl->upload_offset = offset;
+    ucl->upload_length = length;
+    ucl->hot_file/*UL*/ = false;
+    if (strlen(str) == 0) {
+        ucl->local_file/*UL*/ = NULL;
+        open_upload_file(ucl, 0);
         return;
     }
 
-    upload_file(ucl);
+    free(ucl->share_file/*UL*/);
+    if (type == DC_ADCGET_FILE)
+        ucl->share_file/*UL*/ = translate_remote_to_local(str);
+    else
+        ucl->share_file/*UL*/ = xstrdup(str);
+    res = msgq_put_sync(ucl->put_mq, MSGQ_INT, DC_MSG_CHECK_UPLOAD, MSGQ_INT32, new_request(ucl, upload_checked),
+                        MSGQ_INT, type, MSGQ_STR, ucl->share_file/*UL*/, MSGQ_END);
+    request_sent(ucl, res);
 }
 
+#if defined(HAVE_LIBXML2)
 
 static void
 open_upload_file_adcget(DCUserConnLocal *ucl, const char *type, const char *str, uint64_t offset, uint64_t numbytes)
@@ -773,25 +1367,10 @@ open_upload_file_adcget(DCUserConnLocal *ucl, const char *type, const char *str,
         flag_putf(DC_DF_DEBUG, _("User requests %" PRIu64 " bytes of <%s> starting from %" PRIu64 "\n"), numbytes, filename, offset);
     }
 
-    if (open_upload_file_main(ucl, filename, offset, t) < 0) {
-        free(filename);
-        return;
-    }
-
+    free(ucl->upload_id);
+    ucl->upload_id = xasprintf("%s %s", type, str);
+    request_upload(ucl, DC_UPLOAD_ADCGET, t, filename, offset, numbytes);
     free(filename);
-
-    if ((numbytes == (uint64_t)-1) || (offset + numbytes >= ucl->file_size))
-        ucl->final_pos = ucl->file_size;
-    else
-        ucl->final_pos = offset + numbytes;
-
-    if (!user_putf(ucl, "$ADCSND %s %s %" PRIu64 " %" PRIu64 "|", type, str,
-                   ucl->transfer_pos, ucl->final_pos - ucl->transfer_pos)) {
-        end_upload(ucl, false, _("communication error"));
-        return;
-    }
-
-    upload_file(ucl);
 }
 
 #endif
@@ -813,9 +1392,89 @@ upload_file(DCUserConnLocal *ucl)
         /*end_upload(ucl, true);*/ /* Just won't go through */
         return;
     }
-    FD_SET(ucl->user_socket, &ucl->user_write_fds);
-    assert(ucl->user_sendq->cur == 0);
+    /* The reply to the request may still be in user_sendq. It is sent
+     * before the file data goes out without copying. */
+    reactor_watch_write(ucl->reactor, ucl->user_socket, (ReactorCallback) user_socket_writable, ucl);
     ucl->user_state = DC_USER_DATA_SEND;
+    ucl->zero_copy = true;
+    start_bdp_sampling(ucl);
+}
+
+/* Ask the kernel to read the next UPLOAD_READAHEAD_SIZE bytes of the
+ * upload ahead of the sending position, and drop what has been sent
+ * from the page cache unless others are likely to upload the same file.
+ * A file that was cold when the upload started becomes hot as soon as
+ * another upload of it begins.
+ */
+static void
+upload_readahead(DCUserConnLocal *ucl)
+{
+#if defined(__linux__)
+    uint64_t end;
+
+    /* Errors are ignored, these are only hints. */
+    if (ucl->readahead_pos < ucl->final_pos && ucl->readahead_pos < ucl->file_pos + UPLOAD_READAHEAD_SIZE/2) {
+        end = MIN(ucl->file_pos + UPLOAD_READAHEAD_SIZE, ucl->final_pos);
+        posix_fadvise(ucl->transfer_fd/*UL*/, ucl->readahead_pos, end - ucl->readahead_pos, POSIX_FADV_WILLNEED);
+        ucl->readahead_pos = end;
+    }
+    if (!ucl->hot_file/*UL*/ && ucl->file_pos - ucl->dropped_pos >= UPLOAD_READAHEAD_SIZE
+            && !(ucl->hot_file/*UL*/ = upload_file_shared(ucl))) {
+        posix_fadvise(ucl->transfer_fd/*UL*/, ucl->dropped_pos, ucl->file_pos - ucl->dropped_pos, POSIX_FADV_DONTNEED);
+        ucl->dropped_pos = ucl->file_pos;
+    }
+#endif
+}
+
+/* Send the next part of an upload straight from transfer_fd to the
+ * socket, without copying it through user_sendq. A file list in memory
+ * is sent straight from its buffer. This returns false if sendfile
+ * cannot be used for this upload, in which case zero_copy is cleared
+ * and the caller should fall back to buffered sending.
+ */
+static bool
+upload_zero_copy(DCUserConnLocal *ucl)
+{
+    size_t block;
+    ssize_t res;
+
+    block = transfer_allowance(ucl, MIN(ZERO_COPY_BLOCK_SIZE, ucl->final_pos - ucl->file_pos));
+    if (block == 0)
+        return true;
+    if (ucl->list_buffer/*UL*/ != NULL) {
+        res = send(ucl->user_socket, (char *) ucl->list_buffer->data + ucl->file_pos, block, 0);
+    } else {
+#if defined(__linux__)
+        res = sendfile(ucl->user_socket, ucl->transfer_fd/*UL*/, NULL, block);
+#else
+        ucl->zero_copy = false;
+        return false;
+#endif
+    }
+    if (res < 0 && (errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+        ucl->zero_copy = false;
+        return false;
+    }
+    if (res < 0 && (errno == EAGAIN || errno == EINTR))
+        return true;
+    if (res == 0) {
+        /* The file was truncated while we were sending it. */
+        warn_file_error(res, false, ucl->local_file/*UL*/);
+        end_upload(ucl, false, _("local error"));
+        terminate_process(ucl); /* MSG: local error */
+        return true;
+    }
+    if (res < 0) {
+        warn_socket_error(res, true, _("user"));
+        end_upload(ucl, false, _("communication error"));
+        terminate_process(ucl); /* MSG: communication error */
+        return true;
+    }
+    transfer_consumed(ucl, res);
+    ucl->file_pos += res;
+    ucl->transfer_pos += res;
+    send_user_status(ucl, ucl->file_pos);
+    return true;
 }
 
 /* Handle commands and data sent by the hub.
@@ -823,7 +1482,13 @@ upload_file(DCUserConnLocal *ucl)
 static void
 user_handle_command(DCUserConnLocal *ucl, char *buf, uint32_t len)
 {
-    if (ucl->user_state == DC_USER_DATA_RECV) {
+    if (ucl->user_state == DC_USER_DATA_RECV && ucl->leaves) {
+        ucl->roots = xrealloc(ucl->roots, ucl->roots_size + len);
+        memcpy(ucl->roots + ucl->roots_size, buf, len);
+        ucl->roots_size += len;
+        download_written(ucl, len);
+    }
+    else if (ucl->user_state == DC_USER_DATA_RECV) {
         ssize_t res;
 
         res = full_write(ucl->transfer_fd/*DL*/, buf, len);
@@ -834,54 +1499,23 @@ user_handle_command(DCUserConnLocal *ucl, char *buf, uint32_t len)
             terminate_process(ucl); /* MSG: local error */
             return;
         }
-        ucl->file_pos += len;
-        ucl->transfer_pos += len;
-        ucl->data_size/*DL*/ -= len;
-        send_user_status(ucl, ucl->file_pos);
-        if (ucl->file_pos == ucl->file_size) {
-            end_download(ucl, true, _("transfer complete"));
-            download_next_file(ucl);
-            return;
-        }
+        if (ucl->verify)
+            download_hash(ucl, buf, len);
+        download_written(ucl, len);
     }
     else if (len >= 8 && strncmp(buf, "$MyNick ", 8) == 0) {
-        char *local_nick;
+        int res;
 
         if (!check_state(ucl, buf, DC_USER_MYNICK))
             return;
-        local_nick = hub_to_main_string(buf+8);
-
-        if (!nick_validate(ucl, local_nick)) {
-            free(local_nick);
-            return;
-        }
-
-        ucl->user_nick = local_nick;
-
-        if (!ucl->we_connected) {
-            char *our_nick;
-            char *hub_my_nick;
-
-            if (!get_our_nick(ucl, &our_nick))
-                return;
-
-            hub_my_nick = main_to_hub_string(our_nick);
-
-            if (!user_putf(ucl, "$MyNick %s|", hub_my_nick)) {
-                free(our_nick);
-                free(hub_my_nick);
-                return;
-            }
-            free(our_nick);
-            free(hub_my_nick);
-            if (!user_putf(ucl, "$Lock %s Pk=%s|", LOCK_STRING, LOCK_PK_STRING))
-                return;
-        }
-        ucl->user_state = DC_USER_LOCK;
+        ucl->user_nick = hub_to_main_string(buf+8);
+        res = msgq_put_sync(ucl->put_mq, MSGQ_INT, DC_MSG_VALIDATE_NICK, MSGQ_INT32, new_request(ucl, nick_validated),
+                            MSGQ_STR, ucl->user_nick, MSGQ_END);
+        request_sent(ucl, res);
     }
     else if (len >= 6 && strncmp(buf, "$Lock ", 6) == 0) {
         char *key;
-        bool download;
+        bool sent;
 
         if (!check_state(ucl, buf, DC_USER_LOCK))
             return;
@@ -891,27 +1525,10 @@ user_handle_command(DCUserConnLocal *ucl, char *buf, uint32_t len)
             key = buf+len;
         }
         key = decode_lock(buf+6, key-buf-6, DC_CLIENT_BASE_KEY);
-        if (!wants_to_download(ucl, &download)) {
-            free(key);
-            return;
-        }
-#if defined(HAVE_LIBXML2)
-        /*if (!user_putf(ucl, "$Supports XmlBZList|")) {*/
-        /*if (!user_putf(ucl, "$Supports XmlBZList ADCGet TTHF TTHL|")) {*/
-        if (!user_putf(ucl, "$Supports MiniSlots XmlBZList ADCGet TTHF|")) {
-            free(key);
-            return;
-        }
-#endif
-        if (!user_putf(ucl, "$Direction %s %d|", download ? "Download" : "Upload", ucl->dir_rand)) {
-            free(key);
-            return;
-        }
-        if (!user_putf(ucl, "$Key %s|", key)) {
-            free(key);
-            return;
-        }
+        sent = send_direction_and_key(ucl, key);
         free(key);
+        if (!sent)
+            return;
         ucl->user_state = DC_USER_SUPPORTS;
     }
     else if (len >= 10 && strncmp(buf, "$Supports ", 10) == 0) {
@@ -932,9 +1549,9 @@ user_handle_command(DCUserConnLocal *ucl, char *buf, uint32_t len)
     }
     else if (len >= 11 && strncmp(buf, "$Direction ", 11) == 0) {
         char *token;
-        uint16_t remote_rand;
         bool they_download;
-        bool we_download;
+        uint16_t remote_rand;
+        int res;
 
         if (!check_state(ucl, buf, DC_USER_DIRECTION))
             return;
@@ -967,11 +1584,8 @@ user_handle_command(DCUserConnLocal *ucl, char *buf, uint32_t len)
             return;
         }
 
-        if (!wants_to_download(ucl, &we_download))
-            return;
-
         if (they_download) { /* Remote wants to download. Do we want to download too? */
-            if (we_download) {
+            if (ucl->we_download) {
                 if (remote_rand >= ucl->dir_rand) { /* We lost. Let them download. */
                     ucl->our_dir = DC_DIR_SEND;
                 } else { /* We won. */
@@ -982,31 +1596,30 @@ user_handle_command(DCUserConnLocal *ucl, char *buf, uint32_t len)
                 ucl->our_dir = DC_DIR_SEND;
             }
         } else { /* Remote wants to upload. Do we want to upload too? */
-            if (!we_download) {
+            if (!ucl->we_download) {
                 warn(_("User does not want to download, nor do we.\n"));
                 terminate_process(ucl); /* MSG: no one wants to exchange files */
                 return;
             }
             ucl->our_dir = DC_DIR_RECEIVE;
         }
-        if (!direction_validate(ucl, ucl->our_dir))
-            return;
-        ucl->user_state = DC_USER_KEY;
+        res = msgq_put_sync(ucl->put_mq, MSGQ_INT, DC_MSG_VALIDATE_DIR, MSGQ_INT32, new_request(ucl, direction_validated),
+                            MSGQ_INT, ucl->our_dir, MSGQ_END);
+        request_sent(ucl, res);
     }
     else if (len >= 5 && strncmp(buf, "$Key ", 5) == 0) {
         char *key;
 
-        if (!check_state(ucl, buf, DC_USER_KEY))
+        if (!ucl->key_expected) {
+            warn(_("Received %s message in wrong state.\n"), strtok(buf, " "));
+            terminate_process(ucl); /* MSG: protocol error */
             return;
+        }
+        ucl->key_expected = false;
         key = decode_lock(LOCK_STRING, LOCK_STRING_LEN, DC_CLIENT_BASE_KEY);
         if (strcmp(buf+5, key) != 0)
             warn(_("Invalid $Key message: Incorrect key, ignoring\n"));
         free(key);
-        if (ucl->our_dir == DC_DIR_SEND) {
-            ucl->user_state = DC_USER_GET;
-        } else {
-            download_next_file(ucl);
-        }
     }
     else if (len >= 5 && strncmp(buf, "$Get ", 5) == 0) {
         char *token;
@@ -1058,7 +1671,7 @@ user_handle_command(DCUserConnLocal *ucl, char *buf, uint32_t len)
             if (s == NULL)
                 s = iconv_alloc(from_utf8, buf+5);
             */
-            open_upload_file(ucl, s, offset); /* Changes state */
+            request_upload(ucl, DC_UPLOAD_GET, DC_ADCGET_FILE, s, offset, UINT64_MAX); /* Changes state */
             free(s);
         }
     }
@@ -1080,6 +1693,36 @@ user_handle_command(DCUserConnLocal *ucl, char *buf, uint32_t len)
         }
         open_download_file(ucl, file_size); /* Will change state */
     }
+    else if (len >= 8 && strncmp(buf, "$ADCSND ", 8) == 0) {
+        char *args = buf+8;
+        char *type;
+        char *token;
+        uint64_t offset;
+        uint64_t length;
+
+        if (!check_state(ucl, buf, DC_USER_FILE_LENGTH))
+            return;
+        type = strsep(&args, " ");
+        strsep(&args, " "); /* identifier, we know what we asked for */
+        token = strsep(&args, " ");
+        if (token == NULL || strcmp(type, ucl->leaves ? "tthl" : "file") != 0 || !parse_uint64(token, &offset)
+                || (token = strsep(&args, " ")) == NULL || !parse_uint64(token, &length)) {
+            end_download(ucl, false, _("protocol error: invalid $ADCSND message"));
+            terminate_process(ucl); /* MSG: protocol error */
+            return;
+        }
+        if (ucl->leaves && offset == 0 && length <= MAX_LEAVES_SIZE)
+            ucl->final_pos = length;
+        /* The data follows immediately, so we cannot recover from getting
+         * something else than we asked for. */
+        if (offset != ucl->file_pos || length != ucl->final_pos - ucl->file_pos) {
+            end_download(ucl, false, _("protocol error: remote sends %" PRIu64 " %s from %" PRIu64),
+                         length, ngettext("byte", "bytes", length), offset);
+            terminate_process(ucl); /* MSG: protocol error */
+            return;
+        }
+        start_download(ucl, false); /* Will change state */
+    }
     else if (len >= 7 && strncmp(buf, "$Error ", 7) == 0) {
         if (ucl->user_state == DC_USER_FILE_LENGTH) {
             if (strcmp(buf+7, "File Not Available") == 0) {
@@ -1120,7 +1763,7 @@ user_handle_command(DCUserConnLocal *ucl, char *buf, uint32_t len)
 
         flag_putf(DC_DF_DEBUG, _("User requests %" PRIu64 " bytes of <%s> starting from %" PRIu64 "\n"), block_size, p_filename, offset);
 
-        open_upload_file_block(ucl, p_filename, offset, block_size);
+        request_upload(ucl, DC_UPLOAD_UGETBLOCK, DC_ADCGET_FILE, p_filename, offset, block_size);
 
         free(p_filename);
 
@@ -1190,21 +1833,132 @@ user_handle_command(DCUserConnLocal *ucl, char *buf, uint32_t len)
 }
 
 
-static void
-user_input_available(DCUserConnLocal *ucl)
+/* Move the next part of a download straight from the socket to
+ * transfer_fd through a pipe, without copying it through user_recvq.
+ * This may only be called when user_recvq is empty. It returns false
+ * if splice cannot be used, in which case zero_copy is cleared and the
+ * caller should fall back to reading into user_recvq.
+ */
+static bool
+download_zero_copy(DCUserConnLocal *ucl)
 {
-    int start = 0;
-    int c;
-    int res;
-
-    alarm(0); /* cannot fail */
-    res = byteq_read(ucl->user_recvq, ucl->user_socket);
+#if defined(__linux__)
+    size_t block;
+    ssize_t len;
+    ssize_t res;
+
+    block = transfer_allowance(ucl, MIN(ZERO_COPY_BLOCK_SIZE, ucl->data_size/*DL*/));
+    if (block == 0)
+        return true;
+    if (ucl->splice_pipe[0] < 0) {
+        if (pipe(ucl->splice_pipe) < 0) {
+            ucl->zero_copy = false;
+            return false;
+        }
+        fcntl(ucl->splice_pipe[1], F_SETPIPE_SZ, ZERO_COPY_BLOCK_SIZE); /* Ignore errors */
+    }
+
+    len = splice(ucl->user_socket, NULL, ucl->splice_pipe[1], NULL, block, SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+    if (len < 0 && errno == EINVAL) {
+        ucl->zero_copy = false;
+        return false;
+    }
+    if (len < 0 && (errno == EAGAIN || errno == EINTR))
+        return true;
+    if (len <= 0) {
+        warn_socket_error(len, false, _("user"));
+        terminate_process(ucl); /* MSG: socket error above */
+        return true;
+    }
+    transfer_consumed(ucl, len);
+
+    while (len > 0 && ucl->user_running) {
+        res = splice(ucl->splice_pipe[0], NULL, ucl->transfer_fd/*DL*/, NULL, len, SPLICE_F_MOVE);
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res < 0 && errno == EINVAL) {
+            /* The file cannot be written with splice. Handle what is
+             * already in the pipe the usual way, and stop using splice. */
+            ucl->zero_copy = false;
+            res = byteq_full_read_upto(ucl->user_recvq, ucl->splice_pipe[0], len);
+            if (res < len) {
+                warn(_("Cannot read from pipe - %s\n"), errstr);
+                end_download(ucl, false, _("local error"));
+                terminate_process(ucl); /* MSG: local error */
+                return true;
+            }
+            user_handle_command(ucl, ucl->user_recvq->buf, len);
+            byteq_remove(ucl->user_recvq, len);
+            return true;
+        }
+        if (res <= 0) {
+            /* We cannot expect to synchronize with remote at this point, so shut down. */
+            warn_file_error(res, true, ucl->share_file/*DL*/);
+            end_download(ucl, false, _("local error"));
+            terminate_process(ucl); /* MSG: local error */
+            return true;
+        }
+        if (ucl->verify && !download_hash_written(ucl, res)) {
+            end_download(ucl, false, _("local error"));
+            terminate_process(ucl); /* MSG: local error */
+            return true;
+        }
+        len -= res;
+        download_written(ucl, res);
+    }
+    return true;
+#else
+    ucl->zero_copy = false;
+    return false;
+#endif
+}
+
+static void
+user_input_available(DCUserConnLocal *ucl)
+{
+    int res;
+
+    ucl->last_activity = reactor_now(ucl->reactor);
+    /* When idle, the socket is still read to notice if the user closes
+     * the connection. */
+    if (ucl->reply_handler != NULL && ucl->user_state != DC_USER_IDLE) {
+        /* Leave the data in the socket until main has replied. */
+        reactor_unwatch_read(ucl->reactor, ucl->user_socket);
+        ucl->input_paused = true;
+        return;
+    }
+    if (ucl->user_state == DC_USER_DATA_RECV && ucl->zero_copy
+            && ucl->user_recvq->cur == 0 && download_zero_copy(ucl))
+        return;
+    if (ucl->user_state == DC_USER_DATA_RECV) {
+        size_t block = transfer_allowance(ucl, DEFAULT_RECVQ_SIZE);
+
+        if (block == 0)
+            return;
+        res = byteq_read_upto(ucl->user_recvq, ucl->user_socket, ucl->user_recvq->cur + block);
+    } else {
+        res = byteq_read(ucl->user_recvq, ucl->user_socket);
+    }
     if (res == 0 || (res < 0 && errno != EAGAIN && errno != EINTR)) {
         warn_socket_error(res, false, _("user"));
         terminate_process(ucl); /* MSG: socket error above */
         return;
     }
+    if (res > 0 && ucl->user_state == DC_USER_DATA_RECV)
+        transfer_consumed(ucl, res);
+    handle_user_input(ucl);
+}
+
+/* Handle the commands and data in user_recvq, until a command needs a
+ * reply from main. What we send in response is written in one go.
+ */
+static void
+handle_user_input(DCUserConnLocal *ucl)
+{
+    int start = 0;
+    int c;
 
+    user_cork(ucl);
     for (c = ucl->user_recvq_last; c < ucl->user_recvq->cur; c++) {
         if (ucl->data_size/*DL*/ > 0) {
             uint32_t size;
@@ -1213,7 +1967,7 @@ user_input_available(DCUserConnLocal *ucl)
             size = MIN(ucl->data_size/*DL*/, ucl->user_recvq->cur - start);
             user_handle_command(ucl, ucl->user_recvq->buf + start, size);
             start += size;
-            if (!ucl->user_running)
+            if (!ucl->user_running || ucl->reply_handler != NULL)
                 break;
             c += size - 1;
         }
@@ -1224,7 +1978,7 @@ user_input_available(DCUserConnLocal *ucl)
             ucl->user_recvq->buf[c] = '\0'; /* Just to be on the safe side... */
             user_handle_command(ucl, ucl->user_recvq->buf + start, c - start);
             start = c+1;
-            if (!ucl->user_running)
+            if (!ucl->user_running || ucl->reply_handler != NULL)
                 break;
         }
     }
@@ -1232,14 +1986,15 @@ user_input_available(DCUserConnLocal *ucl)
     if (start != 0)
         byteq_remove(ucl->user_recvq, start);
 
-    ucl->user_recvq_last = ucl->user_recvq->cur;
-    alarm(USER_CONN_IDLE_TIMEOUT); /* cannot fail */
+    /* What is left is scanned again once the reply has been handled. */
+    ucl->user_recvq_last = (ucl->reply_handler != NULL ? 0 : ucl->user_recvq->cur);
+    user_uncork(ucl);
 }
 
 static void
 user_now_writable(DCUserConnLocal *ucl)
 {
-    alarm(0); /* cannot fail */
+    ucl->last_activity = reactor_now(ucl->reactor);
     if (ucl->user_state == DC_USER_CONNECT) {
         int error;
         socklen_t size = sizeof(error);
@@ -1255,27 +2010,15 @@ user_now_writable(DCUserConnLocal *ucl)
             return;
         }
 
-        FD_CLR(ucl->user_socket, &ucl->user_write_fds);
-        FD_SET(ucl->user_socket, &ucl->user_read_fds);
+        reactor_unwatch_write(ucl->reactor, ucl->user_socket);
+        reactor_watch_read(ucl->reactor, ucl->user_socket, (ReactorCallback) user_socket_readable, ucl);
         ucl->user_state = DC_USER_MYNICK;
 
         if (ucl->we_connected) {
-            char *our_nick;
-            char *hub_my_nick;
-
-            if (!get_our_nick(ucl, &our_nick))
-                return;
-            hub_my_nick = main_to_hub_string(our_nick);
             flag_putf(DC_DF_CONNECTIONS, _("Connected to user.\n"));/*XXX: move where!?*/
-            if (!user_putf(ucl, "$MyNick %s|", hub_my_nick)) {
-                free(our_nick);
-                free(hub_my_nick);
-                return;
-            }
-            free(our_nick);
-            free(hub_my_nick);
-            if (!user_putf(ucl, "$Lock %s Pk=%s|", LOCK_STRING, LOCK_PK_STRING))
-                return;
+            user_cork(ucl);
+            send_my_nick_and_lock(ucl);
+            user_uncork(ucl);
         }
     }
     else if (ucl->user_state == DC_USER_DATA_SEND) {
@@ -1283,31 +2026,62 @@ user_now_writable(DCUserConnLocal *ucl)
         ssize_t res;
 
         assert(ucl->file_size != 0);
-        block = MIN(DEFAULT_SENDQ_SIZE, ucl->final_pos - ucl->file_pos);
-        if (block > 0 && ucl->user_sendq->cur == 0) { //if (ucl->user_sendq->cur < ucl->user_sendq->max) {
-            res = byteq_full_read_upto(ucl->user_sendq, ucl->transfer_fd/*UL*/, block);
-            if (res < block) {
-                warn_file_error(res, false, ucl->local_file/*UL*/);
-                end_upload(ucl, false, _("local error"));
-                terminate_process(ucl); /* MSG: local error */
+        if (ucl->list_buffer/*UL*/ == NULL)
+            upload_readahead(ucl);
+        if (ucl->zero_copy && ucl->user_sendq->cur > 0) {
+            /* Only the reply to the request is queued. The file data
+             * follows it once the queue is empty, so it is never read
+             * into the queue behind the reply. */
+            res = byteq_write(ucl->user_sendq, ucl->user_socket);
+            if (res == 0 || (res < 0 && errno != EAGAIN && errno != EINTR)) {
+                warn_socket_error(res, true, _("user"));
+                end_upload(ucl, false, _("communication error"));
+                terminate_process(ucl); /* MSG: communication error */
                 return;
             }
-            ucl->file_pos += res;
-        }
+        } else if (ucl->zero_copy && upload_zero_copy(ucl)) {
+            if (!ucl->user_running)
+                return;
+        } else {
+            /* Refill when half of the queue has been sent, so that the
+             * socket buffer does not run dry while we read the file. */
+            block = 0;
+            if (ucl->user_sendq->cur < ucl->sendq_target / 2)
+                block = MIN(ucl->sendq_target - ucl->user_sendq->cur, ucl->final_pos - ucl->file_pos);
+            if (block > 0 && ucl->list_buffer/*UL*/ != NULL) {
+                byteq_append(ucl->user_sendq, (char *) ucl->list_buffer->data + ucl->file_pos, block);
+                ucl->file_pos += block;
+            } else if (block > 0) {
+                res = byteq_full_read_upto(ucl->user_sendq, ucl->transfer_fd/*UL*/, ucl->user_sendq->cur + block);
+                if (res < block) {
+                    warn_file_error(res, false, ucl->local_file/*UL*/);
+                    end_upload(ucl, false, _("local error"));
+                    terminate_process(ucl); /* MSG: local error */
+                    return;
+                }
+                ucl->file_pos += res;
+            }
 
-        assert(ucl->user_sendq->cur != 0);
-        res = byteq_write(ucl->user_sendq, ucl->user_socket);
-        if (res == 0 || (res < 0 && errno != EAGAIN && errno != EINTR)) {
-            warn_socket_error(res, true, _("user"));
-            end_upload(ucl, false, _("communication error"));
-            terminate_process(ucl); /* MSG: communication error */
-            return;
+            assert(ucl->user_sendq->cur != 0);
+            block = transfer_allowance(ucl, ucl->user_sendq->cur);
+            if (block == 0)
+                return;
+            res = byteq_write_upto(ucl->user_sendq, ucl->user_socket, block);
+            if (res == 0 || (res < 0 && errno != EAGAIN && errno != EINTR)) {
+                warn_socket_error(res, true, _("user"));
+                end_upload(ucl, false, _("communication error"));
+                terminate_process(ucl); /* MSG: communication error */
+                return;
+            }
+            if (res > 0)
+                transfer_consumed(ucl, res);
+            ucl->transfer_pos += res;
+            send_user_status(ucl, ucl->file_pos - ucl->user_sendq->cur);
         }
-        ucl->transfer_pos += res;
-        send_user_status(ucl, ucl->file_pos - ucl->user_sendq->cur);
+        adapt_socket_buffers(ucl);
 
         if (ucl->file_pos == ucl->final_pos && ucl->user_sendq->cur == 0) {
-            FD_CLR(ucl->user_socket, &ucl->user_write_fds);
+            reactor_unwatch_write(ucl->reactor, ucl->user_socket);
             end_upload(ucl, true, _("transfer complete"));
             ucl->user_state = DC_USER_GET;
         }
@@ -1324,9 +2098,115 @@ user_now_writable(DCUserConnLocal *ucl)
             }
         }
         if (ucl->user_sendq->cur == 0)
-            FD_CLR(ucl->user_socket, &ucl->user_write_fds);
+            reactor_unwatch_write(ucl->reactor, ucl->user_socket);
     }
-    alarm(USER_CONN_IDLE_TIMEOUT); /* cannot fail */
+}
+
+/* The idle timer is not touched on each read and write. Instead it is
+ * rescheduled relative to the last activity when it goes off.
+ */
+static void
+check_idle_timeout(DCUserConnLocal *ucl)
+{
+    uint64_t idle = reactor_now(ucl->reactor) - ucl->last_activity;
+    uint32_t timeout = USER_CONN_IDLE_TIMEOUT;
+
+    if (ucl->user_state == DC_USER_IDLE)
+        timeout = ucl->idle_timeout;
+    if (idle >= timeout * 1000) {
+        if (ucl->user_state == DC_USER_IDLE)
+            flag_putf(DC_DF_CONNECTIONS, _("No more files to download.\n"));
+        else
+            warn(_("Idle timeout (%d seconds)\n"), timeout);
+        terminate_process(ucl); /* MSG: idle timeout msg above */
+        return;
+    }
+    reactor_timer_set(ucl->idle_timer, timeout * 1000 - idle);
+}
+
+/* Every handler called from the reactor is wrapped by these two
+ * functions. When running in the main process they make screen output
+ * go through the main process message handler, and free the connection
+ * once it has stopped running and main no longer refers to it.
+ */
+static void
+user_conn_enter(DCUserConnLocal *ucl)
+{
+    if (!ucl->in_process)
+        return;
+    assert(!ucl->busy);
+    ucl->busy = true;
+    ucl->main_writer = screen_writer;
+    screen_writer = user_screen_writer;
+    cur_ucl = ucl;
+}
+
+static void
+user_conn_leave(DCUserConnLocal *ucl)
+{
+    if (!ucl->in_process)
+        return;
+    if (!ucl->user_running && ucl->uc != NULL)
+        terminate_process(ucl); /* main releases us in response */
+    screen_writer = ucl->main_writer;
+    ucl->busy = false;
+    if (ucl->uc == NULL)
+        user_conn_local_free(ucl);
+}
+
+static void
+user_socket_readable(DCUserConnLocal *ucl)
+{
+    /* An earlier handler in the same dispatch may have ended the
+     * connection. */
+    if (!ucl->user_running)
+        return;
+    user_conn_enter(ucl);
+    user_input_available(ucl);
+    user_conn_leave(ucl);
+}
+
+static void
+user_socket_writable(DCUserConnLocal *ucl)
+{
+    if (!ucl->user_running)
+        return;
+    user_conn_enter(ucl);
+    user_now_writable(ucl);
+    user_conn_leave(ucl);
+}
+
+static void
+user_idle_timer_expired(DCUserConnLocal *ucl)
+{
+    if (!ucl->user_running)
+        return;
+    user_conn_enter(ucl);
+    check_idle_timeout(ucl);
+    user_conn_leave(ucl);
+}
+
+static void
+user_throttle_timer_expired(DCUserConnLocal *ucl)
+{
+    if (!ucl->user_running)
+        return;
+    user_conn_enter(ucl);
+    resume_transfer(ucl);
+    user_conn_leave(ucl);
+}
+
+/* Called when a message has been put for main by an in-process
+ * connection. Main handles it immediately, with its own screen writer.
+ */
+static void
+user_local_flush(DCUserConnLocal *ucl)
+{
+    ScreenWriter writer = screen_writer;
+
+    screen_writer = ucl->main_writer;
+    user_conn_dispatch(ucl->uc);
+    screen_writer = writer;
 }
 
 static void
@@ -1338,12 +2218,8 @@ signal_received(int signal)
     signal_char = signal;
     /* We don't care if this blocks - since we can't postpone this. */
     if (write(ucl->signal_pipe[1], &signal_char, sizeof(uint8_t)) < sizeof(uint8_t)) {
-        /* Die only if the signal is fatal.
-         * SIGALRM is sent when the connection has been idle too long.
-         * It will result in the connection shutting down, so if we
-         * can't deliver it we might just shut down here.
-         */
-        if (signal == SIGTERM || signal == SIGALRM)
+        /* Die only if the signal is fatal. */
+        if (signal == SIGTERM)
             die(_("Cannot write to signal pipe - %s\n"), errstr); /* die OK */
         warn(_("Cannot write to signal pipe - %s\n"), errstr);
     }
@@ -1354,6 +2230,8 @@ read_signal_input(DCUserConnLocal *ucl)
 {
     uint8_t signal;
 
+    if (!ucl->user_running)
+        return;
     /* This read is atomic since sizeof(int) < PIPE_BUF!
      * It also doesn't block since all data is already
      * available (otherwise select wouldn't tell us there
@@ -1368,69 +2246,203 @@ read_signal_input(DCUserConnLocal *ucl)
     if (signal == SIGTERM) {
         warn(_("Received TERM signal, shutting down.\n"));
         terminate_process(ucl); /* MSG: terminating by signal */
-    } else if (signal == SIGALRM) {
-        warn(_("Idle timeout (%d seconds)\n"), USER_CONN_IDLE_TIMEOUT);
-        terminate_process(ucl); /* MSG: idle timeout msg above */
     } else if (signal == SIGUSR1) {
         /* Not implemented yet, do nothing for now. */
     }
 }
 
-static void
-main_request_fd_writable(DCUserConnLocal *ucl)
-{
-    int res;
-
-    res = msgq_write(ucl->put_mq);
-    if (res <= 0) {
-        fatal_error(ucl, res, true);
-        return;
-    }
-    if (!msgq_has_partial_msg(ucl->put_mq))
-        FD_CLR(ucl->put_mq->fd, &ucl->user_write_fds);
-}
-
 static void
 main_result_fd_readable(DCUserConnLocal *ucl)
 {
     int res;
 
+    if (!ucl->user_running)
+        return;
     res = msgq_read(ucl->get_mq);
     if (res <= 0) {
         fatal_error(ucl, res, false);
         return;
     }
-    warn(_("Received unknown message from main process, shutting down process.\n"));
-    ucl->user_running = false;
+    user_cork(ucl);
+    handle_replies(ucl);
+    resume_user_input(ucl);
+    user_uncork(ucl);
 }
 
-void
-__attribute__((noreturn))
-user_main(int get_fd[2], int put_fd[2], struct sockaddr_in *addr, int sock)
+static DCUserConnLocal *
+user_conn_local_new(MsgQ *get_mq, MsgQ *put_mq)
 {
-    struct sigaction sigact;
     DCUserConnLocal *ucl;
 
-    filelist_free(our_filelist);
-
     ucl = xmalloc(sizeof(DCUserConnLocal));
-    cur_ucl = ucl; /* one per process anyway */
     ucl->user_nick = NULL;
     ucl->share_file = NULL;
     ucl->local_file = NULL;
     ucl->user_recvq_last = 0;
+    ucl->user_recvq = NULL;
+    ucl->user_sendq = NULL;
     ucl->user_socket = -1;
     ucl->transfer_fd = -1;
+    ucl->list_buffer = NULL;
+    ucl->signal_pipe[0] = -1;
+    ucl->signal_pipe[1] = -1;
     ucl->data_size = 0;     /* only useful when receiving files */
     ucl->file_pos = 0;
     ucl->final_pos = 0;
     ucl->transfer_pos = 0;
     ucl->file_size = 0;
+    ucl->zero_copy = false;
+    ucl->splice_pipe[0] = -1;
+    ucl->splice_pipe[1] = -1;
+    ucl->writeback_pos = 0;
+    ucl->dropped_pos = 0;
+    ucl->readahead_pos = 0;
+    ucl->hot_file = false;
+    ucl->bdp_sample_time = 0;
+    ucl->bdp_sample_pos = 0;
+    ucl->status_time = 0;
+    ucl->status_pos = 0;
+    ucl->status_pending = false;
+    ucl->socket_buffer_size = 0;
+    ucl->sendq_target = DEFAULT_SENDQ_SIZE;
+    ratelimit_init(&ucl->user_limit, 0);
+    ucl->throttle_timer = NULL;
+    ucl->verify = false;
+    ucl->roots = NULL;
+    ucl->roots_size = 0;
+    ucl->hash_buf = NULL;
+    ucl->leaves = false;
+    ucl->our_nick = xstrdup(my_nick);
     ucl->user_state = DC_USER_CONNECT;
+    ucl->request_id = 0;
+    ucl->reply_handler = NULL;
+    ucl->input_paused = false;
+    ucl->corked = 0;
+    ucl->we_download = false;
+    ucl->key_expected = false;
+    ucl->idle_timeout = 0;
+    ucl->upload_id = NULL;
     ucl->user_running = true;
-    ucl->get_mq = msgq_new(get_fd[0]);
-    ucl->put_mq = msgq_new(put_fd[1]);
+    ucl->get_mq = get_mq;
+    ucl->put_mq = put_mq;
     ucl->supports = ptrv_new();
+    ucl->reactor = NULL;
+    ucl->idle_timer = NULL;
+    ucl->in_process = false;
+    ucl->busy = false;
+    ucl->uc = NULL;
+    ucl->main_writer = NULL;
+    return ucl;
+}
+
+static void
+user_conn_local_free(DCUserConnLocal *ucl)
+{
+    free(ucl->local_file);
+    free(ucl->share_file);
+    free(ucl->user_nick);
+    free(ucl->our_nick);
+    free(ucl->upload_id);
+    free(ucl->roots);
+    free(ucl->hash_buf);
+    byteq_free(ucl->user_recvq);
+    byteq_free(ucl->user_sendq);
+    reactor_timer_free(ucl->idle_timer);
+    reactor_timer_free(ucl->throttle_timer);
+
+    if (ucl->transfer_fd >= 0 && close(ucl->transfer_fd) < 0)
+        warn(_("Cannot close transfer file - %s\n"), errstr); /* XXX: should print WHAT file - then remove " transfer" */
+    if (ucl->list_buffer != NULL)
+        file_list_buffer_unref(ucl->list_buffer);
+    if (ucl->splice_pipe[0] >= 0 && (close(ucl->splice_pipe[0]) < 0 || close(ucl->splice_pipe[1]) < 0))
+        warn(_("Cannot close pipe - %s\n"), errstr);
+    if (ucl->user_socket >= 0) {
+        if (ucl->reactor != NULL) {
+            reactor_unwatch_read(ucl->reactor, ucl->user_socket);
+            reactor_unwatch_write(ucl->reactor, ucl->user_socket);
+        }
+        if (close(ucl->user_socket) < 0)
+            warn(_("Cannot close user connection - %s\n"), errstr);
+    }
+    if (ucl->get_mq != NULL && ucl->get_mq->fd >= 0 && close(ucl->get_mq->fd) != 0)
+        warn(_("Cannot close pipe - %s\n"), errstr);
+    if (ucl->put_mq != NULL && ucl->put_mq->fd >= 0 && close(ucl->put_mq->fd) != 0)
+        warn(_("Cannot close pipe - %s\n"), errstr);
+
+    msgq_free(ucl->get_mq);
+    msgq_free(ucl->put_mq);
+
+    ptrv_foreach(ucl->supports, free);
+    ptrv_free(ucl->supports);
+    free(ucl);
+}
+
+/* Create or take over the user socket and start watching it in
+ * ucl->reactor. Returns false if the connection could not be set up.
+ */
+static bool
+user_conn_start(DCUserConnLocal *ucl, struct sockaddr_in *addr, int sock)
+{
+    ucl->user_recvq = byteq_new(DEFAULT_RECVQ_SIZE);
+    ucl->user_sendq = byteq_new(DEFAULT_SENDQ_SIZE);
+    ucl->dir_rand = rand() % 0x8000;
+    if (sock < 0) {
+        ucl->user_socket = socket(PF_INET, SOCK_STREAM, 0);
+        if (ucl->user_socket < 0) {
+            warn(_("Cannot create socket - %s\n"), errstr);
+            return false;
+        }
+        ucl->we_connected = true;
+    } else {
+        ucl->user_socket = sock;
+        ucl->we_connected = false;
+    }
+
+    /* Set non-blocking I/O on socket. */
+    if (!fd_set_nonblock_flag(ucl->user_socket, true)) {
+        warn(_("Cannot set non-blocking flag - %s\n"), errstr);
+        return false;
+    }
+
+    if (sock < 0) {
+        /* Connect to host, non-blocking manner. Even if connect would return
+         * success, we would catch the successful connection after select -
+         * when socket_fd is writable.
+         */
+        if (connect(ucl->user_socket, (struct sockaddr *) addr, sizeof(struct sockaddr_in)) < 0
+                && errno != EINPROGRESS) {
+            warn(_("Cannot connect - %s\n"), errstr);
+            return false;
+        }
+    }
+
+    /* The reactor calls the write handler of the user socket prior to
+     * the read handler, to detect connect() completion before any data
+     * is received and handled.
+     */
+    reactor_watch_write(ucl->reactor, ucl->user_socket, (ReactorCallback) user_socket_writable, ucl); /* will set read after connect() finishes */
+    ucl->last_activity = reactor_now(ucl->reactor);
+    ucl->idle_timer = reactor_timer_new(ucl->reactor, (ReactorCallback) user_idle_timer_expired, ucl);
+    reactor_timer_set(ucl->idle_timer, USER_CONN_IDLE_TIMEOUT * 1000);
+    ucl->throttle_timer = reactor_timer_new(ucl->reactor, (ReactorCallback) user_throttle_timer_expired, ucl);
+    return true;
+}
+
+void
+__attribute__((noreturn))
+user_main(int get_fd[2], int put_fd[2], struct sockaddr_in *addr, int sock)
+{
+    struct sigaction sigact;
+    DCUserConnLocal *ucl;
+    Reactor *reactor;
+
+    filelist_free(our_filelist);
+    /* The epoll set is shared with the main process. */
+    reactor_free(main_reactor);
+    main_reactor = NULL;
+
+    ucl = user_conn_local_new(msgq_new(get_fd[0]), msgq_new(put_fd[1]));
+    cur_ucl = ucl; /* one per process anyway */
 
     screen_writer = user_screen_writer;
 
@@ -1454,8 +2466,7 @@ user_main(int get_fd[2], int put_fd[2], struct sockaddr_in *addr, int sock)
      * must also be registered here, either with an action or as ignored.
      */
     if (sigaction(SIGTERM, &sigact, NULL) < 0
-            || sigaction(SIGUSR1, &sigact, NULL) < 0
-            || sigaction(SIGALRM, &sigact, NULL) < 0) {
+            || sigaction(SIGUSR1, &sigact, NULL) < 0) {
         warn(_("Cannot register signal handler - %s\n"), errstr);
         goto cleanup;
     }
@@ -1467,98 +2478,86 @@ user_main(int get_fd[2], int put_fd[2], struct sockaddr_in *addr, int sock)
         goto cleanup;
     }
 
-    ucl->user_recvq = byteq_new(DEFAULT_RECVQ_SIZE);
-    ucl->user_sendq = byteq_new(DEFAULT_SENDQ_SIZE);
-    ucl->dir_rand = rand() % 0x8000;
-    if (sock < 0) {
-        ucl->user_socket = socket(PF_INET, SOCK_STREAM, 0);
-        if (ucl->user_socket < 0) {
-            warn(_("Cannot create socket - %s\n"), errstr);
-            goto cleanup;
-        }
-        ucl->we_connected = true;
-    } else {
-        ucl->user_socket = sock;
-        ucl->we_connected = false;
-    }
-
-    /* Set non-blocking I/O on socket. */
-    if (!fd_set_nonblock_flag(ucl->user_socket, true)) {
-        warn(_("Cannot set non-blocking flag - %s\n"), errstr);
+    ucl->reactor = reactor_new();
+    if (ucl->reactor == NULL) {
+        warn(_("Cannot create event reactor - %s\n"), errstr);
         goto cleanup;
     }
-
-    if (sock < 0) {
-        /* Connect to host, non-blocking manner. Even if connect would return
-         * success, we would catch the successful connection after select -
-         * when socket_fd is writable.
-         */
-        if (connect(ucl->user_socket, (struct sockaddr *) addr, sizeof(struct sockaddr_in)) < 0
-                && errno != EINPROGRESS) {
-            warn(_("Cannot connect - %s\n"), errstr);
-            goto cleanup;
-        }
-    }
-
-    FD_ZERO(&ucl->user_read_fds);
-    FD_ZERO(&ucl->user_write_fds);
-    FD_SET(ucl->signal_pipe[0], &ucl->user_read_fds);
-    FD_SET(ucl->user_socket, &ucl->user_write_fds); /* will set read after connect() finishes */
-    FD_SET(ucl->get_mq->fd, &ucl->user_read_fds);
+    reactor_watch_read(ucl->reactor, ucl->signal_pipe[0], (ReactorCallback) read_signal_input, ucl);
+    reactor_watch_read(ucl->reactor, ucl->get_mq->fd, (ReactorCallback) main_result_fd_readable, ucl);
+    if (!user_conn_start(ucl, addr, sock))
+        goto cleanup;
 
     while (ucl->user_running) {
-        fd_set res_read_fds;
-        fd_set res_write_fds;
-
-        res_read_fds = ucl->user_read_fds;
-        res_write_fds = ucl->user_write_fds;
-        if (TEMP_FAILURE_RETRY(select(FD_SETSIZE, &res_read_fds, &res_write_fds, NULL, NULL)) < 0) {
-            warn(_("Cannot select - %s\n"), errstr);
+        if (TEMP_FAILURE_RETRY(reactor_dispatch(ucl->reactor, -1)) < 0) {
+            warn(_("Cannot wait for events - %s\n"), errstr);
             break;
         }
-
-        /* We must check for user writable prior to readable, to detect
-        * connect() completion before any data is received and handled.
-        */
-
-        if (ucl->user_running && FD_ISSET(ucl->signal_pipe[0], &res_read_fds))
-            read_signal_input(ucl);
-        if (ucl->user_running && FD_ISSET(ucl->put_mq->fd, &res_write_fds))
-            main_request_fd_writable(ucl);
-        if (ucl->user_running && FD_ISSET(ucl->get_mq->fd, &res_read_fds))
-            main_result_fd_readable(ucl);
-        if (ucl->user_running && FD_ISSET(ucl->user_socket, &res_write_fds))
-            user_now_writable(ucl);
-        if (ucl->user_running && FD_ISSET(ucl->user_socket, &res_read_fds))
-            user_input_available(ucl);
     }
 
 cleanup:
 
-    free(ucl->local_file);
-    free(ucl->share_file);
-    free(ucl->user_nick);
-    byteq_free(ucl->user_recvq);
-    byteq_free(ucl->user_sendq);
-
-    if (ucl->transfer_fd >= 0 && close(ucl->transfer_fd) < 0)
-        warn(_("Cannot close transfer file - %s\n"), errstr); /* XXX: should print WHAT file - then remove " transfer" */
     if (ucl->signal_pipe[0] >= 0 && close(ucl->signal_pipe[0]) < 0)
         warn(_("Cannot close signal pipe - %s\n"), errstr);
     if (ucl->signal_pipe[1] >= 0 && close(ucl->signal_pipe[1]) < 0)
         warn(_("Cannot close signal pipe - %s\n"), errstr);
-    if (ucl->get_mq != NULL && close(ucl->get_mq->fd) != 0)
-        warn(_("Cannot close pipe - %s\n"), errstr);
-    if (ucl->put_mq != NULL && close(ucl->put_mq->fd) != 0)
-        warn(_("Cannot close pipe - %s\n"), errstr);
-    if (ucl->user_socket >= 0 && close(ucl->user_socket) < 0)
-        warn(_("Cannot close user connection - %s\n"), errstr);
+    reactor = ucl->reactor;
+    user_conn_local_free(ucl);
+    reactor_free(reactor);
 
-    msgq_free(ucl->get_mq);
-    msgq_free(ucl->put_mq);
+    exit(EXIT_SUCCESS);
+}
 
-    ptrv_foreach(ucl->supports, free);
-    ptrv_free(ucl->supports);
+/* Start a user connection in the main process, driven by main_reactor.
+ * Messages for main are put on uc->get_mq and handled right away, and
+ * replies are picked up from uc->put_mq. Returns false if the connection
+ * could not be set up, in which case uc has been disconnected already.
+ */
+bool
+user_local_start(DCUserConn *uc, struct sockaddr_in *addr, int sock)
+{
+    DCUserConnLocal *ucl;
+    bool started;
+
+    ucl = user_conn_local_new(uc->put_mq, uc->get_mq);
+    ucl->in_process = true;
+    ucl->uc = uc;
+    ucl->reactor = main_reactor;
+    msgq_set_flush(ucl->put_mq, (MsgQFlushCallback) user_local_flush, ucl);
+    uc->local = ucl;
+
+    user_conn_enter(ucl);
+    started = user_conn_start(ucl, addr, sock);
+    if (!started)
+        ucl->user_running = false;
+    user_conn_leave(ucl);
+    return started;
+}
 
-    exit(EXIT_SUCCESS);
+/* Called by main when it has put a reply for an in-process connection
+ * other than in response to one of its messages.
+ */
+void
+user_local_replied(DCUserConnLocal *ucl)
+{
+    user_conn_enter(ucl);
+    user_cork(ucl);
+    handle_replies(ucl);
+    resume_user_input(ucl);
+    user_uncork(ucl);
+    user_conn_leave(ucl);
+}
+
+/* Called by main when it disconnects an in-process connection. The
+ * message queues are handed over to the connection, which is freed
+ * as soon as none of its handlers are running.
+ */
+void
+user_local_release(DCUserConnLocal *ucl)
+{
+    msgq_set_flush(ucl->put_mq, NULL, NULL);
+    ucl->uc = NULL;
+    ucl->user_running = false;
+    if (!ucl->busy)
+        user_conn_local_free(ucl);
 }
@@ -89,14 +89,24 @@ static void var_set_display_flags(DCVariable *var, int argc, char **argv);
 static void var_set_log_file(DCVariable *var, int argc, char **argv);
 static char *var_get_time(DCVariable *var);
 static void var_set_filelist_refresh_interval(DCVariable *var, int argc, char **argv);
+static void var_set_hash_idle_io(DCVariable *var, int argc, char **argv);
+static void var_set_hash_sidecars(DCVariable *var, int argc, char **argv);
+static void var_set_hash_workers(DCVariable *var, int argc, char **argv);
 static char *var_get_user_sort_order(DCVariable *var);
 static void var_set_user_sort_order(DCVariable *var, int argc, char **argv);
+static char *var_get_transfer_engine(DCVariable *var);
+static void var_set_transfer_engine(DCVariable *var, int argc, char **argv);
+static void var_set_rate_limit(DCVariable *var, int argc, char **argv);
+static char *var_get_uint32(DCVariable *var);
+static void var_set_uint32(DCVariable *var, int argc, char **argv);
+static void var_set_idle_connections(DCVariable *var, int argc, char **argv);
 
 static void speed_completion_generator(DCCompletionInfo *ci);
 static void bool_completion_generator(DCCompletionInfo *ci);
 static void variable_completion_generator(DCCompletionInfo *ci);
 static void display_completion_generator(DCCompletionInfo *ci);
 static void charset_completion_generator(DCCompletionInfo *ci);
+static void transfer_engine_completion_generator(DCCompletionInfo *ci);
 
 typedef struct {
     DCDisplayFlag flag;
@@ -127,6 +137,13 @@ uint32_t log_flags = ~(DC_DF_DEBUG);
 struct in_addr force_remote_addr = { INADDR_NONE };
 struct in_addr force_listen_addr = { INADDR_NONE };
 DCUserSortType user_sort_order = DC_SORT_NAME|DC_SORT_ASC;
+DCTransferEngine transfer_engine = DC_ENGINE_PROCESS;
+uint32_t upload_limit = 0;	/* KiB/s, 0 for unlimited */
+uint32_t download_limit = 0;
+uint32_t user_upload_limit = 0;
+uint32_t user_download_limit = 0;
+uint32_t idle_connections = 4;	/* download connections kept open when done */
+uint32_t idle_connection_timeout = 60;
 
 /* This list must be sorted according to strcmp. */
 DCDisplayFlagDetails display_flag_details[] =  {
@@ -154,6 +171,13 @@ static char *speeds[] = {
 };
 static const int speeds_count = sizeof(speeds)/sizeof(*speeds);
 
+/* Indexed by DCTransferEngine. */
+static char *transfer_engines[] = {
+    "process",
+    "reactor",
+};
+static const int transfer_engines_count = sizeof(transfer_engines)/sizeof(*transfer_engines);
+
 /* This structure must be sorted by variable name, according to strcmp. */
 static DCVariable variables[] = {
     {
@@ -184,6 +208,13 @@ static DCVariable variables[] = {
         NULL,
         "Types of messages to display on screen"
     },
+    {
+        "download_limit",
+        var_get_uint32, var_set_rate_limit, &download_limit,
+        NULL,
+        NULL,
+        "Maximum total download rate in KiB/s (0 for unlimited)"
+    },
     {
         "downloaddir",
         var_get_string, var_set_download_dir, &download_dir,
@@ -212,6 +243,27 @@ static DCVariable variables[] = {
         NULL,
         "Local filesystem charset (if it differs from local charset)"
     },
+    {
+        "hash_idle_io",
+        var_get_bool, var_set_hash_idle_io, &hash_idle_io,
+        bool_completion_generator,
+        NULL,
+        "Read shared files for hashing only when no other process uses the disk"
+    },
+    {
+        "hash_sidecars",
+        var_get_bool, var_set_hash_sidecars, &hash_sidecars,
+        bool_completion_generator,
+        NULL,
+        "Save the hashes of shared files in .microdc_tth directories next to them, as tthsum --sidecar does"
+    },
+    {
+        "hash_workers",
+        var_get_uint32, var_set_hash_workers, &hash_workers,
+        NULL,
+        NULL,
+        "Maximum number of processes hashing shared files, at most one per disk"
+    },
     {
         "hub_charset",
         var_get_string, var_set_hub_charset, &hub_charset,
@@ -219,6 +271,20 @@ static DCVariable variables[] = {
         NULL,
         "Character set used for chat on the hub"
     },
+    {
+        "idle_connection_timeout",
+        var_get_uint32, var_set_uint32, &idle_connection_timeout,
+        NULL,
+        NULL,
+        "Seconds to keep an idle download connection open for more files"
+    },
+    {
+        "idle_connections",
+        var_get_uint32, var_set_idle_connections, &idle_connections,
+        NULL,
+        NULL,
+        "Maximum number of idle download connections kept open (0 to close them)"
+    },
     {
         "listenaddr",
         var_get_listen_addr, var_set_listen_addr, &force_listen_addr,
@@ -312,6 +378,34 @@ static DCVariable variables[] = {
         NULL,
         "The user agent tag the hub uses to detect features"
     },
+    {
+        "transfer_engine",
+        var_get_transfer_engine, var_set_transfer_engine, &transfer_engine,
+        transfer_engine_completion_generator,
+        NULL,
+        "Run new user connections in a separate `process' each, or in the main `reactor'"
+    },
+    {
+        "upload_limit",
+        var_get_uint32, var_set_rate_limit, &upload_limit,
+        NULL,
+        NULL,
+        "Maximum total upload rate in KiB/s (0 for unlimited)"
+    },
+    {
+        "user_download_limit",
+        var_get_uint32, var_set_rate_limit, &user_download_limit,
+        NULL,
+        NULL,
+        "Maximum download rate from each user in KiB/s (0 for unlimited)"
+    },
+    {
+        "user_upload_limit",
+        var_get_uint32, var_set_rate_limit, &user_upload_limit,
+        NULL,
+        NULL,
+        "Maximum upload rate to each user in KiB/s (0 for unlimited)"
+    },
     {
         "usersortorder",
         var_get_user_sort_order, var_set_user_sort_order, &user_sort_order,
@@ -518,6 +612,51 @@ var_get_slots(DCVariable *var)
     return xstrdup(uint32_str(my_ul_slots));
 }
 
+static void
+var_set_rate_limit(DCVariable *var, int argc, char **argv)
+{
+    if (argc > 2) {
+        warn(_("too many arguments\n"));
+        return;
+    }
+    if (!parse_uint32(argv[1], var->value)) {
+        screen_putf(_("Invalid rate limit `%s'\n"), quotearg(argv[1]));
+        return;
+    }
+    update_transfer_limits();
+}
+
+static void
+var_set_uint32(DCVariable *var, int argc, char **argv)
+{
+    if (argc > 2) {
+        warn(_("too many arguments\n"));
+        return;
+    }
+    if (!parse_uint32(argv[1], var->value))
+        screen_putf(_("Invalid value `%s'\n"), quotearg(argv[1]));
+}
+
+static void
+var_set_idle_connections(DCVariable *var, int argc, char **argv)
+{
+    if (argc > 2) {
+        warn(_("too many arguments\n"));
+        return;
+    }
+    if (!parse_uint32(argv[1], &idle_connections)) {
+        screen_putf(_("Invalid value `%s'\n"), quotearg(argv[1]));
+        return;
+    }
+    user_conn_trim_idle();
+}
+
+static char *
+var_get_uint32(DCVariable *var)
+{
+    return xstrdup(uint32_str(*(uint32_t *) var->value));
+}
+
 /* Improve: return string position or word index in csv where value was found
  * XXX: move to strutil.c or something. Also on gmediaserver!
  */
@@ -612,6 +751,7 @@ var_set_auto_reconnect(DCVariable *var, int argc, char **argv)
         return;/*false*/
     }
     auto_reconnect = state;
+    schedule_hub_activity_check();
 }
 
 static char *
@@ -876,6 +1016,57 @@ var_set_filelist_refresh_interval(DCVariable *var, int argc, char **argv)
     update_request_set_filelist_refresh_timeout(filelist_refresh_timeout);
 }
 
+static void
+var_set_hash_idle_io(DCVariable *var, int argc, char **argv)
+{
+    bool state;
+
+    if (argc > 2) {
+        warn(_("too many arguments\n"));
+        return;
+    }
+    if (!parse_bool(argv[1], &state)) {
+        screen_putf(_("Specify value as `0', `no', `off', `1', `yes', or `on'.\n"));
+        return;
+    }
+    hash_idle_io = state;
+    update_request_set_hash_idle_io(hash_idle_io);
+}
+
+static void
+var_set_hash_sidecars(DCVariable *var, int argc, char **argv)
+{
+    bool state;
+
+    if (argc > 2) {
+        warn(_("too many arguments\n"));
+        return;
+    }
+    if (!parse_bool(argv[1], &state)) {
+        screen_putf(_("Specify value as `0', `no', `off', `1', `yes', or `on'.\n"));
+        return;
+    }
+    hash_sidecars = state;
+    update_request_set_hash_sidecars(hash_sidecars);
+}
+
+static void
+var_set_hash_workers(DCVariable *var, int argc, char **argv)
+{
+    uint32_t count;
+
+    if (argc > 2) {
+        warn(_("too many arguments\n"));
+        return;
+    }
+    if (!parse_uint32(argv[1], &count) || count == 0) {
+        screen_putf(_("Invalid value `%s' for number of workers.\n"), quotearg(argv[1]));
+        return;
+    }
+    hash_workers = count;
+    update_request_set_hash_workers(hash_workers);
+}
+
 static char *var_get_user_sort_order(DCVariable *var) {
     const char *sort_criteria[] = {
         "name",
@@ -924,6 +1115,31 @@ static void var_set_user_sort_order(DCVariable *var, int argc, char **argv) {
     }
 }
 
+static char *
+var_get_transfer_engine(DCVariable *var)
+{
+    return xstrdup(transfer_engines[transfer_engine]);
+}
+
+static void
+var_set_transfer_engine(DCVariable *var, int argc, char **argv)
+{
+    int c;
+
+    if (argc > 2) {
+        warn(_("too many arguments\n"));
+        return;
+    }
+    for (c = 0; c < transfer_engines_count; c++) {
+        if (strcmp(argv[1], transfer_engines[c]) == 0) {
+            /* Existing connections keep running where they were started. */
+            transfer_engine = c;
+            return;
+        }
+    }
+    screen_putf(_("Specify transfer_engine as `process' or `reactor'.\n"));
+}
+
 /* The following completers could be improved by doing a modified
  * binsearch for the first match, then stopping immediately when a
  * non-match is found.
@@ -946,6 +1162,17 @@ speed_completion_generator(DCCompletionInfo *ci)
     }
 }
 
+static void
+transfer_engine_completion_generator(DCCompletionInfo *ci)
+{
+    int c;
+
+    for (c = 0; c < transfer_engines_count; c++) {
+        if (strleftcmp(ci->word, transfer_engines[c]) == 0)
+            ptrv_append(ci->results, new_completion_entry(transfer_engines[c], NULL));
+    }
+}
+
 static void
 display_completion_generator(DCCompletionInfo *ci)
 {